@@ -1,6 +1,12 @@
 
 #include "fs.h"
 
+struct BcStat bc_stat;
+
+// The disk driver, IDE unless fs_init finds a virtio-blk disk
+int (*disk_read)(uint32_t secno, void *dst, size_t nsecs)        = ide_read;
+int (*disk_write)(uint32_t secno, const void *src, size_t nsecs) = ide_write;
+
 // Return the virtual address of this disk block.
 void *
 diskaddr(uint32_t blockno) {
@@ -20,10 +26,243 @@ va_is_mapped(void *va) {
           (uvpd[VPD(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P));
 }
 
-// Is this virtual address dirty?
+// Is this virtual address dirty?  Clients write the blocks that are
+// shared with their mmap()s through their own mappings, whose dirty
+// bits we can't see; they harvest them and tell us with FSREQ_MSYNC
+// on msync(), munmap(), sync() and exit (see file_msync).
 bool
 va_is_dirty(void *va) {
-  return (uvpt[PGNUM(va)] & PTE_D) != 0;
+  return uvpt[PGNUM(va)] & (PTE_D | PTE_BC_DIRTY);
+}
+
+// The dirty set: blocks known to be dirty, as a bitmap to look them up
+// and as a list, in the order they became dirty, to walk them.  Writes
+// through a block's mapping only set PTE_D; bc_scan finds those.  A
+// block that is written out leaves the bitmap at once but stays on the
+// list until the list is next compacted, so bc_onlist keeps it from
+// being listed twice.
+static uint32_t bc_dirtymap[DISKSIZE / BLKSIZE / 32];
+static uint32_t bc_onlist[DISKSIZE / BLKSIZE / 32];
+#define BC_DIRTYLIST (2 * BC_NBLOCKS)
+static uint32_t bc_dirtylist[BC_DIRTYLIST];
+static uint32_t bc_ndirtylist;
+
+// Drop the blocks that are no longer dirty from the dirty list.
+static void
+bc_compact(void) {
+  uint32_t i, n = 0, b;
+
+  for (i = 0; i < bc_ndirtylist; i++) {
+    b = bc_dirtylist[i];
+    if (bc_dirtymap[b / 32] & (1U << (b % 32)))
+      bc_dirtylist[n++] = b;
+    else
+      bc_onlist[b / 32] &= ~(1U << (b % 32));
+  }
+  bc_ndirtylist = n;
+}
+
+// Add block blockno to the dirty set.
+void
+bc_set_dirty(uint32_t blockno) {
+  bc_dirtymap[blockno / 32] |= 1U << (blockno % 32);
+  if (bc_onlist[blockno / 32] & (1U << (blockno % 32)))
+    return;
+  if (bc_ndirtylist == BC_DIRTYLIST)
+    bc_compact();
+  // Only cached blocks are dirty, and the cache holds BC_NBLOCKS.
+  assert(bc_ndirtylist < BC_DIRTYLIST);
+  bc_dirtylist[bc_ndirtylist++] = blockno;
+  bc_onlist[blockno / 32] |= 1U << (blockno % 32);
+}
+
+// Take block blockno out of the dirty set, after writing it out.
+static void
+bc_set_clean(uint32_t blockno) {
+  bc_dirtymap[blockno / 32] &= ~(1U << (blockno % 32));
+}
+
+// Mark the block-cache page at this mapped virtual address dirty,
+// for writes that did not go through its mapping.
+void
+va_set_dirty(void *va) {
+  int r;
+
+  va = ROUNDDOWN(va, PGSIZE);
+  if ((r = sys_page_map(0, va, 0, va, (uvpt[PGNUM(va)] & PTE_SYSCALL) | PTE_BC_DIRTY)) < 0)
+    panic("va_set_dirty: sys_page_map: %i", r);
+  bc_set_dirty(((uintptr_t)va - DISKMAP) / BLKSIZE);
+}
+
+// Blocks in the cache, in the order the CLOCK hand visits them.  A
+// block stays in its slot until it is evicted, even if something else
+// unmapped it meanwhile; such a slot is taken over without evicting.
+static uint32_t bc_clock[BC_NBLOCKS];
+static uint32_t bc_nclock; // slots in use
+static uint32_t bc_hand;   // slot the hand looks at next
+// Blocks that have a slot in bc_clock
+static uint32_t bc_inclock[DISKSIZE / BLKSIZE / 32];
+// When bc_writeback first saw the block in each slot dirty, 0 if not
+static int bc_dirty_since[BC_NBLOCKS];
+
+// Pinned blocks are never evicted: the superblock and the bitmap,
+// which super and bitmap point to.
+static bool
+bc_pinned(uint32_t blockno) {
+  return blockno < 2 || !super ||
+         blockno < 2 + (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
+}
+
+// Number of blocks shared writable with mmap()s
+static uint32_t bc_nshared;
+
+// Share the block-cache page at va, which is mapped, writable with
+// mmap()s.  It stays in the cache until no client maps it any more.
+// Returns 0 on success, or -E_NO_MEM if BC_SHARED_MAX blocks are
+// shared already, so that the cache always has blocks it can evict.
+int
+bc_share(void *va) {
+  int r;
+
+  if (uvpt[PGNUM(va)] & PTE_SHARE)
+    return 0;
+  if (bc_nshared >= BC_SHARED_MAX)
+    return -E_NO_MEM;
+  if ((r = sys_page_map(0, va, 0, va, (uvpt[PGNUM(va)] & PTE_SYSCALL) | PTE_SHARE)) < 0)
+    return r;
+  bc_nshared++;
+  return 0;
+}
+
+// Whether block blockno is cached and shared writable with mmap()s.
+// Once the last client has unmapped it, it stops being shared and is
+// marked dirty once, for writes of a client that went away without
+// msync().
+static bool
+bc_shared(uint32_t blockno) {
+  void *va = (void *)(uintptr_t)(DISKMAP + blockno * BLKSIZE);
+  int r;
+
+  if (!va_is_mapped(va) || !(uvpt[PGNUM(va)] & PTE_SHARE))
+    return 0;
+  if (pageref(va) > 1)
+    return 1;
+  if ((r = sys_page_map(0, va, 0, va, (uvpt[PGNUM(va)] & PTE_SYSCALL & ~PTE_SHARE) | PTE_BC_DIRTY)) < 0)
+    panic("bc_shared: sys_page_map: %i", r);
+  bc_set_dirty(blockno);
+  bc_nshared--;
+  return 0;
+}
+
+// Move the CLOCK hand to a slot whose block may go, and evict that
+// block: write it out if it is dirty, then unmap it.  Blocks that were
+// used since the hand last came by lose their accessed bit instead.
+// Pinned blocks, and blocks shared writable with mmap()s, stay.
+// Returns the slot, or -E_NO_MEM if no block can go.
+static int
+bc_evict(void) {
+  uint32_t slot, blockno, n;
+  void *va;
+  int r;
+
+  for (n = 0; n < 3 * bc_nclock; n++) {
+    slot    = bc_hand;
+    bc_hand = (bc_hand + 1) % bc_nclock;
+    blockno = bc_clock[slot];
+    va      = (void *)(uintptr_t)(DISKMAP + blockno * BLKSIZE);
+    if (!va_is_mapped(va))
+      goto out;
+    if (bc_pinned(blockno) || bc_shared(blockno))
+      continue;
+    if (uvpt[PGNUM(va)] & PTE_A) {
+      if ((r = sys_page_harvest(va, 1, NULL, PTE_A | HARVEST_CLEAR)) < 0)
+        panic("bc_evict: sys_page_harvest: %i", r);
+      continue;
+    }
+    flush_block(va);
+    if ((r = sys_page_unmap(0, va)) < 0)
+      panic("bc_evict: sys_page_unmap: %i", r);
+    bc_stat.bs_evictions++;
+    goto out;
+  }
+  return -E_NO_MEM;
+
+out:
+  bc_inclock[blockno / 32] &= ~(1U << (blockno % 32));
+  bc_set_clean(blockno);
+  bc_dirty_since[slot] = 0;
+  return slot;
+}
+
+// Note that block blockno is in the cache now, evicting another
+// block if the cache is full.
+// Returns 0 on success, or -E_NO_MEM if no block can be evicted.
+int
+bc_track(uint32_t blockno) {
+  int slot;
+
+  if (bc_inclock[blockno / 32] & (1U << (blockno % 32)))
+    return 0;
+  if ((slot = bc_nclock < BC_NBLOCKS ? bc_nclock++ : bc_evict()) < 0)
+    return slot;
+  bc_clock[slot] = blockno;
+  bc_inclock[blockno / 32] |= 1U << (blockno % 32);
+  return 0;
+}
+
+// Read the nblocks blocks from blockno on, none of which may be in
+// the cache, into the cache with a single disk_read.  Blocks that no
+// room can be made for are dropped again.
+// Returns 0 on success, or -E_NO_MEM if there was no room for blockno.
+static int
+bc_read(uint32_t blockno, uint32_t nblocks) {
+  void *addr = (void *)(uintptr_t)(DISKMAP + blockno * BLKSIZE);
+  uint32_t i, j;
+  int r;
+
+  assert(nblocks <= BC_RA_MAX);
+  for (i = 0; i < nblocks; i++)
+    if ((r = sys_page_alloc(0, addr + i * BLKSIZE, PTE_W)) < 0)
+      panic("bc_read: sys_page_alloc: %i", r);
+  if ((r = disk_read(blockno * BLKSECTS, addr, nblocks * BLKSECTS)) < 0)
+    panic("bc_read: disk_read: %i", r);
+
+  // Clear the dirty bits of the pages, since we just read the
+  // blocks from disk, and the accessed bits of the ones read ahead
+  if ((r = sys_page_harvest(addr, nblocks, NULL, PTE_A | PTE_D | HARVEST_CLEAR)) < 0)
+    panic("bc_read: sys_page_harvest: %i", r);
+
+  for (i = 0; i < nblocks; i++)
+    if ((r = bc_track(blockno + i)) < 0)
+      break;
+  for (j = i; j < nblocks; j++)
+    sys_page_unmap(0, addr + j * BLKSIZE);
+  return i ? 0 : r;
+}
+
+// Bring block blockno, which is about to be used, into the cache
+// together with up to nblocks - 1 blocks after it, which the caller
+// expects to be used soon.  The blocks have to be in use.  Reading
+// ahead stops at the first block that is already in the cache.
+// Returns 0 on success, or -E_NO_MEM if there was no room for blockno.
+int
+bc_readahead(uint32_t blockno, uint32_t nblocks) {
+  uint32_t n;
+
+  if (super && blockno + nblocks > super->s_nblocks)
+    nblocks = super->s_nblocks - blockno;
+  nblocks = MIN(nblocks, BC_RA_MAX);
+  if (va_is_mapped(diskaddr(blockno)))
+    return 0;
+  for (n = 1; n < nblocks && !va_is_mapped(diskaddr(blockno + n)); n++)
+    /* do nothing */;
+
+  bc_stat.bs_misses++;
+  if (n > 1) {
+    bc_stat.bs_ra_blocks += n - 1;
+    bc_stat.bs_ra_reads++;
+  }
+  return bc_read(blockno, n);
 }
 
 // Fault any disk block that is read in to memory by
@@ -32,6 +271,7 @@ static void
 bc_pgfault(struct UTrapframe *utf) {
   void *addr       = (void *)utf->utf_fault_va;
   uint32_t blockno = (uint32_t)((uintptr_t)addr - (uintptr_t)DISKMAP) / BLKSIZE;
+  int r;
 
   // Check that the fault was within the block cache region
   if (addr < (void *)DISKMAP || addr >= (void *)(DISKMAP + DISKSIZE))
@@ -49,20 +289,11 @@ bc_pgfault(struct UTrapframe *utf) {
   //
   // LAB 10: Your code here.
 
-  int r;
-  addr = ROUNDDOWN(addr, PGSIZE);
-	if ((r = sys_page_alloc(0, addr, PTE_W)) < 0) {
-		panic("bc_pgfault: sys_page_alloc: %i", r);
-  }
-	if ((r = ide_read(blockno * BLKSECTS, addr, BLKSECTS)) < 0) {
-		panic("bc_pgfault: ide_read: %i", r);
-  }
-
-  // Clear the dirty bit for the disk block page since we just read the
-	// block from disk
-	if ((r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0) { // для последующей откачки
-		panic("in bc_pgfault, sys_page_map: %i", r);
-  }
+  // There is always room, since only BC_SHARED_MAX blocks can be
+  // kept from being evicted.
+  bc_stat.bs_misses++;
+  if ((r = bc_read(blockno, 1)) < 0)
+    panic("bc_pgfault: bc_read: %i", r);
 
 	if (bitmap && block_is_free(blockno)) {
 		panic("reading free block %08x\n", blockno);
@@ -70,11 +301,11 @@ bc_pgfault(struct UTrapframe *utf) {
 }
 
 // Flush the contents of the block containing VA out to disk if
-// necessary, then clear the PTE_D bit using sys_page_map.
+// necessary, then clear its PTE_D and PTE_BC_DIRTY bits with
+// sys_page_harvest, which leaves the mapping alone.
 // If the block is not in the block cache or is not dirty, does
 // nothing.
-// Hint: Use va_is_mapped, va_is_dirty, and ide_write.
-// Hint: Use the PTE_SYSCALL constant when calling sys_page_map.
+// Hint: Use va_is_mapped, va_is_dirty, and disk_write.
 // Hint: Don't forget to round addr down.
 void
 flush_block(void *addr) {
@@ -93,12 +324,148 @@ flush_block(void *addr) {
   }
 
   int r;
-  if ((r = ide_write(blockno * BLKSECTS, addr, BLKSECTS)) < 0) {
-		panic("flush_block: ide_write: %i", r);
+  if ((r = disk_write(blockno * BLKSECTS, addr, BLKSECTS)) < 0) {
+		panic("flush_block: disk_write: %i", r);
+    }
+	if ((r = sys_page_harvest(addr, 1, NULL, PTE_D | PTE_BC_DIRTY | HARVEST_CLEAR)) < 0) {
+		panic("flush_block: sys_page_harvest: %i", r);
+    }
+  bc_set_clean(blockno);
+}
+
+// Sort the n block numbers in a, by Shell sort.
+static void
+bc_sort(uint32_t *a, uint32_t n) {
+  uint32_t gap, i, j, t;
+
+  for (gap = n / 2; gap > 0; gap /= 2)
+    for (i = gap; i < n; i++) {
+      t = a[i];
+      for (j = i; j >= gap && a[j - gap] > t; j -= gap)
+        a[j] = a[j - gap];
+      a[j] = t;
+    }
+}
+
+// Write the n dirty blocks in 'blocks', sorted, to disk, each run of
+// consecutive blocks in one disk_write, and then mark them clean.
+static void
+bc_write_runs(uint32_t *blocks, uint32_t n) {
+  uint32_t i, j, k;
+  void *va;
+  int r;
+
+  for (i = 0; i < n; i = j) {
+    for (j = i + 1; j < n && j - i < BC_WB_MAXRUN && blocks[j] == blocks[j - 1] + 1; j++)
+      /* do nothing */;
+    va = diskaddr(blocks[i]);
+    if ((r = disk_write(blocks[i] * BLKSECTS, va, (j - i) * BLKSECTS)) < 0)
+      panic("bc_write_runs: disk_write: %i", r);
+    if ((r = sys_page_harvest(va, j - i, NULL, PTE_D | PTE_BC_DIRTY | HARVEST_CLEAR)) < 0)
+      panic("bc_write_runs: sys_page_harvest: %i", r);
+    for (k = i; k < j; k++)
+      bc_set_clean(blocks[k]);
+  }
+}
+
+// Add the cached blocks that were written through their mappings
+// since the last look to the dirty set.  One sys_page_harvest finds
+// them, skipping the unmapped parts of the disk a page table at a time.
+// Blocks no client maps any more stop being shared first.
+static void
+bc_scan(void) {
+  static uint64_t dirty[DISKSIZE / BLKSIZE / 64];
+  uint32_t i;
+  uint64_t w;
+  int r;
+
+  for (i = 0; i < bc_nclock; i++)
+    bc_shared(bc_clock[i]);
+
+  if ((r = sys_page_harvest((void *)DISKMAP, super->s_nblocks, dirty, PTE_D | PTE_BC_DIRTY)) < 0)
+    panic("bc_scan: sys_page_harvest: %i", r);
+  for (i = 0; r > 0 && i < (super->s_nblocks + 63) / 64; i++)
+    for (w = dirty[i]; w; w &= w - 1)
+      bc_set_dirty(i * 64 + __builtin_ctzll(w));
+}
+
+// Write out the dirty blocks among the 'nwhich' distinct ones in
+// 'which', or all of them if 'which' is NULL, in order and coalesced
+// into multi-block writes.
+void
+bc_sync(const uint32_t *which, uint32_t nwhich) {
+  static uint32_t blocks[BC_DIRTYLIST];
+  uint32_t i, n = 0, b;
+  void *va;
+
+  bc_scan();
+  if (!which) {
+    which  = bc_dirtylist;
+    nwhich = bc_ndirtylist;
+  }
+  assert(nwhich <= BC_DIRTYLIST);
+  for (i = 0; i < nwhich; i++) {
+    b = which[i];
+    if (!(bc_dirtymap[b / 32] & (1U << (b % 32))))
+      continue;
+    va = (void *)(uintptr_t)(DISKMAP + b * BLKSIZE);
+    if (!va_is_mapped(va) || !va_is_dirty(va))
+      bc_set_clean(b);
+    else
+      blocks[n++] = b;
+  }
+  bc_sort(blocks, n);
+  bc_write_runs(blocks, n);
+  bc_compact();
+}
+
+// Write dirty blocks back in the background.  At most once every
+// BC_WB_INTERVAL seconds, look for dirty blocks in the cache and note
+// when each was first seen dirty.  If the server is 'idle', write the
+// ones that have been dirty for BC_DIRTY_AGE seconds; if more than
+// 1/BC_DIRTY_RATIO of the cache is dirty, write them all right away.
+// Blocks go out in order, coalesced into multi-block writes.
+// Returns whether dirty blocks may be left for a later call.
+bool
+bc_writeback(bool idle) {
+  static uint32_t blocks[BC_NBLOCKS];
+  static int last;
+  uint32_t slot, ndirty = 0, n = 0;
+  int now = vsys_gettime(), expired;
+  void *va;
+
+  if (now - last < BC_WB_INTERVAL)
+    return 1;
+  last = now;
+
+  for (slot = 0; slot < bc_nclock; slot++) {
+    bc_shared(bc_clock[slot]);
+    va = (void *)(uintptr_t)(DISKMAP + bc_clock[slot] * BLKSIZE);
+    if (!va_is_mapped(va) || !va_is_dirty(va)) {
+      bc_dirty_since[slot] = 0;
+      continue;
     }
-	if ((r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0) {
-		panic("flush_block: sys_page_map: %i", r);
+    bc_set_dirty(bc_clock[slot]);
+    if (!bc_dirty_since[slot])
+      bc_dirty_since[slot] = now;
+    ndirty++;
+  }
+
+  if (ndirty > BC_NBLOCKS / BC_DIRTY_RATIO)
+    expired = now;
+  else if (idle)
+    expired = now - BC_DIRTY_AGE;
+  else
+    return ndirty > 0;
+
+  for (slot = 0; slot < bc_nclock; slot++)
+    if (bc_dirty_since[slot] && bc_dirty_since[slot] <= expired) {
+      blocks[n++]          = bc_clock[slot];
+      bc_dirty_since[slot] = 0;
     }
+  bc_sort(blocks, n);
+  bc_write_runs(blocks, n);
+  return ndirty > n;
 }
 
 // Test that the block cache works, by smashing the superblock and
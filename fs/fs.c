@@ -42,41 +42,124 @@ block_is_free(uint32_t blockno) {
   return 0;
 }
 
+// Free blocks in each bitmap block, so that the allocator can skip
+// full ones.  Kept up to date by free_block and claim_block.
+static uint32_t bitmap_nfree[DISKSIZE / BLKSIZE / BLKBITSIZE];
+// Where the allocator looks for free blocks next: after the last
+// blocks it handed out.
+static uint32_t alloc_hint;
+// Most runs of free blocks alloc_blocks looks at for n in a row, so
+// that a fragmented disk doesn't cost a scan of the whole bitmap.
+#define ALLOC_MAXRUNS 64
+
 // Mark a block free in the bitmap
 void
 free_block(uint32_t blockno) {
   // Blockno zero is the null pointer of block numbers.
   if (blockno == 0)
     panic("attempt to free zero block");
+  if (!(bitmap[blockno / 32] & (1U << (blockno % 32))))
+    bitmap_nfree[blockno / BLKBITSIZE]++;
   bitmap[blockno / 32] |= 1U << (blockno % 32);
 }
 
-// Search the bitmap for a free block and allocate it.  When you
-// allocate a block, immediately flush the changed bitmap block
-// to disk.
+// Mark a free block in use in the bitmap.
+void
+claim_block(uint32_t blockno) {
+  assert(block_is_free(blockno));
+  bitmap[blockno / 32] &= ~(1U << (blockno % 32));
+  bitmap_nfree[blockno / BLKBITSIZE]--;
+}
+
+// Count the free blocks in each bitmap block.  The bits past the
+// last block of the disk don't count.
+static void
+bitmap_count(void) {
+  const uint64_t *words = (const uint64_t *)bitmap;
+  uint32_t i, nwords = (super->s_nblocks + 63) / 64;
+  uint64_t w;
+
+  memset(bitmap_nfree, 0, sizeof(bitmap_nfree));
+  for (i = 0; i < nwords; i++) {
+    w = words[i];
+    if (i == nwords - 1 && super->s_nblocks % 64)
+      w &= (1ULL << (super->s_nblocks % 64)) - 1;
+    bitmap_nfree[i * 64 / BLKBITSIZE] += __builtin_popcountll(w);
+  }
+}
+
+// Find the first free block in [from, end), 64 bits at a time, and
+// skipping bitmap blocks with no free blocks.  Returns end if there
+// is none.
+static uint32_t
+bitmap_find_free(uint32_t from, uint32_t end) {
+  const uint64_t *words = (const uint64_t *)bitmap;
+  uint64_t w;
+
+  while (from < end) {
+    if (!bitmap_nfree[from / BLKBITSIZE]) {
+      from = ROUNDDOWN(from, BLKBITSIZE) + BLKBITSIZE;
+      continue;
+    }
+    w = words[from / 64] & (~0ULL << (from % 64));
+    if (w)
+      return MIN(ROUNDDOWN(from, 64) + __builtin_ctzll(w), end);
+    from = ROUNDDOWN(from, 64) + 64;
+  }
+  return end;
+}
+
+// Allocate up to n free blocks in a row, preferably n, looking from
+// where the last allocation ended.  If none of the first ALLOC_MAXRUNS
+// runs of free blocks is n long, take the longest of them.  The
+// changed bitmap blocks are left dirty in the block cache, for the
+// next sync or write-back to pick up.
+//
+// Returns the first block number and sets *nalloc to the number of
+// blocks on success, -E_NO_DISK if we are out of blocks.
+int
+alloc_blocks(uint32_t n, uint32_t *nalloc) {
+  uint32_t from, end, b, len, best = 0, bestlen = 0, pass, nruns = 0;
+
+  assert(n > 0);
+  for (pass = 0; pass < 2 && nruns < ALLOC_MAXRUNS; pass++) {
+    from = pass ? 0 : alloc_hint;
+    end  = pass ? alloc_hint : super->s_nblocks;
+    while (nruns < ALLOC_MAXRUNS && (b = bitmap_find_free(from, end)) < end) {
+      for (len = 1; len < n && block_is_free(b + len); len++)
+        /* do nothing */;
+      if (len == n)
+        goto found;
+      if (len > bestlen) {
+        best    = b;
+        bestlen = len;
+      }
+      from = b + len;
+      nruns++;
+    }
+  }
+  if (!bestlen)
+    return -E_NO_DISK;
+  b   = best;
+  len = bestlen;
+
+found:
+  for (from = b; from < b + len; from++)
+    claim_block(from);
+  alloc_hint = b + len < super->s_nblocks ? b + len : 0;
+  *nalloc    = len;
+  return b;
+}
+
+// Search the bitmap for a free block and allocate it.
 //
 // Return block number allocated on success,
 // -E_NO_DISK if we are out of blocks.
-//
-// Hint: use free_block as an example for manipulating the bitmap.
 int
-alloc_block(void) { // выделяем блок
-  // The bitmap consists of one or more blocks.  A single bitmap block
-  // contains the in-use bits for BLKBITSIZE blocks.  There are
-  // super->s_nblocks blocks in the disk altogether.
-
-  // LAB 10: Your code here.
+alloc_block(void) {
+  uint32_t n;
 
-  int i;
-	for (i = 0; i < super->s_nblocks; ++i) {
-    if (block_is_free(i)) {
-      bitmap[i / 32] &= ~(1 << (i % 32));
-      flush_block(&bitmap[i / 32]);
-      return i;
-    }
-	}
-
-  return -E_NO_DISK;
+  return alloc_blocks(1, &n);
 }
 
 // Validate the file system bitmap.
@@ -107,11 +190,18 @@ void
 fs_init(void) {
   static_assert(sizeof(struct File) == 256, "Unsupported file size");
 
-  // Find a JOS disk.  Use the second IDE disk (number 1) if availabl
-  if (ide_probe_disk1())
-    ide_set_disk(1);
-  else
-    ide_set_disk(0);
+  // Find a JOS disk.  Use a virtio-blk disk if there is one, else the
+  // second IDE disk (number 1) if available.
+  if (virtio_blk_init() == 0) {
+    disk_read  = virtio_blk_read;
+    disk_write = virtio_blk_write;
+  } else {
+    if (ide_probe_disk1())
+      ide_set_disk(1);
+    else
+      ide_set_disk(0);
+    ide_init();
+  }
   bc_init();
 
   // Set "super" to point to the super block.
@@ -130,6 +220,7 @@ fs_init(void) {
   // Set "bitmap" to the beginning of the first bitmap block.
   bitmap = diskaddr(2);
   check_bitmap();
+  bitmap_count();
 }
 
 // Find the disk block number slot for the 'filebno'th block in file 'f'.
@@ -145,6 +236,8 @@ fs_init(void) {
 //		alloc was 0.
 //	-E_NO_DISK if there's no space on the disk for an indirect block.
 //	-E_INVAL if filebno is out of range (it's >= NDIRECT + NINDIRECT).
+//	-E_NOT_SUPP if f maps its blocks with extents, which have no
+//		slot per block; use file_map_block for those.
 //
 // Analogy: This is like pgdir_walk for files.
 // Hint: Don't forget to clear any block you allocate.
@@ -154,6 +247,9 @@ file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool all
   // LAB 10: Your code here.
   int newb;
 
+  if (f->f_flags & FILE_EXTENTS) {
+      return -E_NOT_SUPP;
+  }
   if (filebno >= NDIRECT + NINDIRECT) {
       return -E_INVAL;
   }
@@ -182,6 +278,228 @@ file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool all
   return 0;
 }
 
+// The i'th extent of f: one of f->f_extent, or one in the extent block.
+static struct Extent *
+file_extent(struct File *f, uint32_t i) {
+  if (i < NEXTENT)
+    return &f->f_extent[i];
+  return (struct Extent *)diskaddr(f->f_extblock) + (i - NEXTENT);
+}
+
+// Find the last extent of f that starts at or before file block
+// filebno, by binary search.  Returns its index, -1 if there is none.
+static int
+file_extent_find(struct File *f, uint32_t filebno) {
+  uint32_t lo = 0, hi = f->f_nextent, mid;
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (file_extent(f, mid)->e_lblk <= filebno)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return (int)lo - 1;
+}
+
+// Insert extent 'ext' into f as extent number 'at'.  There has to be
+// room for it.
+static void
+file_extent_insert(struct File *f, uint32_t at, struct Extent ext) {
+  uint32_t i;
+
+  assert(f->f_nextent < NEXTENT + NEXTBLK && (f->f_nextent < NEXTENT || f->f_extblock));
+  for (i = f->f_nextent; i > at; i--)
+    *file_extent(f, i) = *file_extent(f, i - 1);
+  *file_extent(f, at) = ext;
+  f->f_nextent++;
+}
+
+// Remove extent number 'at' from f.
+static void
+file_extent_remove(struct File *f, uint32_t at) {
+  uint32_t i;
+
+  for (i = at; i + 1 < f->f_nextent; i++)
+    *file_extent(f, i) = *file_extent(f, i + 1);
+  f->f_nextent--;
+}
+
+// Find the disk block of the filebno'th block in file 'f' and store
+// it in *pdiskbno, 0 if the block is not allocated.
+//
+// Returns the number of blocks, up to maxrun, from filebno on that lie
+// in a row on disk from *pdiskbno on; 0 if the block is not allocated.
+// Errors are:
+//	-E_INVAL if filebno is out of range for a file with block pointers.
+int
+file_map_block(struct File *f, uint32_t filebno, uint32_t *pdiskbno, uint32_t maxrun) {
+  struct Extent *e;
+  uint32_t *p, n;
+  int i, r;
+
+  assert(maxrun > 0);
+  *pdiskbno = 0;
+  if (f->f_flags & FILE_EXTENTS) {
+    if ((i = file_extent_find(f, filebno)) < 0)
+      return 0;
+    e = file_extent(f, i);
+    if (filebno >= e->e_lblk + e->e_len)
+      return 0;
+    *pdiskbno = e->e_pblk + (filebno - e->e_lblk);
+    return MIN(maxrun, e->e_lblk + e->e_len - filebno);
+  }
+
+  if ((r = file_block_walk(f, filebno, &p, 0)) < 0)
+    return r == -E_NOT_FOUND ? 0 : r;
+  if (!(*pdiskbno = *p))
+    return 0;
+  for (n = 1; n < maxrun; n++)
+    if (file_block_walk(f, filebno + n, &p, 0) < 0 || *p != *pdiskbno + n)
+      break;
+  return n;
+}
+
+// Make sure that file_map_set can give blocks filebno to
+// filebno + n - 1 of f disk blocks: allocate the indirect block or
+// the extent block that it could need.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_NO_DISK if the disk is full, or f has as many extents as it
+//		can have.
+//	-E_INVAL if the blocks are out of range for block pointers.
+static int
+file_map_prepare(struct File *f, uint32_t filebno, uint32_t n) {
+  uint32_t *p;
+  int r;
+
+  if (!(f->f_flags & FILE_EXTENTS))
+    return file_block_walk(f, filebno + n - 1, &p, 1);
+  if (f->f_nextent == NEXTENT + NEXTBLK)
+    return -E_NO_DISK;
+  if (f->f_nextent >= NEXTENT && !f->f_extblock) {
+    if ((r = alloc_block()) < 0)
+      return r;
+    f->f_extblock = r;
+  }
+  return 0;
+}
+
+// Give blocks filebno to filebno + n - 1 of f, which have no disk
+// blocks, the disk blocks from diskbno on.  With extents, this grows
+// the extent before or after the blocks if they continue it on disk,
+// else it adds an extent.  Call file_map_prepare first.
+static void
+file_map_set(struct File *f, uint32_t filebno, uint32_t diskbno, uint32_t n) {
+  struct Extent *e, *next;
+  uint32_t i, *p;
+  int at;
+
+  if (!(f->f_flags & FILE_EXTENTS)) {
+    for (i = 0; i < n; i++) {
+      if (file_block_walk(f, filebno + i, &p, 0) < 0)
+        panic("file_map_set: no slot for block %u of %s", filebno + i, f->f_name);
+      *p = diskbno + i;
+    }
+    return;
+  }
+
+  at   = file_extent_find(f, filebno);
+  e    = at >= 0 ? file_extent(f, at) : NULL;
+  next = (uint32_t)(at + 1) < f->f_nextent ? file_extent(f, at + 1) : NULL;
+  if (e && e->e_lblk + e->e_len == filebno && e->e_pblk + e->e_len == diskbno) {
+    e->e_len += n;
+    if (next && next->e_lblk == filebno + n && next->e_pblk == diskbno + n) {
+      e->e_len += next->e_len;
+      file_extent_remove(f, at + 1);
+    }
+  } else if (next && next->e_lblk == filebno + n && next->e_pblk == diskbno + n) {
+    next->e_lblk = filebno;
+    next->e_pblk = diskbno;
+    next->e_len += n;
+  } else {
+    file_extent_insert(f, at + 1, (struct Extent){filebno, diskbno, n});
+  }
+}
+
+
+// Sequential access detection for readahead.  Each file being read
+// has a slot here, found by its struct File's address.
+struct Readahead {
+  struct File *ra_file;
+  uint32_t ra_next;   // block number that continues a sequential run
+  uint32_t ra_window; // blocks to read at once on the next miss
+};
+
+#define NREADAHEAD   16
+#define RA_MIN_BLOCK 4
+
+static struct Readahead readahead[NREADAHEAD];
+
+// Note that block filebno of f, at blk, is about to be read.  Runs of
+// consecutive blocks grow f's readahead window, anything else closes
+// it.  On a cache miss the block is read together with the blocks after
+// it in the window that follow it on disk.  Only readers call this:
+// blocks about to be overwritten need not be read at all.
+// Returns 0 on success, or -E_NO_MEM if the cache has no room.
+static int
+file_readahead(struct File *f, uint32_t filebno, char *blk) {
+  struct Readahead *ra = &readahead[(uintptr_t)f / sizeof(struct File) % NREADAHEAD];
+  uint32_t nblocks, run, diskbno = ((uintptr_t)blk - DISKMAP) / BLKSIZE;
+  int n;
+
+  if (ra->ra_file != f) {
+    ra->ra_file   = f;
+    ra->ra_next   = 0;
+    ra->ra_window = 0;
+  }
+  // Block-sized reads use each block once, smaller ones several times
+  // in a row.
+  if (filebno == ra->ra_next)
+    ra->ra_window = ra->ra_window ? MIN(ra->ra_window * 2, BC_RA_MAX) : RA_MIN_BLOCK;
+  else if (filebno + 1 != ra->ra_next)
+    ra->ra_window = 0;
+  ra->ra_next = filebno + 1;
+
+  if (va_is_mapped(blk)) {
+    bc_stat.bs_hits++;
+    return 0;
+  }
+  if (!ra->ra_window)
+    return 0;
+
+  nblocks = ROUNDUP(f->f_size, BLKSIZE) / BLKSIZE;
+  nblocks = filebno < nblocks ? MIN(ra->ra_window, nblocks - filebno) : 1;
+  // file_map_block clears 'run' if it finds no block there; read just
+  // blk's own block then.
+  if ((n = file_map_block(f, filebno, &run, nblocks)) < 1 || run != diskbno)
+    n = 1;
+  return bc_readahead(diskbno, n);
+}
+
+#define ALLOC_RUN_MAX 32
+
+// Allocate a disk block for the filebno'th block of f, which has
+// none.  The unallocated blocks of f that follow it, up to f's size,
+// get the disk blocks that follow, if they are free, so that files
+// written in order end up in order on disk.
+static int
+file_alloc_run(struct File *f, uint32_t filebno, uint32_t *pdiskbno) {
+  uint32_t n, got, nblocks = ROUNDUP(f->f_size, BLKSIZE) / BLKSIZE, diskbno;
+  int b, r;
+
+  n = filebno < nblocks ? MIN(nblocks - filebno, ALLOC_RUN_MAX) : 1;
+  for (got = 1; got < n; got++)
+    if (file_map_block(f, filebno + got, &diskbno, 1) != 0)
+      break;
+  if ((r = file_map_prepare(f, filebno, got)) < 0)
+    return r;
+  if ((b = alloc_blocks(got, &got)) < 0)
+    return b;
+
+  file_map_set(f, filebno, b, got);
+  *pdiskbno = b;
+  return 0;
+}
 
 // Set *blk to the address in memory where the filebno'th
 // block of file 'f' would be mapped.
@@ -194,21 +512,15 @@ file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool all
 int
 file_get_block(struct File *f, uint32_t filebno, char **blk) { // создает блок в случае необходимости
   // LAB 10: Your code here.
-  int r, newb;
-  uint32_t *pdiskbno;
-  if ((r = file_block_walk(f, filebno, &pdiskbno, 1)) < 0) { // pdiskbno - указатель на указатель на блок
-    return r;
-  }
+  int r;
+  uint32_t diskbno;
 
-  if (!*pdiskbno) 
-  {
-    if ((newb = alloc_block()) < 0) {
-      return -E_NO_DISK;
-  }
-    *pdiskbno = newb;
-  }
+  if ((r = file_map_block(f, filebno, &diskbno, 1)) < 0)
+    return r;
+  if (!r && (r = file_alloc_run(f, filebno, &diskbno)) < 0)
+    return r;
 
-  *blk = (char *) diskaddr(*pdiskbno);
+  *blk = (char *) diskaddr(diskbno);
   return 0;
 }
 
@@ -352,7 +664,10 @@ file_create(const char *path, struct File **pf) {
   if ((r = dir_alloc_file(dir, &f)) < 0)
     return r;
 
+  // New files map their blocks with extents.
+  memset(f, 0, sizeof(*f));
   strcpy(f->f_name, name);
+  f->f_flags = FILE_EXTENTS;
   *pf = f;
   file_flush(dir);
   return 0;
@@ -391,7 +706,8 @@ file_read(struct File *f, void *buf, size_t count, off_t offset) {
   count = MIN(count, f->f_size - offset);
 
   for (pos = offset; pos < offset + count;) {
-    if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
+    if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0 ||
+        (r = file_readahead(f, pos / BLKSIZE, blk)) < 0)
       return r;
     bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
     memmove(buf, blk + pos % BLKSIZE, bn);
@@ -403,6 +719,80 @@ file_read(struct File *f, void *buf, size_t count, off_t offset) {
   return count;
 }
 
+// Like file_read, but map the block-cache pages that hold the bytes
+// at dst, one after another, with 'perm', instead of copying them.
+// 'offset' must be block-aligned.  With PTE_W in 'perm' the pages are
+// shared writable, for mmap(), and stay the file's blocks from then on.
+// Returns the number of bytes mapped, < 0 on error.
+// The bytes of the last page past the end of the file are not zeroed.
+int
+file_map(struct File *f, void *dst, size_t count, off_t offset, int perm) {
+  int r;
+  off_t pos;
+  char *blk;
+
+  static_assert(BLKSIZE == PGSIZE, "Block-cache pages are not blocks");
+
+  if (offset % BLKSIZE)
+    return -E_INVAL;
+  // Snapshotted files are assembled by snapshot_file_read.
+  if (*curr_snap != 0 && find_in_snapshot_list(f) == 0 && f->f_type != FTYPE_DIR)
+    return -E_NOT_SUPP;
+
+  if (offset >= f->f_size)
+    return 0;
+
+  count = MIN(count, f->f_size - offset);
+
+  for (pos = offset; pos < offset + count; pos += BLKSIZE, dst += BLKSIZE) {
+    if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0 ||
+        (r = file_readahead(f, pos / BLKSIZE, blk)) < 0)
+      return pos > offset ? pos - offset : r;
+    // Bring the block in from disk before mapping it.
+    (void)*(volatile char *)blk;
+    if (perm & PTE_W) {
+      // A page donated by FSREQ_WRITE_MAP is still copy-on-write: take
+      // a copy of our own first.  PTE_SHARE keeps file_write_map from
+      // replacing the page under the mapping later.
+      if (uvpt[PGNUM(blk)] & PTE_COW)
+        *(volatile char *)blk = *(volatile char *)blk;
+      if ((r = bc_share(blk)) < 0)
+        return pos > offset ? pos - offset : r;
+    }
+    if ((r = sys_page_map(0, blk, 0, dst, perm)) < 0)
+      return r;
+  }
+  return count;
+}
+
+// Write the blocks of f from 'offset' to 'offset' + 'count' to disk,
+// after a client wrote to them through a shared mapping from
+// file_map, instead of waiting for the block cache to write them back.
+// Returns 0 on success, < 0 on error.
+int
+file_msync(struct File *f, off_t offset, size_t count) {
+  int r;
+  off_t pos;
+  char *blk;
+
+  if (offset % BLKSIZE)
+    return -E_INVAL;
+  if (offset >= f->f_size)
+    return 0;
+
+  count = MIN(count, f->f_size - offset);
+
+  for (pos = offset; pos < offset + count; pos += BLKSIZE) {
+    if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
+      return r;
+    if (!va_is_mapped(blk))
+      continue;
+    va_set_dirty(blk);
+    flush_block(blk);
+  }
+  return 0;
+}
+
 // Write count bytes from buf into f, starting at seek position
 // offset.  This is meant to mimic the standard pwrite function.
 // Extends the file if necessary.
@@ -436,6 +826,43 @@ file_write(struct File *f, const void *buf, size_t count, off_t offset)
   return count;
 }
 
+// Like file_write, but for whole blocks at a block-aligned offset: map
+// the pages at 'src', which their sender shares copy-on-write, as the
+// file's blocks instead of copying them, and mark the blocks dirty.
+// Returns the number of bytes written, < 0 on error.
+int
+file_write_map(struct File *f, void *src, size_t count, off_t offset) {
+  int r;
+  off_t pos;
+  char *blk;
+
+  if (offset % BLKSIZE || count % BLKSIZE)
+    return -E_INVAL;
+  if (*curr_snap != 0 && find_in_snapshot_list(f) == 0)
+    return -E_NOT_SUPP;
+
+  // Extend file if necessary
+  if (offset + count > f->f_size)
+    if ((r = file_set_size(f, offset + count)) < 0)
+      return r;
+
+  for (pos = offset; pos < offset + count; pos += BLKSIZE, src += BLKSIZE) {
+    if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
+      return r;
+    // Shared mappings of the block must keep seeing its contents.
+    if (va_is_mapped(blk) && (uvpt[PGNUM(blk)] & PTE_SHARE))
+      return pos > offset ? pos - offset : -E_NOT_SUPP;
+    if ((r = sys_page_map(0, src, 0, blk, PTE_P | PTE_U | PTE_COW | PTE_BC_DIRTY)) < 0)
+      return r;
+    if ((r = bc_track(((uintptr_t)blk - DISKMAP) / BLKSIZE)) < 0) {
+      sys_page_unmap(0, blk);
+      return pos > offset ? pos - offset : r;
+    }
+    bc_set_dirty(((uintptr_t)blk - DISKMAP) / BLKSIZE);
+  }
+  return count;
+}
+
 int find_in_snapshot_list(struct File * f)
 {
   int r;
@@ -726,6 +1153,33 @@ file_free_block(struct File *f, uint32_t filebno) {
   return 0;
 }
 
+// Free the blocks of extent-format file f from block nblocks on,
+// dropping or shortening the extents that hold them, and the extent
+// block once it is not needed.
+static void
+file_truncate_extents(struct File *f, uint32_t nblocks) {
+  struct Extent *e;
+  uint32_t keep, i;
+
+  while (f->f_nextent > 0) {
+    e    = file_extent(f, f->f_nextent - 1);
+    keep = e->e_lblk < nblocks ? MIN(e->e_len, nblocks - e->e_lblk) : 0;
+    if (keep == e->e_len)
+      break;
+    for (i = keep; i < e->e_len; i++)
+      free_block(e->e_pblk + i);
+    if (keep) {
+      e->e_len = keep;
+      break;
+    }
+    f->f_nextent--;
+  }
+  if (f->f_nextent <= NEXTENT && f->f_extblock) {
+    free_block(f->f_extblock);
+    f->f_extblock = 0;
+  }
+}
+
 // Remove any blocks currently used by file 'f',
 // but not necessary for a file of size 'newsize'.
 // For both the old and new sizes, figure out the number of blocks required,
@@ -742,6 +1196,10 @@ file_truncate_blocks(struct File *f, off_t newsize) {
 
   old_nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE;
   new_nblocks = (newsize + BLKSIZE - 1) / BLKSIZE;
+  if (f->f_flags & FILE_EXTENTS) {
+    file_truncate_extents(f, new_nblocks);
+    return;
+  }
   for (bno = new_nblocks; bno < old_nblocks; bno++)
     if ((r = file_free_block(f, bno)) < 0)
       cprintf("warning: file_free_block: %i", r);
@@ -798,51 +1256,42 @@ file_set_size(struct File *f, off_t newsize) {
 }
 
 // Flush the contents and metadata of file f out to disk.
-// Loop over all the blocks in file.
-// Translate the file block number into a disk block number
-// and then check whether that disk block is dirty.  If so, write it out.
+// Collect the blocks of f that are in the block cache, walking its
+// runs of blocks once, and write out the dirty ones.  They are at
+// most the cache's BC_NBLOCKS.
 void
 file_flush(struct File *f) {
-  int i;
-  uint32_t *pdiskbno;
+  static uint32_t blocks[BC_NBLOCKS];
+  uint32_t filebno, diskbno, i, n = 0, nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE;
+  uint32_t meta[2] = {((uintptr_t)f - DISKMAP) / BLKSIZE,
+                      (f->f_flags & FILE_EXTENTS) ? f->f_extblock : f->f_indirect};
+  int r;
 
-  if (*curr_snap != 0)
-  {  
-    if (find_in_snapshot_list(f)==1)
-    {
-      for (i = 0; i < (f->f_size + BLKSIZE - 1) / BLKSIZE; i++) {
-        if (file_block_walk(f, i, &pdiskbno, 0) < 0 ||
-            pdiskbno == NULL || *pdiskbno == 0)
-          continue;
-        flush_block(diskaddr(*pdiskbno));
-      }
-      flush_block(f);
-      if (f->f_indirect)
-        flush_block(diskaddr(f->f_indirect));
-    }
-    else
-      file_flush((struct File *)*curr_snap);
+  if (*curr_snap != 0 && find_in_snapshot_list(f) != 1) {
+    file_flush((struct File *)*curr_snap);
+    return;
   }
-  else
-  {
-    for (i = 0; i < (f->f_size + BLKSIZE - 1) / BLKSIZE; i++) {
-        if (file_block_walk(f, i, &pdiskbno, 0) < 0 ||
-            pdiskbno == NULL || *pdiskbno == 0)
-          continue;
-        flush_block(diskaddr(*pdiskbno));
+
+  for (i = 0; i < 2; i++)
+    if (meta[i] && va_is_mapped(diskaddr(meta[i])))
+      blocks[n++] = meta[i];
+  for (filebno = 0; filebno < nblocks; filebno += r ? r : 1) {
+    if ((r = file_map_block(f, filebno, &diskbno, nblocks - filebno)) < 0)
+      break;
+    for (i = 0; i < r; i++)
+      if (va_is_mapped(diskaddr(diskbno + i))) {
+        assert(n < BC_NBLOCKS);
+        blocks[n++] = diskbno + i;
       }
-      flush_block(f);
-      if (f->f_indirect)
-        flush_block(diskaddr(f->f_indirect));
   }
+  bc_sync(blocks, n);
 }
 
-// Sync the entire file system.  A big hammer.
+// Sync the entire file system.  A big hammer, but it only has to
+// swing at the blocks in the cache's dirty set.
 void
 fs_sync(void) {
-  int i;
-  for (i = 1; i < super->s_nblocks; i++)
-    flush_block(diskaddr(i));
+  bc_sync(NULL, 0);
 }
 
 //IZ1
@@ -1118,90 +1567,46 @@ int print_snapshot_list()
   
 }
 
-uint32_t *check_blocks(struct File *f, uint32_t block_num, struct File **help_file)
-{
-  int number;
-  uint32_t * addr;
-  //struct File *file = NULL;
-  //cprintf("checking file %s size %d\n",f->f_name, (int)f->f_size);
-  for (int pos = 0; pos < f->f_size; pos += BLKSIZE)
-  {
-    number = pos / BLKSIZE;
-    if (number < NDIRECT)
-    {
-      if (f->f_direct[number] == block_num)
-      {
-        //cprintf("Gotcha1\n");
-        *help_file = f;
-        return f->f_direct + number;
-      }
-    }
-    else 
-    {
-      if (number == NDIRECT)
-      {
-        if (f->f_indirect == 0)
-        {
-          //cprintf("Gotcha2\n");
-          *help_file = NULL;
-          return NULL;
-        }
-        addr = (uint32_t *)((uint64_t)f->f_indirect * BLKSIZE + DISKMAP);
-      }
-      //cprintf("here\n");
-      if (addr[number - NDIRECT] == block_num)
-      {
-        //cprintf("Gotcha3\n");
-        *help_file = f;
-        return addr + (number - NDIRECT);
-      }
-    }
+// Is disk block blockno one of f's data blocks, or its indirect or
+// extent block?
+static bool
+check_blocks(struct File *f, uint32_t blockno) {
+  uint32_t filebno, diskbno, nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE;
+  int n;
+
+  if (blockno == ((f->f_flags & FILE_EXTENTS) ? f->f_extblock : f->f_indirect))
+    return 1;
+  for (filebno = 0; filebno < nblocks; filebno += n ? n : 1) {
+    if ((n = file_map_block(f, filebno, &diskbno, nblocks - filebno)) < 0)
+      return 0;
+    if (n && blockno >= diskbno && blockno < diskbno + n)
+      return 1;
   }
-  //cprintf("Gotcha4\n");
-  *help_file = NULL;
-  return NULL;
+  return 0;
 }
 
-uint32_t *find_file(struct File * dir, uint32_t block_num, struct File **help_file)
-{
-  int r;
-  uint32_t i, j, nblock;
+// Find the regular file under dir that disk block blockno belongs to.
+// Returns the file, NULL if there is none.
+static struct File *
+find_file(struct File *dir, uint32_t blockno) {
+  uint32_t i, j, nblock = dir->f_size / BLKSIZE;
+  struct File *f, *res;
   char *blk;
-  struct File *f, *file = NULL;
-  uint32_t *res;
-  file = NULL;
-  nblock = dir->f_size / BLKSIZE;
+
   for (i = 0; i < nblock; i++) {
-    if ((r = file_get_block(dir, i, &blk)) < 0) // blk - подходящий адрес
-    {
-      cprintf("Something wrong with file_get_block in find_file\n");
-      *help_file = NULL;
+    if (file_get_block(dir, i, &blk) < 0)
       return NULL;
-    }
     f = (struct File *)blk;
-    for (j = 0; j < BLKFILES; j++)
-    {
-      if ((f[j].f_type == FTYPE_DIR) && (f[j].f_name[0] != '.'))
-      {
-        res = find_file(f + j, block_num, &file);
-      }
-      else if (f[j].f_type == FTYPE_REG)
-      {
-        res = check_blocks(f + j, block_num, &file);
-      }
-
-      if (res)
-      {
-        //cprintf("Gotcha5\n");
-        *help_file = file;
-        return res;
+    for (j = 0; j < BLKFILES; j++) {
+      if (f[j].f_type == FTYPE_DIR && f[j].f_name[0] && f[j].f_name[0] != '.') {
+        if ((res = find_file(&f[j], blockno)))
+          return res;
+      } else if (f[j].f_type == FTYPE_REG && f[j].f_name[0] && check_blocks(&f[j], blockno)) {
+        return &f[j];
       }
     }
   }
-  //cprintf("Gotcha6\n");
-  *help_file = NULL;
   return NULL;
-
 }
 
 int
@@ -1224,7 +1629,6 @@ test_de_frag(int k)
 
   struct File *curr_file, *test_for_defrag;
   uint32_t i;
-  uint32_t *curr_pdiskbno;
   
  
   if (k)
@@ -1240,8 +1644,7 @@ test_de_frag(int k)
     {
       if (block_is_free(j))
       {
-        bitmap[j / 32] &= ~(1 << (j % 32));
-        flush_block(&bitmap[j / 32]);
+        claim_block(j);
       }
     }
 
@@ -1249,8 +1652,7 @@ test_de_frag(int k)
     {
       if (block_is_free(j))
       {
-        bitmap[j / 32] &= ~(1 << (j % 32));
-        flush_block(&bitmap[j / 32]);
+        claim_block(j);
       }
     }
 
@@ -1291,8 +1693,8 @@ test_de_frag(int k)
   {
     if (!is_bitmap_block(i))
     {
-      curr_pdiskbno = find_file(&super->s_root, i, &curr_file);
-      if (curr_pdiskbno != NULL)
+      curr_file = find_file(&super->s_root, i);
+      if (curr_file != NULL)
       {
         cprintf("block[%d] = %s\n", i, curr_file->f_name);
       }
@@ -1311,231 +1713,94 @@ test_de_frag(int k)
 }
 
 
+// Move regular file f, if its blocks do not lie in one run on disk,
+// into a run of free blocks, as a single extent.  Holes in it become
+// zeroed blocks.  Files that no free run is long enough for, and files
+// with blocks shared with mmap()s, which have to stay where clients map
+// them, are left alone.
+// Returns 1 if f was moved, 0 if not, < 0 on error.
 int
-de_frag()
-{
-  struct File *curr_file, *help_file;
-  int r, newb;
-  uint32_t file_nblocks, i, j;
-  uint32_t *new_pdiskbno, *help_pdiskbno, *curr_pdiskbno;
+defrag_file(struct File *f) {
+  uint32_t filebno, diskbno, nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE, got;
+  int r, start;
 
-  if ((newb = alloc_block()) < 0) 
-  {
-    cprintf("I can't handle de_frag()\n");
-    return -E_NO_DISK;
+  if (!nblocks || (r = file_map_block(f, 0, &diskbno, nblocks)) == nblocks)
+    return 0;
+  if (r < 0)
+    return r;
+  for (filebno = 0; filebno < nblocks; filebno++)
+    if (file_map_block(f, filebno, &diskbno, 1) > 0 && va_is_mapped(diskaddr(diskbno)) &&
+        (uvpt[PGNUM(diskaddr(diskbno))] & PTE_SHARE))
+      return 0;
+
+  if ((start = alloc_blocks(nblocks, &got)) < 0)
+    return start == -E_NO_DISK ? 0 : start;
+  if (got < nblocks) {
+    while (got-- > 0)
+      free_block(start + got);
+    return 0;
   }
 
-  for (i = 2; i < super->s_nblocks; i++)
-  {
-    //cprintf("i=%d\n", i);
-    curr_pdiskbno = find_file(&super->s_root, i, &curr_file);
-    if (curr_pdiskbno != NULL)
-    {
-      //cprintf("%d: %s\n", i, curr_file->f_name);
-    }
-    if (!is_bitmap_block(i))
-    {
-      curr_pdiskbno = find_file(&super->s_root, i, &curr_file);
-      if (curr_pdiskbno != NULL)
-      {
-        //cprintf("%d: %s\n", i, curr_file->f_name);
+  for (filebno = 0; filebno < nblocks; filebno++) {
+    if (file_map_block(f, filebno, &diskbno, 1) > 0)
+      memmove(diskaddr(start + filebno), diskaddr(diskbno), BLKSIZE);
+    else
+      memset(diskaddr(start + filebno), 0, BLKSIZE);
+  }
 
-        file_nblocks = (curr_file->f_size + BLKSIZE - 1) / BLKSIZE;
-        for (j = 0; j < file_nblocks; j++)
-        {
-          free_block(newb);
-          newb = alloc_block();
-
-          //работаем с direct блоками curr_file'а
-          if (j < NDIRECT)
-          {
-            //cprintf("I will do it 0\n");
-            help_pdiskbno = find_file(&super->s_root, i, &help_file);
-            if (help_pdiskbno != NULL)
-            {
-              //cprintf("I will do it 1\n");
-              *help_pdiskbno = curr_file->f_direct[j];
-              //cprintf("I will do it 2\n");
-              flush_block(help_file);
-              //cprintf("I will do it 3\n"); 
-              memcpy(diskaddr(newb), diskaddr(i), BLKSIZE);
-              //cprintf("I will do it 4\n");
-              flush_block(diskaddr(newb));
-              //cprintf("I will do it 5\n");
-              memcpy(diskaddr(i), diskaddr(curr_file->f_direct[j]), BLKSIZE);
-              //cprintf("I will do it 6\n");
-              flush_block(diskaddr(i));
-              //cprintf("I will do it 7\n");
-              memcpy(diskaddr(curr_file->f_direct[j]), diskaddr(newb), BLKSIZE);
-              //cprintf("I will do it 8\n");
-              flush_block(diskaddr(curr_file->f_direct[j]));
-              //cprintf("I will do it 9\n");
-              curr_file->f_direct[j] = i;
-              //cprintf("I will do it 10\n");
-              flush_block(curr_file);
-            }
-            else
-            {
-              if (block_is_free(i))
-              {
-                bitmap[i / 32] &= ~(1 << (i % 32));
-                flush_block(&bitmap[i / 32]);
-                memcpy(diskaddr(i), diskaddr(curr_file->f_direct[j]), BLKSIZE);
-                flush_block(diskaddr(i));
-                free_block(curr_file->f_direct[j]);
-                curr_file->f_direct[j] = i;
-                flush_block(curr_file);
-              }
-              else if (i == newb)
-              {
-                memcpy(diskaddr(i), diskaddr(curr_file->f_direct[j]), BLKSIZE);
-                flush_block(diskaddr(i));
-                newb = curr_file->f_direct[j];
-                curr_file->f_direct[j] = i;
-                flush_block(curr_file);
-              }
-              
-            }
-            if (((i + 1) < super->s_nblocks)&&((j + 1) < file_nblocks)) i++; //else cprintf("error4\n\n");
-            if (is_bitmap_block(i) && ((i + 1) < super->s_nblocks)) i++;
-          }
-
-          //за direct блоками должен быть информационный блок f_indirect
-          //перемещаем его, затем первый indireсt блок
-          if (j == NDIRECT)
-          {
-            //cprintf("I will do it 14\n");
-            if (curr_file->f_indirect == 0)
-            {
-              cprintf("error2\n\n");
-              return 0;
-            }
-            //cprintf("I will do it 15\n");
-            help_pdiskbno = find_file(&super->s_root, i, &help_file);
-            //cprintf("I will do it 16\n");
-            if (help_pdiskbno != NULL)
-            {
-              *help_pdiskbno = curr_file->f_indirect;
-              //cprintf("I will do it 17\n");
-              flush_block(help_file);
-              //cprintf("I will do it 18\n"); 
-              memcpy(diskaddr(newb), diskaddr(i), BLKSIZE);
-              //cprintf("I will do it 19\n");
-              flush_block(diskaddr(newb));
-              //cprintf("I will do it 20\n");
-              memcpy(diskaddr(i), diskaddr(curr_file->f_indirect), BLKSIZE);
-              //cprintf("I will do it 21\n");
-              flush_block(diskaddr(i));
-              //cprintf("I will do it 22\n");
-              memcpy(diskaddr(curr_file->f_indirect), diskaddr(newb), BLKSIZE);
-              //cprintf("I will do it 23\n");
-              flush_block(diskaddr(curr_file->f_indirect));
-              //cprintf("I will do it 24\n");
-              curr_file->f_indirect = i;
-              //cprintf("I will do it 25\n");
-              flush_block(curr_file);
-              //cprintf("I will do it 26\n");
-              //cprintf("I will do it 30\n");
-            }
-            else
-            {
-              if (block_is_free(i))
-              {
-                bitmap[i / 32] &= ~(1 << (i % 32));
-                flush_block(&bitmap[i / 32]);
-                memcpy(diskaddr(i), diskaddr(curr_file->f_indirect), BLKSIZE);
-                flush_block(diskaddr(i));
-                free_block(curr_file->f_indirect);
-                curr_file->f_indirect = i;
-                flush_block(curr_file);
-              }
-              else if (i == newb)
-              {
-                //cprintf("indirect = %d i = %d \n", curr_file->f_indirect, i);
-                memcpy(diskaddr(i), diskaddr(curr_file->f_indirect), BLKSIZE);
-                flush_block(diskaddr(i));
-                newb = curr_file->f_indirect;
-                curr_file->f_indirect = i;
-                flush_block(curr_file);
-              }
-            }
-            if (((i + 1) < super->s_nblocks)&&((j + 1) < file_nblocks)) i++; //else cprintf("error2\n\n");
-            if (is_bitmap_block(i) && ((i + 1) < super->s_nblocks)) i++;
-            free_block(newb);
-            newb = alloc_block();
-          }
-
-          if (j >= NDIRECT)
-          {
-            if ((r = file_block_walk(curr_file, j, &curr_pdiskbno, 0)) < 0) return r;
-            //cprintf("I will do it 31\n");
-            help_pdiskbno = find_file(&super->s_root, i, &help_file);
-            if (help_pdiskbno != NULL)
-            {
-              //cprintf("I will do it 32\n");
-              //cprintf("*curr_pdiskbno = %d\n", *curr_pdiskbno);
-              //cprintf("*help_pdiskbno = %d\n", *help_pdiskbno);
-              //cprintf("*curr_pdiskbno = %d *help_pdiskbno = %d\n", *curr_pdiskbno, *help_pdiskbno);
-              *help_pdiskbno = *curr_pdiskbno;
-              //cprintf("I will do it 33\n");
-              flush_block(help_file);
-              //cprintf("I will do it 34\n");
-              memcpy(diskaddr(newb), diskaddr(i), BLKSIZE);
-              //cprintf("I will do it 35\n");
-              flush_block(diskaddr(newb));
-              //cprintf("I will do it 36\n");
-              memcpy(diskaddr(i), diskaddr(*curr_pdiskbno), BLKSIZE);
-              //cprintf("I will do it 37\n");
-              flush_block(diskaddr(i));
-              //cprintf("I will do it 38\n");
-              memcpy(diskaddr(*curr_pdiskbno), diskaddr(newb), BLKSIZE);
-              //cprintf("I will do it 39\n");
-              flush_block(diskaddr(*curr_pdiskbno));
-              //cprintf("I will do it 40\n");
-              //curr_file->f_indirect = i;
-              new_pdiskbno = (uint32_t *) diskaddr(curr_file->f_indirect) + (j - NDIRECT);
-              //cprintf("I will do it 41\n");
-              *new_pdiskbno = i;
-              //cprintf("I will do it 42\n");
-              flush_block(diskaddr(curr_file->f_indirect));
-              //cprintf("I will do it 43\n");
-            }
-            else
-            {
-              if (block_is_free(i))
-              {
-                bitmap[i / 32] &= ~(1 << (i % 32));
-                flush_block(&bitmap[i / 32]);
-                memcpy(diskaddr(i), diskaddr(*curr_pdiskbno), BLKSIZE);
-                flush_block(diskaddr(i));
-                new_pdiskbno = (uint32_t *) diskaddr(curr_file->f_indirect) + (j - NDIRECT);
-                free_block(*new_pdiskbno);
-                *new_pdiskbno = i;
-                flush_block(diskaddr(curr_file->f_indirect));              
-              }
-              else if (i == newb)
-              {
-                memcpy(diskaddr(i), diskaddr(*curr_pdiskbno), BLKSIZE);
-                flush_block(diskaddr(i));
-                new_pdiskbno = (uint32_t *) diskaddr(curr_file->f_indirect) + (j - NDIRECT);
-                //cprintf("HI indirect = %d i = %d \n", *new_pdiskbno, i);
-                newb = *new_pdiskbno;
-                *new_pdiskbno = i;
-                flush_block(diskaddr(curr_file->f_indirect));  
-              }
+  file_truncate_blocks(f, 0);
+  memset(f->f_direct, 0, sizeof(f->f_direct));
+  f->f_indirect  = 0;
+  f->f_flags    |= FILE_EXTENTS;
+  f->f_extblock  = 0;
+  f->f_nextent   = 1;
+  f->f_extent[0] = (struct Extent){0, start, nblocks};
+  return 1;
+}
 
-            }
-            if (((i + 1) < super->s_nblocks)&&((j + 1) < file_nblocks)) i++; //else cprintf("error3\n\n");
-            if (is_bitmap_block(i) && ((i + 1) < super->s_nblocks)) i++;
-          }
-        }
-        
-      }
+// Defragment the regular files under dir, see defrag_file.
+// Returns the number of files moved, < 0 on error.
+static int
+defrag_dir(struct File *dir) {
+  uint32_t i, j, nblock = dir->f_size / BLKSIZE;
+  int r, moved = 0;
+  struct File *f;
+  char *blk;
+
+  for (i = 0; i < nblock; i++) {
+    if ((r = file_get_block(dir, i, &blk)) < 0)
+      return r;
+    f = (struct File *)blk;
+    for (j = 0; j < BLKFILES; j++) {
+      if (!f[j].f_name[0])
+        continue;
+      if (f[j].f_type == FTYPE_DIR && f[j].f_name[0] != '.')
+        r = defrag_dir(&f[j]);
+      else if (f[j].f_type == FTYPE_REG)
+        r = defrag_file(&f[j]);
+      else
+        r = 0;
+      if (r < 0)
+        return r;
+      moved += r;
     }
   }
-  if (!block_is_free(newb)) free_block(newb);
-  //test_de_frag();
-  cprintf("End of de_frag()\nde_frag() is good\nHappy Christmas!\n");
+  return moved;
+}
+
+// Defragment the file system: move every regular file whose blocks are
+// scattered over the disk into one run of blocks, then sync.
+// Directories stay where they are, since open files and snapshots
+// refer to their struct Files by address.
+// Returns 1 on success, < 0 on error.
+int
+de_frag() {
+  int r;
+
+  if ((r = defrag_dir(&super->s_root)) < 0)
+    return r;
+  fs_sync();
+  cprintf("de_frag() moved %d files\nde_frag() is good\n", r);
   return 1;
 }
 
@@ -11,21 +11,79 @@
 /* Maximum disk size we can handle (3GB) */
 #define DISKSIZE 0xC0000000
 
+/* Most blocks the block cache keeps in memory (16MB).  Superblock and
+ * bitmap blocks, and blocks shared writable with mmap()s, count
+ * against it but are never evicted. */
+#define BC_NBLOCKS 4096
+
+/* Most blocks that may be shared writable with mmap()s at once, so
+ * that the rest of the cache can still be evicted. */
+#define BC_SHARED_MAX (BC_NBLOCKS / 2)
+
+/* Background write-back, see bc_writeback */
+#define BC_WB_INTERVAL 1  // seconds between looks for dirty blocks
+#define BC_DIRTY_AGE   5  // seconds a block may stay dirty
+#define BC_DIRTY_RATIO 4  // at most 1/BC_DIRTY_RATIO of the cache is dirty
+#define BC_WB_MAXRUN   32 // blocks in one disk write (128KB)
+
+/* Most blocks one disk read brings into the block cache (128KB). */
+#define BC_RA_MAX 32
+
+/* Software dirty bit of block-cache pages that were never written
+ * through their mapping, such as pages donated by FSREQ_WRITE_MAP. */
+#define PTE_BC_DIRTY 0x200
+
 extern struct Super *super; // superblock
 extern uint32_t *bitmap;    // bitmap blocks mapped in memory
+extern struct BcStat bc_stat; // block-cache counters
+
+/* pci.c */
+struct PciFunc {
+  uint8_t pf_bus, pf_dev, pf_func;
+  uint16_t pf_vendor, pf_device;
+  uint8_t pf_class, pf_subclass, pf_progif;
+  uint8_t pf_irq; // interrupt line
+};
+
+#define PCI_COMMAND_IO     0x1
+#define PCI_COMMAND_MEM    0x2
+#define PCI_COMMAND_MASTER 0x4
+
+uint32_t pci_conf_read(struct PciFunc *f, uint32_t off);
+void pci_conf_write(struct PciFunc *f, uint32_t off, uint32_t v);
+int pci_find(bool (*match)(struct PciFunc *f, void *arg), void *arg, struct PciFunc *f);
+uint32_t pci_bar(struct PciFunc *f, int n);
+void pci_enable(struct PciFunc *f, uint16_t bits);
 
 /* ide.c */
+#define IDE_MAXSECTS 65536 // sectors in one ide_read or ide_write
+
 bool ide_probe_disk1(void);
 void ide_set_disk(int diskno);
+void ide_init(void);
 void ide_set_partition(uint32_t first_sect, uint32_t nsect);
 int ide_read(uint32_t secno, void *dst, size_t nsecs);
 int ide_write(uint32_t secno, const void *src, size_t nsecs);
 
+/* virtio.c */
+int virtio_blk_init(void);
+int virtio_blk_read(uint32_t secno, void *dst, size_t nsecs);
+int virtio_blk_write(uint32_t secno, const void *src, size_t nsecs);
+
 /* bc.c */
+extern int (*disk_read)(uint32_t secno, void *dst, size_t nsecs);
+extern int (*disk_write)(uint32_t secno, const void *src, size_t nsecs);
 void *diskaddr(uint32_t blockno);
 bool va_is_mapped(void *va);
 bool va_is_dirty(void *va);
+void va_set_dirty(void *va);
 void flush_block(void *addr);
+int bc_readahead(uint32_t blockno, uint32_t nblocks);
+int bc_track(uint32_t blockno);
+int bc_share(void *va);
+void bc_set_dirty(uint32_t blockno);
+void bc_sync(const uint32_t *which, uint32_t nwhich);
+bool bc_writeback(bool idle);
 void bc_init(void);
 
 /* fs.c */
@@ -33,9 +91,13 @@ void fs_init(void);
 int file_get_block(struct File *f, uint32_t file_blockno, char **pblk);
 int file_create(const char *path, struct File **f);
 int file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool alloc);
+int file_map_block(struct File *f, uint32_t filebno, uint32_t *pdiskbno, uint32_t maxrun);
 int file_open(const char *path, struct File **f);
 ssize_t file_read(struct File *f, void *buf, size_t count, off_t offset);
 int file_write(struct File *f, const void *buf, size_t count, off_t offset);
+int file_map(struct File *f, void *dst, size_t count, off_t offset, int perm);
+int file_msync(struct File *f, off_t offset, size_t count);
+int file_write_map(struct File *f, void *src, size_t count, off_t offset);
 int file_set_size(struct File *f, off_t newsize);
 void file_flush(struct File *f);
 int file_remove(const char *path);
@@ -55,11 +117,13 @@ int print_snapshot_list();
 int rec_print_snapshot_list(struct File *snap, struct Snapshot_header header);
 int enable_snapshot();
 int de_frag();
+int defrag_file(struct File *f);
 int test_de_frag(int k);
 
 /* int	map_block(uint32_t); */
 bool block_is_free(uint32_t blockno);
 int alloc_block(void);
+int alloc_blocks(uint32_t n, uint32_t *nalloc);
 
 /* test.c */
 void fs_test(void);
\ No newline at end of file
@@ -123,18 +123,18 @@ finishdisk(void) {
     panic("msync: %s", strerror(errno));
 }
 
+// The len bytes of f lie in a row from block start on, so one extent
+// maps them all.
 void
 finishfile(struct File *f, uint32_t start, uint32_t len) {
-  int i;
-  f->f_size = len;
-  len       = ROUNDUP(len, BLKSIZE);
-  for (i = 0; i < len / BLKSIZE && i < NDIRECT; ++i)
-    f->f_direct[i] = start + i;
-  if (i == NDIRECT) {
-    uint32_t *ind = alloc(BLKSIZE);
-    f->f_indirect = blockof(ind);
-    for (; i < len / BLKSIZE; ++i)
-      ind[i - NDIRECT] = start + i;
+  f->f_size  = len;
+  f->f_flags = FILE_EXTENTS;
+  len        = ROUNDUP(len, BLKSIZE);
+  if (len > 0) {
+    f->f_extent[0].e_lblk = 0;
+    f->f_extent[0].e_pblk = start;
+    f->f_extent[0].e_len  = len / BLKSIZE;
+    f->f_nextent          = 1;
   }
 }
 
@@ -150,6 +150,7 @@ diradd(struct Dir *d, uint32_t type, const char *name) {
   struct File *out = &d->ents[d->n++];
   if (d->n > MAX_DIR_ENTS)
     panic("too many directory entries");
+  memset(out, 0, sizeof *out);
   strcpy(out->f_name, name);
   out->f_type = type;
   return out;
@@ -179,8 +180,6 @@ writefile(struct Dir *dir, const char *name) {
     panic("stat %s: %s", name, strerror(errno));
   if (!S_ISREG(st.st_mode))
     panic("%s is not a regular file", name);
-  if (st.st_size >= MAXFILESIZE)
-    panic("%s too large", name);
 
   last = strrchr(name, '/');
   if (last)
@@ -1,5 +1,7 @@
 /*
- * Minimal PIO-based (non-interrupt-driven) IDE driver code.
+ * IDE driver code for the disks on the primary channel.  Transfers use
+ * PCI bus-master DMA with a completion interrupt when the controller
+ * supports it, and PIO otherwise.
  * For information about what all this IDE/ATA magic means,
  * see the materials available on the class references page.
  */
@@ -12,8 +14,50 @@
 #define IDE_DF   0x20
 #define IDE_ERR  0x01
 
+// Device control register: nIEN keeps the drive from interrupting.
+#define IDE_CTRL 0x3F6
+#define IDE_NIEN 0x02
+
+#define IDE_CMD_READ       0x20
+#define IDE_CMD_READ_EXT   0x24
+#define IDE_CMD_WRITE      0x30
+#define IDE_CMD_WRITE_EXT  0x34
+#define IDE_CMD_READ_DMA   0xC8
+#define IDE_CMD_READ_DMA_EXT  0x25
+#define IDE_CMD_WRITE_DMA  0xCA
+#define IDE_CMD_WRITE_DMA_EXT 0x35
+#define IDE_CMD_IDENTIFY   0xEC
+
+// Bus-master IDE registers of the primary channel, from ide_bmbase
+#define BM_CMD    0
+#define BM_STATUS 2
+#define BM_PRDT   4
+
+#define BM_CMD_START 0x01
+#define BM_CMD_READ  0x08 // the controller writes to memory
+
+#define BM_STATUS_ACTIVE 0x01
+#define BM_STATUS_ERR    0x02
+#define BM_STATUS_IRQ    0x04
+
+// Physical region descriptor: one physically contiguous piece of a
+// DMA transfer, below 4GB and within a 64KB-aligned region.
+struct IdePrd {
+  uint32_t prd_addr;
+  uint16_t prd_len; // 0 means 64KB
+  uint16_t prd_flags;
+};
+
+#define PRD_EOT 0x8000 // last descriptor of the table
+#define NPRD    (PGSIZE / sizeof(struct IdePrd))
+
 static int diskno = 1;
 
+static struct IdePrd ide_prdt[NPRD] __attribute__((aligned(PGSIZE)));
+static uint16_t ide_bmbase;  // bus-master registers, 0 to use PIO only
+static physaddr_t ide_prdt_pa;
+static bool ide_lba48;       // the disk takes 48-bit LBAs
+
 static int
 ide_wait_ready(bool check_error) {
   int r;
@@ -56,20 +100,181 @@ ide_set_disk(int d) {
   diskno = d;
 }
 
-int
-ide_read(uint32_t secno, void *dst, size_t nsecs) {
+static bool
+ide_match_controller(struct PciFunc *f, void *arg) {
+  // Mass storage, IDE, bus-master capable
+  return f->pf_class == 0x01 && f->pf_subclass == 0x01 && (f->pf_progif & 0x80);
+}
+
+// Find out what the disk and its controller can do, and set up DMA if
+// both support it.  Call after ide_set_disk.
+void
+ide_init(void) {
+  struct PciFunc pf;
+  uint16_t id[256], bmbase;
   int r;
 
-  assert(nsecs <= 256);
+  ide_wait_ready(0);
+  outb(IDE_CTRL, IDE_NIEN);
+  outb(0x1F6, 0xE0 | ((diskno & 1) << 4));
+  outb(0x1F7, IDE_CMD_IDENTIFY);
+  if (ide_wait_ready(1) < 0)
+    panic("ide_init: IDENTIFY failed");
+  insl(0x1F0, id, sizeof(id) / 4);
+
+  // Word 83 bit 10: 48-bit addresses; word 49 bit 8: DMA.
+  ide_lba48 = (id[83] & (1 << 10)) != 0;
+  if (!(id[49] & (1 << 8))) {
+    cprintf("IDE: disk %d has no DMA, using PIO\n", diskno);
+    return;
+  }
+
+  // The controller fetches the descriptor table from physical memory.
+  // The kernel clears BM_CMD if we die, so that a transfer can't go on
+  // into pages it has freed.
+  ide_prdt[0].prd_flags = 0;
+  ide_prdt_pa = PTE_ADDR(uvpt[PGNUM(ide_prdt)]);
+  if (ide_prdt_pa >= 0x100000000ULL ||
+      pci_find(ide_match_controller, NULL, &pf) < 0 ||
+      (r = sys_irq_listen(IRQ_IDE, (bmbase = pci_bar(&pf, 4) & ~3) + BM_CMD)) < 0) {
+    cprintf("IDE: no bus-master DMA, using PIO\n");
+    return;
+  }
+  pci_enable(&pf, PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+  ide_bmbase = bmbase;
+  cprintf("IDE: bus-master DMA at port %x%s\n", ide_bmbase, ide_lba48 ? ", LBA48" : "");
+}
 
+// Select the disk and give it command 'cmd' for nsecs sectors from
+// secno, with 48-bit addresses if 'ext'.  'irq' lets the drive
+// interrupt when it is done.
+static void
+ide_start(uint32_t secno, size_t nsecs, int cmd, bool ext, bool irq) {
   ide_wait_ready(0);
 
-  outb(0x1F2, nsecs);
-  outb(0x1F3, secno & 0xFF);
-  outb(0x1F4, (secno >> 8) & 0xFF);
-  outb(0x1F5, (secno >> 16) & 0xFF);
-  outb(0x1F6, 0xE0 | ((diskno & 1) << 4) | ((secno >> 24) & 0x0F));
-  outb(0x1F7, 0x20); // CMD 0x20 means read sector
+  outb(IDE_CTRL, irq ? 0 : IDE_NIEN);
+  if (ext) {
+    // High bytes first, then the low ones
+    outb(0x1F2, (nsecs >> 8) & 0xFF);
+    outb(0x1F3, (secno >> 24) & 0xFF);
+    outb(0x1F4, 0);
+    outb(0x1F5, 0);
+    outb(0x1F2, nsecs & 0xFF);
+    outb(0x1F3, secno & 0xFF);
+    outb(0x1F4, (secno >> 8) & 0xFF);
+    outb(0x1F5, (secno >> 16) & 0xFF);
+    outb(0x1F6, 0x40 | ((diskno & 1) << 4));
+  } else {
+    outb(0x1F2, nsecs);
+    outb(0x1F3, secno & 0xFF);
+    outb(0x1F4, (secno >> 8) & 0xFF);
+    outb(0x1F5, (secno >> 16) & 0xFF);
+    outb(0x1F6, 0xE0 | ((diskno & 1) << 4) | ((secno >> 24) & 0x0F));
+  }
+  outb(0x1F7, cmd);
+}
+
+// Does the transfer need a 48-bit command?  Sets *ext.
+// Returns -E_INVAL if it does but the disk has none.
+static int
+ide_need_ext(uint32_t secno, size_t nsecs, bool *ext) {
+  assert(nsecs > 0 && nsecs <= IDE_MAXSECTS);
+
+  *ext = nsecs > 256 || (uint64_t)secno + nsecs > (1 << 28);
+  if (*ext && !ide_lba48)
+    return -E_INVAL;
+  return 0;
+}
+
+// Fill in the descriptor table for the 'len' bytes at va.  The pages
+// have to be mapped, writable if 'write' (to memory) is set, and lie
+// below 4GB.  Returns -E_NOT_SUPP if they don't or the table is full.
+static int
+ide_dma_prdt(void *va, size_t len, bool write) {
+  struct IdePrd *prd = NULL;
+  uintptr_t p = (uintptr_t)va, end = p + len;
+  physaddr_t pa;
+  size_t n, plen;
+  pte_t pte;
+
+  for (; p < end; p += n) {
+    if (!(uvpml4e[PML4(p)] & PTE_P) || !(uvpde[VPDPE(p)] & PTE_P) ||
+        !(uvpd[VPD(p)] & PTE_P) || (uvpd[VPD(p)] & PTE_PS))
+      return -E_NOT_SUPP;
+    pte = uvpt[PGNUM(p)];
+    if (!(pte & PTE_P) || (write && (!(pte & PTE_W) || (pte & PTE_COW))))
+      return -E_NOT_SUPP;
+    pa = PTE_ADDR(pte) + PGOFF(p);
+    n  = MIN(end - p, PGSIZE - PGOFF(p));
+    if (pa + n > 0x100000000ULL)
+      return -E_NOT_SUPP;
+
+    plen = prd ? (prd->prd_len ? prd->prd_len : 0x10000) : 0;
+    if (prd && prd->prd_addr + plen == pa && (pa + n - 1) >> 16 == prd->prd_addr >> 16) {
+      prd->prd_len = plen + n;
+    } else {
+      prd = prd ? prd + 1 : ide_prdt;
+      if (prd == ide_prdt + NPRD)
+        return -E_NOT_SUPP;
+      prd->prd_addr  = pa;
+      prd->prd_len   = n;
+      prd->prd_flags = 0;
+    }
+  }
+  prd->prd_flags = PRD_EOT;
+  return 0;
+}
+
+// Transfer nsecs sectors from secno to va, or from va if 'write', by
+// DMA, and let other environments run until the disk interrupts.
+// Returns -E_NOT_SUPP without touching the disk if va can't take part
+// in DMA, -1 on disk errors.
+static int
+ide_dma(uint32_t secno, void *va, size_t nsecs, bool write) {
+  int r, bmcmd = write ? 0 : BM_CMD_READ;
+  bool ext;
+  uint8_t st;
+
+  if ((r = ide_need_ext(secno, nsecs, &ext)) < 0)
+    return r;
+  if ((r = ide_dma_prdt(va, nsecs * SECTSIZE, !write)) < 0)
+    return r;
+
+  outl(ide_bmbase + BM_PRDT, ide_prdt_pa);
+  outb(ide_bmbase + BM_CMD, bmcmd);
+  outb(ide_bmbase + BM_STATUS, BM_STATUS_IRQ | BM_STATUS_ERR);
+  ide_start(secno, nsecs, write ? (ext ? IDE_CMD_WRITE_DMA_EXT : IDE_CMD_WRITE_DMA)
+                                : (ext ? IDE_CMD_READ_DMA_EXT : IDE_CMD_READ_DMA),
+            ext, 1);
+  outb(ide_bmbase + BM_CMD, bmcmd | BM_CMD_START);
+
+  // An interrupt left over from earlier does not set BM_STATUS_IRQ.
+  do {
+    if ((r = sys_irq_wait(IRQ_IDE)) < 0)
+      panic("ide_dma: sys_irq_wait: %i", r);
+  } while (!(inb(ide_bmbase + BM_STATUS) & BM_STATUS_IRQ));
+
+  outb(ide_bmbase + BM_CMD, 0);
+  st = inb(ide_bmbase + BM_STATUS);
+  outb(ide_bmbase + BM_STATUS, BM_STATUS_IRQ | BM_STATUS_ERR);
+  // Reading the status register acknowledges the drive's interrupt.
+  r = inb(0x1F7);
+  if ((st & BM_STATUS_ERR) || (r & (IDE_DF | IDE_ERR)))
+    return -1;
+  return 0;
+}
+
+int
+ide_read(uint32_t secno, void *dst, size_t nsecs) {
+  int r;
+  bool ext;
+
+  if (ide_bmbase && (r = ide_dma(secno, dst, nsecs, 0)) != -E_NOT_SUPP)
+    return r;
+
+  if ((r = ide_need_ext(secno, nsecs, &ext)) < 0)
+    return r;
+  ide_start(secno, nsecs, ext ? IDE_CMD_READ_EXT : IDE_CMD_READ, ext, 0);
 
   for (; nsecs > 0; nsecs--, dst += SECTSIZE) {
     if ((r = ide_wait_ready(1)) < 0)
@@ -83,17 +288,14 @@ ide_read(uint32_t secno, void *dst, size_t nsecs) {
 int
 ide_write(uint32_t secno, const void *src, size_t nsecs) {
   int r;
+  bool ext;
 
-  assert(nsecs <= 256);
-
-  ide_wait_ready(0);
+  if (ide_bmbase && (r = ide_dma(secno, (void *)src, nsecs, 1)) != -E_NOT_SUPP)
+    return r;
 
-  outb(0x1F2, nsecs);
-  outb(0x1F3, secno & 0xFF);
-  outb(0x1F4, (secno >> 8) & 0xFF);
-  outb(0x1F5, (secno >> 16) & 0xFF);
-  outb(0x1F6, 0xE0 | ((diskno & 1) << 4) | ((secno >> 24) & 0x0F));
-  outb(0x1F7, 0x30); // CMD 0x30 means write sector
+  if ((r = ide_need_ext(secno, nsecs, &ext)) < 0)
+    return r;
+  ide_start(secno, nsecs, ext ? IDE_CMD_WRITE_EXT : IDE_CMD_WRITE, ext, 0);
 
   for (; nsecs > 0; nsecs--, src += SECTSIZE) {
     if ((r = ide_wait_ready(1)) < 0)
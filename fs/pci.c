@@ -0,0 +1,89 @@
+/*
+ * PCI configuration space access through I/O ports 0xCF8/0xCFC
+ * (configuration mechanism #1), enough for the file system server
+ * to find its disk controller.
+ */
+
+#include "fs.h"
+#include <inc/x86.h>
+
+#define PCI_CONF_ADDR 0xCF8
+#define PCI_CONF_DATA 0xCFC
+
+#define PCI_ID       0x00 // vendor and device IDs
+#define PCI_COMMAND  0x04 // command and status registers
+#define PCI_CLASS    0x08 // revision, prog. interface, subclass, class
+#define PCI_HEADER   0x0C // header type in bits 16-23
+#define PCI_INTR     0x3C // interrupt line in bits 0-7
+#define PCI_BAR(n)   (0x10 + 4 * (n))
+
+#define PCI_HEADER_MULTIFN 0x80
+
+static uint32_t
+pci_conf_addr(struct PciFunc *f, uint32_t off) {
+  return 0x80000000 | (f->pf_bus << 16) | (f->pf_dev << 11) | (f->pf_func << 8) | (off & 0xFC);
+}
+
+uint32_t
+pci_conf_read(struct PciFunc *f, uint32_t off) {
+  outl(PCI_CONF_ADDR, pci_conf_addr(f, off));
+  return inl(PCI_CONF_DATA);
+}
+
+void
+pci_conf_write(struct PciFunc *f, uint32_t off, uint32_t v) {
+  outl(PCI_CONF_ADDR, pci_conf_addr(f, off));
+  outl(PCI_CONF_DATA, v);
+}
+
+// Fill in the IDs, class and interrupt line of *f from its
+// configuration space.  Returns false if there is no such function.
+static bool
+pci_probe(struct PciFunc *f) {
+  uint32_t id = pci_conf_read(f, PCI_ID), class;
+
+  if ((id & 0xFFFF) == 0xFFFF)
+    return 0;
+  class          = pci_conf_read(f, PCI_CLASS);
+  f->pf_vendor   = id & 0xFFFF;
+  f->pf_device   = id >> 16;
+  f->pf_class    = class >> 24;
+  f->pf_subclass = (class >> 16) & 0xFF;
+  f->pf_progif   = (class >> 8) & 0xFF;
+  f->pf_irq      = pci_conf_read(f, PCI_INTR) & 0xFF;
+  return 1;
+}
+
+// Find the first PCI function that 'match' accepts and store it in *f.
+// Returns 0 on success, -E_NOT_FOUND if there is none.
+int
+pci_find(bool (*match)(struct PciFunc *f, void *arg), void *arg, struct PciFunc *f) {
+  uint32_t bus, dev, func, nfunc;
+
+  for (bus = 0; bus < 256; bus++)
+    for (dev = 0; dev < 32; dev++) {
+      nfunc = 1;
+      for (func = 0; func < nfunc; func++) {
+        *f = (struct PciFunc){.pf_bus = bus, .pf_dev = dev, .pf_func = func};
+        if (!pci_probe(f))
+          continue;
+        if (!func && (pci_conf_read(f, PCI_HEADER) >> 16) & PCI_HEADER_MULTIFN)
+          nfunc = 8;
+        if (match(f, arg))
+          return 0;
+      }
+    }
+  return -E_NOT_FOUND;
+}
+
+// Return base address register n of f.
+uint32_t
+pci_bar(struct PciFunc *f, int n) {
+  return pci_conf_read(f, PCI_BAR(n));
+}
+
+// Turn on the command register bits in 'bits' (PCI_COMMAND_*).
+void
+pci_enable(struct PciFunc *f, uint16_t bits) {
+  pci_conf_write(f, PCI_COMMAND, pci_conf_read(f, PCI_COMMAND) | bits);
+}
@@ -37,8 +37,16 @@ struct OpenFile {
 struct OpenFile opentab[MAXOPEN] = {
     {0, 0, 1, 0}};
 
-// Virtual address at which to receive page mappings containing client requests.
-union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
+// Virtual address at which to receive page mappings containing client
+// requests.  It starts a window of IPC_MAX_PAGES pages, below DISKMAP,
+// for requests that come with a run of pages.
+union Fsipc *fsreq = (union Fsipc *)(DISKMAP - IPC_MAX_PAGES * PGSIZE);
+
+// Number of pages mapped at fsreq by the current request.
+static size_t fsreq_npages;
+
+// Block-cache pages for FSREQ_READ_MAP replies are lined up here.
+static char *fsmap = (char *)(DISKMAP - 2 * IPC_MAX_PAGES * PGSIZE);
 
 void
 serve_init(void) {
@@ -191,9 +199,13 @@ serve_set_size(envid_t envid, struct Fsreq_set_size *req) {
 // in ipc->read.req_fileid.  Return the bytes read from the file to
 // the caller in ipc->readRet, then update the seek position.  Returns
 // the number of bytes successfully read, or < 0 on error.
+// If the arguments came in message words, the bytes go into the run of
+// pages the caller sent along instead, up to IPC_MAX_PAGES of them.
 int
 serve_read(envid_t envid, union Fsipc *ipc) {
   struct Fsreq_read *req = &ipc->read;
+  char *buf = ipc->readRet.ret_buf;
+  size_t max = PGSIZE;
 
   //cprintf("server_read\n");
 
@@ -201,17 +213,24 @@ serve_read(envid_t envid, union Fsipc *ipc) {
     cprintf("serve_read %08x %08x %08x\n", envid, req->req_fileid, (uint32_t)req->req_n);
 
   // Lab 10: Your code here:
-  struct Fsret_read *ret = &ipc->readRet;
   struct OpenFile *o;
   int r;
 
+  if (ipc != fsreq) {
+    // The reply goes into the client's pages, which must be writable.
+    if (!fsreq_npages || !(thisenv->env_ipc_perm & PTE_W))
+      return -E_INVAL;
+    buf = (char *)fsreq;
+    max = fsreq_npages * PGSIZE;
+  }
+
 	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0) {
 	  return r;
 	}
 
   //cprintf("req->req_n = %d\n",(int)req->req_n);
 
-	int count = file_read(o->o_file, ret->ret_buf, req->req_n, o->o_fd->fd_offset);
+	int count = file_read(o->o_file, buf, MIN(req->req_n, max), o->o_fd->fd_offset);
   if (count > 0) {
     o->o_fd->fd_offset += count;
   } 
@@ -220,6 +239,89 @@ serve_read(envid_t envid, union Fsipc *ipc) {
 	return count;
 }
 
+// Like serve_read, but map the block-cache pages of up to req->req_n
+// bytes, and at most IPC_MAX_PAGES pages, into the caller read-only,
+// instead of copying the bytes.  The seek position must be page-aligned.
+// Returns the number of bytes, with the pages in *pg_store and
+// *perm_store, or < 0 on error.  -E_NOT_SUPP means the caller has to
+// use FSREQ_READ.
+int
+serve_read_map(envid_t envid, struct Fsreq_read *req, void **pg_store, int *perm_store) {
+  struct OpenFile *o;
+  int r;
+
+  if (debug)
+    cprintf("serve_read_map %08x %08x %08x\n", envid, req->req_fileid, (uint32_t)req->req_n);
+
+  if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+    return r;
+  if (o->o_fd->fd_offset % PGSIZE)
+    return -E_NOT_SUPP;
+
+  r = file_map(o->o_file, fsmap, MIN(req->req_n, IPC_MAX_PAGES * PGSIZE),
+               o->o_fd->fd_offset, PTE_P | PTE_U);
+  if (r > 0) {
+    o->o_fd->fd_offset += r;
+    *pg_store   = IPC_PAGES(fsmap, ROUNDUP(r, PGSIZE) / PGSIZE);
+    *perm_store = PTE_P | PTE_U;
+  }
+  return r;
+}
+
+// Map the block-cache pages of up to req->req_n bytes of req->req_fileid
+// from req->req_offset, which must be page-aligned, and at most
+// IPC_MAX_PAGES pages, into the caller for a fault in an mmap()ed range.
+// They are read-only, or shared and writable if req->req_write is set
+// and the file is open for writing.  The seek position stays put.
+// Returns the number of bytes, with the pages in *pg_store and
+// *perm_store, or < 0 on error.
+int
+serve_map(envid_t envid, struct Fsreq_map *req, void **pg_store, int *perm_store) {
+  struct OpenFile *o;
+  int perm = PTE_P | PTE_U;
+  int r;
+
+  if (debug)
+    cprintf("serve_map %08x %08x %08x %08x\n", envid, req->req_fileid,
+            (uint32_t)req->req_offset, (uint32_t)req->req_n);
+
+  if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+    return r;
+  if (req->req_offset < 0 || req->req_offset % PGSIZE)
+    return -E_INVAL;
+  if (req->req_write) {
+    if ((o->o_mode & O_ACCMODE) == O_RDONLY)
+      return -E_INVAL;
+    perm |= PTE_W | PTE_SHARE;
+  }
+
+  r = file_map(o->o_file, fsmap, MIN(req->req_n, IPC_MAX_PAGES * PGSIZE),
+               req->req_offset, perm);
+  if (r > 0) {
+    *pg_store   = IPC_PAGES(fsmap, ROUNDUP(r, PGSIZE) / PGSIZE);
+    *perm_store = perm;
+  }
+  return r;
+}
+
+// Write the req->req_n bytes of req->req_fileid from req->req_offset,
+// which the caller changed through a shared mapping, to disk.
+int
+serve_msync(envid_t envid, struct Fsreq_msync *req) {
+  struct OpenFile *o;
+  int r;
+
+  if (debug)
+    cprintf("serve_msync %08x %08x %08x %08x\n", envid, req->req_fileid,
+            (uint32_t)req->req_offset, (uint32_t)req->req_n);
+
+  if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+    return r;
+  if ((o->o_mode & O_ACCMODE) == O_RDONLY || req->req_offset < 0)
+    return -E_INVAL;
+  return file_msync(o->o_file, req->req_offset, req->req_n);
+}
+
 // Write req->req_n bytes from req->req_buf to req_fileid, starting at
 // the current seek position, and update the seek position
 // accordingly.  Extend the file if necessary.  Returns the number of
@@ -244,6 +346,32 @@ serve_write(envid_t envid, struct Fsreq_write *req) {
 	return count;
 }
 
+// Like serve_write, but the bytes are the run of whole pages that the
+// caller sent along, shared copy-on-write, and they become the file's
+// blocks.  The seek position must be page-aligned.
+// Returns -E_NOT_SUPP if the caller has to use FSREQ_WRITE.
+int
+serve_write_map(envid_t envid, struct Fsreq_write_map *req) {
+  struct OpenFile *o;
+  int r;
+
+  if (debug)
+    cprintf("serve_write_map %08x %08x %08x\n", envid, req->req_fileid, (uint32_t)req->req_n);
+
+  if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+    return r;
+  // Pages the caller can still write to must not become blocks.
+  if (!fsreq_npages || !(thisenv->env_ipc_perm & PTE_COW) ||
+      req->req_n % PGSIZE || req->req_n > fsreq_npages * PGSIZE)
+    return -E_INVAL;
+  if (o->o_fd->fd_offset % PGSIZE)
+    return -E_NOT_SUPP;
+
+  if ((r = file_write_map(o->o_file, fsreq, req->req_n, o->o_fd->fd_offset)) > 0)
+    o->o_fd->fd_offset += r;
+  return r;
+}
+
 // Stat ipc->stat.req_fileid.  Return the file's struct Stat to the
 // caller in ipc->statRet.
 int
@@ -286,6 +414,16 @@ serve_sync(envid_t envid, union Fsipc *req) {
   return 0;
 }
 
+// Return the block-cache counters in ipc->bcstatRet.
+int
+serve_bcstat(envid_t envid, union Fsipc *ipc) {
+  if (debug)
+    cprintf("serve_bcstat %08x\n", envid);
+
+  ipc->bcstatRet = bc_stat;
+  return 0;
+}
+
 int
 serve_de_frag(envid_t envid, union Fsipc *req)
 {
@@ -432,49 +570,95 @@ fshandler handlers[] = {
     [FSREQ_STAT]     = serve_stat,
     [FSREQ_FLUSH]    = (fshandler)serve_flush,
     [FSREQ_WRITE]    = (fshandler)serve_write,
+    [FSREQ_WRITE_MAP] = (fshandler)serve_write_map,
+    [FSREQ_MSYNC]    = (fshandler)serve_msync,
     [FSREQ_SET_SIZE] = (fshandler)serve_set_size,
     [FSREQ_SNPSHT]   = serve_snpsht,
     [FSREQ_SYNC]     = serve_sync,
+    [FSREQ_BCSTAT]   = serve_bcstat,
     [FSREQ_DFRG]     = serve_de_frag,
     [FSREQ_TSTDFRG]  = serve_test_de_frag};
 #define NHANDLERS (sizeof(handlers) / sizeof(handlers[0]))
 
+// Requests that came in IPC message words instead of a page are copied
+// here, so that handlers can treat both alike.  It is cleared first, so
+// strings in such requests are always terminated.
+static union Fsipc fsmsg;
+
 void
 serve(void) {
-  uint32_t req, whom;
-  int perm, r;
-  void *pg;
+  uint32_t req, whom = 0;
+  int perm = 0, r = 0, timeout = 0, wb;
+  void *pg = NULL;
+  union Fsipc *ipc;
+  size_t i;
 
+  // Each reply goes out in the same system call that waits for the
+  // next request.
   while (1) {
-    perm = 0;
-    req  = ipc_recv((int32_t *)&whom, fsreq, &perm);
+    // Write dirty blocks back, old ones only if no other request is
+    // waiting for us.  While some are left, the wait gives up every
+    // BC_WB_INTERVAL seconds, so they go out when no requests come in,
+    // too.
+    wb = bc_writeback(!thisenv->env_ipc_senders) ? BC_WB_INTERVAL : 0;
+    if (wb != timeout)
+      sys_ipc_timeout(timeout = wb);
+
+    if (whom)
+      req = ipc_reply_wait(whom, r, pg, perm, NULL, (envid_t *)&whom,
+                           IPC_PAGES(fsreq, IPC_MAX_PAGES), &perm);
+    else
+      req = ipc_recv((envid_t *)&whom, IPC_PAGES(fsreq, IPC_MAX_PAGES), &perm);
+    // Block-cache pages the reply mapped at fsmap must not count as
+    // mapped by a client (see bc_shared).
+    if (pg && IPC_PAGES_VA(pg) == fsmap)
+      for (i = 0; i < IPC_PAGES_N(pg); i++)
+        sys_page_unmap(0, fsmap + i * PGSIZE);
+    pg = NULL;
+    // Timed out, or failed: there is no request to answer.
+    if (!whom)
+      continue;
+    fsreq_npages = (perm & PTE_P) ? thisenv->env_ipc_npages : 0;
     if (debug)
       cprintf("fs req %d from %08x [page %08lx: %s]\n",
               req, whom, (unsigned long)uvpt[PGNUM(fsreq)],
               (char *)fsreq);
 
-    // All requests must contain an argument page
-    if (!(perm & PTE_P)) {
-      cprintf("Invalid request from %08x: no argument page\n",
-              whom);
-      continue; // just leave it hanging...
+    // Requests with message words carry their arguments there, and
+    // whatever they leave out reads as zero; the others in the page.
+    if ((perm & PTE_P) && !thisenv->env_ipc_msg.im_nwords) {
+      ipc = fsreq;
+    } else {
+      memset(&fsmsg, 0, sizeof(fsmsg));
+      memcpy(&fsmsg, (const void *)thisenv->env_ipc_msg.im_words,
+             thisenv->env_ipc_msg.im_nwords * sizeof(uint64_t));
+      ipc = &fsmsg;
     }
 
-    pg = NULL;
     if (req == FSREQ_OPEN) {
-      r = serve_open(whom, (struct Fsreq_open *)fsreq, &pg, &perm);
+      r = serve_open(whom, (struct Fsreq_open *)ipc, &pg, &perm);
+    } 
+    else if (req == FSREQ_READ_MAP) 
+    {
+      r = serve_read_map(whom, &ipc->read, &pg, &perm);
+    } 
+    else if (req == FSREQ_MAP) 
+    {
+      r = serve_map(whom, &ipc->map, &pg, &perm);
     } 
     else if (req < NHANDLERS && handlers[req]) 
     {
-      r = handlers[req](whom, fsreq);
+      r = handlers[req](whom, ipc);
     } 
     else 
     {
       cprintf("Invalid request code %d from %08x\n", req, whom);
       r = -E_INVAL;
     }
-    ipc_send(whom, r, pg, perm);
-    sys_page_unmap(0, fsreq);
+
+    // Let go of the client's pages; the reply can't refer to them.
+    for (i = 0; i < fsreq_npages; i++)
+      sys_page_unmap(0, (char *)fsreq + i * PGSIZE);
   }
 }
 
@@ -488,6 +672,10 @@ umain(int argc, char **argv) {
   outw(0x8A00, 0x8A00);
   cprintf("FS can do I/O\n");
 
+  // Every other environment waits on us for its file operations,
+  // so do not let batch jobs delay the replies.
+  sys_env_set_priority(0, ENV_PRIO_HIGH);
+
   serve_init();
   fs_init();
   fs_test();
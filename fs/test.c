@@ -5,6 +5,10 @@
 
 static char *msg = "This is the NEW message of the day!\n\n";
 
+// Blocks in each of the files check_extents interleaves on disk; more
+// than fit in struct File, so that the extent block is used too.
+#define NFRAG (NEXTENT + 3)
+
 void check_dir(struct File *dir);
 
 static inline void
@@ -14,40 +18,92 @@ check_consistency(void) {
 
 void
 check_dir(struct File *dir) {
-  int r, i, j, k;
-  uint32_t *blk;
+  int i, j, k;
+  uint32_t diskbno;
   struct File *files;
 
   uint32_t nblock = dir->f_size / BLKSIZE;
   for (i = 0; i < nblock; ++i) {
 
-    if ((r = file_block_walk(dir, i, &blk, 0)) < 0) {
+    if (file_map_block(dir, i, &diskbno, 1) <= 0) {
       continue;
     }
 
-    files = (struct File *)diskaddr(*blk);
+    files = (struct File *)diskaddr(diskbno);
 
     for (j = 0; j < BLKFILES; ++j) {
       struct File *f = &(files[j]);
       if (strcmp(f->f_name, "\0") != 0) {
-        uint32_t *pdiskbno = NULL;
-
         cprintf("checking consistency of %s\n", f->f_name);
 
         for (k = 0; k < (f->f_size + BLKSIZE - 1) / BLKSIZE; ++k) {
           if (f->f_type == FTYPE_DIR) {
             check_dir(f);
           }
-          if (file_block_walk(f, k, &pdiskbno, 0) < 0 || pdiskbno == NULL || *pdiskbno == 0) {
+          if (file_map_block(f, k, &diskbno, 1) <= 0) {
             continue;
           }
-          assert(!block_is_free(*pdiskbno));
+          assert(!block_is_free(diskbno));
         }
       }
     }
   }
 }
 
+// Check that block filebno of f is allocated and holds 'c'.
+static void
+check_frag_block(struct File *f, uint32_t filebno, char c) {
+  uint32_t diskbno;
+
+  if (file_map_block(f, filebno, &diskbno, 1) != 1)
+    panic("block %u of %s is not mapped", filebno, f->f_name);
+  assert(!block_is_free(diskbno));
+  assert(*(char *)diskaddr(diskbno) == c);
+}
+
+// Grow two files a block at a time in turns, so that their blocks
+// alternate on disk and each block needs an extent of its own.  Then
+// defragment one of them, which must leave it in a single extent.
+static void
+check_extents(void) {
+  struct File *f[2];
+  uint32_t i, j, diskbno;
+  char *blk;
+  int r;
+
+  if ((r = file_create("/frag0", &f[0])) < 0 || (r = file_create("/frag1", &f[1])) < 0)
+    panic("file_create: %i", r);
+  for (i = 0; i < NFRAG; i++)
+    for (j = 0; j < 2; j++) {
+      if ((r = file_set_size(f[j], (i + 1) * BLKSIZE)) < 0)
+        panic("file_set_size: %i", r);
+      if ((r = file_get_block(f[j], i, &blk)) < 0)
+        panic("file_get_block: %i", r);
+      memset(blk, 'a' + 2 * i + j, BLKSIZE);
+    }
+  assert(f[0]->f_flags & FILE_EXTENTS);
+  assert(f[0]->f_nextent == NFRAG && f[0]->f_extblock);
+  for (i = 0; i < NFRAG; i++)
+    check_frag_block(f[0], i, 'a' + 2 * i);
+  cprintf("file extents are good\n");
+
+  if ((r = defrag_file(f[0])) != 1)
+    panic("defrag_file: %i", r);
+  assert(f[0]->f_nextent == 1 && !f[0]->f_extblock);
+  assert(file_map_block(f[0], 0, &diskbno, NFRAG) == NFRAG);
+  for (i = 0; i < NFRAG; i++) {
+    check_frag_block(f[0], i, 'a' + 2 * i);
+    check_frag_block(f[1], i, 'a' + 2 * i + 1);
+  }
+  cprintf("defrag_file is good\n");
+
+  for (j = 0; j < 2; j++) {
+    if ((r = file_set_size(f[j], 0)) < 0)
+      panic("file_set_size: %i", r);
+    f[j]->f_name[0] = '\0';
+  }
+}
+
 void
 fs_test(void) {
   struct File *f;
@@ -93,7 +149,7 @@ fs_test(void) {
 
   if ((r = file_set_size(f, 0)) < 0)
     panic("file_set_size: %i", r);
-  assert(f->f_direct[0] == 0);
+  assert(f->f_direct[0] == 0 && f->f_nextent == 0);
   assert(!(uvpt[PGNUM(f)] & PTE_D));
   cprintf("file_truncate is good\n");
 
@@ -108,4 +164,6 @@ fs_test(void) {
   //assert(!(uvpt[PGNUM(blk)] & PTE_D));
   //assert(!(uvpt[PGNUM(f)] & PTE_D));
   cprintf("file rewrite is good\n");
+
+  check_extents();
 }
@@ -0,0 +1,361 @@
+/*
+ * virtio-blk driver for a legacy (or transitional) virtio PCI device,
+ * as QEMU attaches one with -drive if=virtio.  It has the ide_read and
+ * ide_write interface, but puts the pages of a transfer straight into
+ * the descriptors of a split virtqueue, keeps several requests in
+ * flight at once, and sleeps on the device's interrupt.
+ */
+
+#include "fs.h"
+#include <inc/x86.h>
+
+#define VIRTIO_VENDOR  0x1AF4
+#define VIRTIO_DEV_BLK 0x1001 // legacy device ID of virtio-blk
+
+// Legacy virtio registers, from the I/O space in BAR 0
+#define VIRTIO_HOST_FEATURES  0x00
+#define VIRTIO_GUEST_FEATURES 0x04
+#define VIRTIO_QUEUE_PFN      0x08
+#define VIRTIO_QUEUE_SIZE     0x0C
+#define VIRTIO_QUEUE_SEL      0x0E
+#define VIRTIO_QUEUE_NOTIFY   0x10
+#define VIRTIO_STATUS         0x12
+#define VIRTIO_ISR            0x13
+#define VIRTIO_CONFIG         0x14 // device configuration, without MSI-X
+
+#define VIRTIO_STATUS_ACK      0x01
+#define VIRTIO_STATUS_DRIVER   0x02
+#define VIRTIO_STATUS_DRIVER_OK 0x04
+#define VIRTIO_STATUS_FAILED   0x80
+
+#define VIRTIO_BLK_F_SEG_MAX (1 << 2)
+
+// virtio-blk configuration fields
+#define VIRTIO_BLK_CAPACITY (VIRTIO_CONFIG + 0)  // 64 bits, in sectors
+#define VIRTIO_BLK_SEG_MAX  (VIRTIO_CONFIG + 12) // data descriptors per request
+
+#define VIRTIO_BLK_T_IN  0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_S_OK  0
+
+#define VRING_DESC_F_NEXT  1
+#define VRING_DESC_F_WRITE 2 // the device writes to the buffer
+
+#define VRING_ALIGN 4096
+
+struct VringDesc {
+  uint64_t addr;
+  uint32_t len;
+  uint16_t flags;
+  uint16_t next;
+};
+
+struct VringAvail {
+  uint16_t flags;
+  uint16_t idx;
+  uint16_t ring[];
+};
+
+struct VringUsedElem {
+  uint32_t id;
+  uint32_t len;
+};
+
+struct VringUsed {
+  uint16_t flags;
+  uint16_t idx;
+  struct VringUsedElem ring[];
+};
+
+struct VirtioBlkReq {
+  uint32_t type;
+  uint32_t reserved;
+  uint64_t sector;
+};
+
+// Request header and status byte of the request whose chain starts
+// at the descriptor of the same index
+struct VblkSlot {
+  struct VirtioBlkReq vs_req;
+  uint8_t vs_status;
+};
+
+// The queue, the request slots and a bounce buffer live in one 2MB
+// page, which is physically contiguous as the legacy queue must be.
+#define VBLK_MEM     ((char *)(DISKMAP - 8 * PTSIZE))
+#define VBLK_RING    VBLK_MEM
+#define VBLK_SLOTS   ((struct VblkSlot *)(VBLK_MEM + PTSIZE / 2))
+#define VBLK_BOUNCE  (VBLK_MEM + 3 * PTSIZE / 4)
+#define VBLK_NBOUNCE ((PTSIZE / 4) / SECTSIZE) // sectors in the bounce buffer
+#define VBLK_MAXQ    4096
+
+static uint16_t vblk_base; // I/O ports, 0 if there is no device
+static uint8_t vblk_irq;
+static uint64_t vblk_capacity;
+static uint32_t vblk_seg_max;
+static uint16_t vblk_qsz;
+
+static struct VringDesc *vblk_desc;
+static struct VringAvail *vblk_avail;
+static struct VringUsed *vblk_used;
+static uint16_t vblk_free;      // first free descriptor
+static uint16_t vblk_nfree;     // free descriptors
+static uint16_t vblk_used_idx;  // next used ring entry to look at
+static int vblk_error;          // a request of the current transfer failed
+
+// Physical address of va in the 2MB page at VBLK_MEM
+static physaddr_t
+vblk_pa(const void *va) {
+  return PTE_ADDR(uvpd[VPD(va)]) + ((uintptr_t)va & (PTSIZE - 1));
+}
+
+// Physical address of the byte at va for the device to read, or to
+// write to if 'to_mem'.  Returns 0 if va is not mapped, or not
+// writable (or copy-on-write) when it has to be.
+static physaddr_t
+vblk_dma_addr(uintptr_t va, bool to_mem) {
+  pte_t pte;
+
+  if (!(uvpml4e[PML4(va)] & PTE_P) || !(uvpde[VPDPE(va)] & PTE_P) ||
+      !(uvpd[VPD(va)] & PTE_P))
+    return 0;
+  if (uvpd[VPD(va)] & PTE_PS)
+    return vblk_pa((void *)va);
+  pte = uvpt[PGNUM(va)];
+  if (!(pte & PTE_P) || (to_mem && (!(pte & PTE_W) || (pte & PTE_COW))))
+    return 0;
+  return PTE_ADDR(pte) + PGOFF(va);
+}
+
+static bool
+vblk_match(struct PciFunc *f, void *arg) {
+  return f->pf_vendor == VIRTIO_VENDOR && f->pf_device == VIRTIO_DEV_BLK;
+}
+
+// Find a virtio-blk device and set up its queue.
+// Returns 0 on success, < 0 if there is no usable device.
+int
+virtio_blk_init(void) {
+  struct PciFunc pf;
+  uint32_t bar, features;
+  size_t ringsz;
+  int r, i;
+
+  if ((r = pci_find(vblk_match, NULL, &pf)) < 0)
+    return r;
+  bar = pci_bar(&pf, 0);
+  if (!(bar & 1) || pf.pf_irq >= 16) {
+    cprintf("virtio-blk: no legacy I/O registers or IRQ\n");
+    return -E_NOT_SUPP;
+  }
+  pci_enable(&pf, PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+  vblk_base = bar & ~3;
+  vblk_irq  = pf.pf_irq;
+
+  outb(vblk_base + VIRTIO_STATUS, 0);
+  outb(vblk_base + VIRTIO_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+  features = inl(vblk_base + VIRTIO_HOST_FEATURES) & VIRTIO_BLK_F_SEG_MAX;
+  outl(vblk_base + VIRTIO_GUEST_FEATURES, features);
+
+  vblk_capacity = inl(vblk_base + VIRTIO_BLK_CAPACITY) |
+                  ((uint64_t)inl(vblk_base + VIRTIO_BLK_CAPACITY + 4) << 32);
+  vblk_seg_max = (features & VIRTIO_BLK_F_SEG_MAX) ? inl(vblk_base + VIRTIO_BLK_SEG_MAX) : 0;
+
+  outw(vblk_base + VIRTIO_QUEUE_SEL, 0);
+  vblk_qsz = inw(vblk_base + VIRTIO_QUEUE_SIZE);
+  ringsz   = ROUNDUP(vblk_qsz * sizeof(struct VringDesc) + (3 + vblk_qsz) * sizeof(uint16_t), VRING_ALIGN) +
+           3 * sizeof(uint16_t) + vblk_qsz * sizeof(struct VringUsedElem);
+  if (vblk_qsz < 3 || vblk_qsz > VBLK_MAXQ || ringsz > PTSIZE / 2 ||
+      (r = sys_page_alloc_huge(0, VBLK_MEM, PTE_P | PTE_W)) < 0 ||
+      (r = sys_irq_listen(vblk_irq, vblk_base + VIRTIO_STATUS)) < 0) {
+    cprintf("virtio-blk: can't set up a queue of %d\n", vblk_qsz);
+    outb(vblk_base + VIRTIO_STATUS, VIRTIO_STATUS_FAILED);
+    vblk_base = 0;
+    return -E_NOT_SUPP;
+  }
+
+  vblk_desc  = (struct VringDesc *)VBLK_RING;
+  vblk_avail = (struct VringAvail *)(vblk_desc + vblk_qsz);
+  vblk_used  = (struct VringUsed *)ROUNDUP((char *)&vblk_avail->ring[vblk_qsz + 1], VRING_ALIGN);
+  for (i = 0; i < vblk_qsz; i++)
+    vblk_desc[i].next = i + 1;
+  vblk_free  = 0;
+  vblk_nfree = vblk_qsz;
+
+  outl(vblk_base + VIRTIO_QUEUE_PFN, vblk_pa(VBLK_RING) / PGSIZE);
+  outb(vblk_base + VIRTIO_STATUS,
+       VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+
+  cprintf("virtio-blk: %lu sectors, queue of %d, IRQ %d\n",
+          (unsigned long)vblk_capacity, vblk_qsz, vblk_irq);
+  return 0;
+}
+
+// Return the descriptor chain starting at 'head' to the free list.
+static void
+vblk_free_chain(uint16_t head) {
+  uint16_t i = head;
+
+  while (vblk_desc[i].flags & VRING_DESC_F_NEXT) {
+    vblk_nfree++;
+    i = vblk_desc[i].next;
+  }
+  vblk_nfree++;
+  vblk_desc[i].next = vblk_free;
+  vblk_free         = head;
+}
+
+// Free the requests the device has finished.  If 'wait' and it has
+// finished none, sleep on its interrupt first.  Returns the number
+// of requests freed.
+static int
+vblk_reap(bool wait) {
+  int n = 0, r;
+  uint16_t head;
+
+  while (1) {
+    __sync_synchronize();
+    while (vblk_used_idx != vblk_used->idx) {
+      head = vblk_used->ring[vblk_used_idx++ % vblk_qsz].id;
+      if (VBLK_SLOTS[head].vs_status != VIRTIO_BLK_S_OK)
+        vblk_error = -1;
+      vblk_free_chain(head);
+      n++;
+    }
+    if (n || !wait)
+      return n;
+    if ((r = sys_irq_wait(vblk_irq)) < 0)
+      panic("virtio-blk: sys_irq_wait: %i", r);
+    // Reading the ISR acknowledges the interrupt.
+    inb(vblk_base + VIRTIO_ISR);
+  }
+}
+
+// Take a free descriptor, or wait for one.
+static uint16_t
+vblk_alloc_desc(void) {
+  uint16_t i;
+
+  while (!vblk_nfree)
+    vblk_reap(1);
+  i = vblk_free;
+  vblk_free = vblk_desc[i].next;
+  vblk_nfree--;
+  return i;
+}
+
+// Take a descriptor for 'len' bytes at physical 'pa' and, if 'prev'
+// is set, chain it after *prev and make it the new *prev.
+static uint16_t
+vblk_chain(uint16_t *prev, physaddr_t pa, uint32_t len, uint16_t flags) {
+  uint16_t i = vblk_alloc_desc();
+
+  vblk_desc[i].addr  = pa;
+  vblk_desc[i].len   = len;
+  vblk_desc[i].flags = flags;
+  if (prev) {
+    vblk_desc[*prev].next = i;
+    vblk_desc[*prev].flags |= VRING_DESC_F_NEXT;
+    *prev = i;
+  }
+  return i;
+}
+
+// Queue a request for nsecs sectors from secno, to or from the pages
+// at va, and let the device know.  The pages have to be mapped,
+// writable if the device writes to them; returns -E_NOT_SUPP without
+// queueing anything otherwise.  Returns the number of sectors the
+// request covers, which are fewer than nsecs if the request ran out
+// of data descriptors.
+static int
+vblk_submit(uint32_t secno, void *va, size_t nsecs, bool write) {
+  uintptr_t p = (uintptr_t)va, end = p + nsecs * SECTSIZE;
+  uint32_t maxseg = vblk_qsz - 2, nseg = 0;
+  uint16_t head, last;
+  physaddr_t pa, seg_end = 0;
+  size_t n;
+
+  if (vblk_seg_max)
+    maxseg = MIN(maxseg, vblk_seg_max);
+  // Check the pages before taking any descriptors.
+  for (; p < end; p += n) {
+    n = MIN(end - p, PGSIZE - PGOFF(p));
+    if (!vblk_dma_addr(p, !write))
+      return -E_NOT_SUPP;
+  }
+
+  head = last = vblk_alloc_desc();
+  VBLK_SLOTS[head].vs_req.type     = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+  VBLK_SLOTS[head].vs_req.reserved = 0;
+  VBLK_SLOTS[head].vs_req.sector   = secno;
+  VBLK_SLOTS[head].vs_status       = 0xFF;
+  vblk_desc[head].addr  = vblk_pa(&VBLK_SLOTS[head].vs_req);
+  vblk_desc[head].len   = sizeof(struct VirtioBlkReq);
+  vblk_desc[head].flags = 0;
+
+  // One data descriptor for each physically contiguous run of pages.
+  for (p = (uintptr_t)va; p < end; p += n) {
+    pa = vblk_dma_addr(p, !write);
+    n  = MIN(end - p, PGSIZE - PGOFF(p));
+    if (nseg && pa == seg_end) {
+      vblk_desc[last].len += n;
+    } else {
+      if (nseg == maxseg)
+        break;
+      vblk_chain(&last, pa, n, write ? 0 : VRING_DESC_F_WRITE);
+      nseg++;
+    }
+    seg_end = pa + n;
+  }
+  vblk_chain(&last, vblk_pa(&VBLK_SLOTS[head].vs_status), 1, VRING_DESC_F_WRITE);
+
+  vblk_avail->ring[vblk_avail->idx % vblk_qsz] = head;
+  __sync_synchronize();
+  vblk_avail->idx++;
+  __sync_synchronize();
+  outw(vblk_base + VIRTIO_QUEUE_NOTIFY, 0);
+
+  return (p - (uintptr_t)va) / SECTSIZE;
+}
+
+// Transfer nsecs sectors from secno to va, or from va if 'write', in
+// as many requests at once as the queue holds, and wait for them all.
+static int
+vblk_rw(uint32_t secno, void *va, size_t nsecs, bool write) {
+  size_t n;
+  int r;
+
+  if (!vblk_base || secno + (uint64_t)nsecs > vblk_capacity)
+    return -E_INVAL;
+
+  vblk_error = 0;
+  while (nsecs > 0) {
+    if ((r = vblk_submit(secno, va, nsecs, write)) == -E_NOT_SUPP) {
+      // Go through the bounce buffer, one piece at a time.
+      n = MIN(nsecs, VBLK_NBOUNCE);
+      if (write)
+        memcpy(VBLK_BOUNCE, va, n * SECTSIZE);
+      r = vblk_submit(secno, VBLK_BOUNCE, n, write);
+      while (vblk_nfree < vblk_qsz)
+        vblk_reap(1);
+      if (!write)
+        memcpy(va, VBLK_BOUNCE, r * SECTSIZE);
+    }
+    secno += r;
+    va += r * SECTSIZE;
+    nsecs -= r;
+  }
+  while (vblk_nfree < vblk_qsz)
+    vblk_reap(1);
+  return vblk_error;
+}
+
+int
+virtio_blk_read(uint32_t secno, void *dst, size_t nsecs) {
+  return vblk_rw(secno, dst, nsecs, 0);
+}
+
+int
+virtio_blk_write(uint32_t secno, const void *src, size_t nsecs) {
+  return vblk_rw(secno, (void *)src, nsecs, 1);
+}
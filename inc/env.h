@@ -31,6 +31,32 @@ extern physaddr_t kern_cr3;
 #define NENV        (1 << LOG2NENV)
 #define ENVX(envid) ((envid) & (NENV - 1))
 
+// Scheduling priorities.  Level 0 is the most favored one; every level
+// has its own run queue and the scheduler always serves the lowest
+// numbered non-empty level first.
+#define NENVPRIO         8
+#define ENV_PRIO_HIGH    0
+#define ENV_PRIO_DEFAULT 4
+#define ENV_PRIO_LOW     (NENVPRIO - 1)
+
+// Up to IPC_MSG_WORDS words can go along with an IPC value, copied by
+// the kernel, so that small messages need no page.
+#define IPC_MSG_WORDS 16
+
+struct IpcMsg {
+  uint64_t im_nwords; // Words used in im_words
+  uint64_t im_words[IPC_MSG_WORDS];
+};
+
+// A run of up to IPC_MAX_PAGES pages can be sent, or received, where an
+// IPC takes a page address: IPC_PAGES(va, n) is the page-aligned 'va'
+// with n - 1 in the page offset bits.  A plain page address is a run
+// of one page.
+#define IPC_MAX_PAGES     256
+#define IPC_PAGES(va, n)  ((void *)((uintptr_t)(va) | ((n) - 1)))
+#define IPC_PAGES_VA(run) ((void *)((uintptr_t)(run) & ~(uintptr_t)(PGSIZE - 1)))
+#define IPC_PAGES_N(run)  (((uintptr_t)(run) & (PGSIZE - 1)) + 1)
+
 // Values of env_status in struct Env
 enum {
   ENV_FREE = 0,
@@ -58,9 +84,17 @@ struct Env {
   uint32_t env_runs;       // Number of times environment has run
   uint8_t *binary;         // Pointer to process ELF image in kernel memory
 
+  // Scheduling
+  int env_priority;        // Run queue level, see NENVPRIO
+  bool env_rq_linked;      // Env is on a run queue
+  struct Env *env_rq_next; // Next env on the same run queue level
+  struct Env *env_rq_prev; // Previous env on the same run queue level
+
   // Address space
   pml4e_t *env_pml4e; // Kernel virtual address of page dir
   physaddr_t env_cr3;
+  uint16_t env_pcid;       // TLB tag of the address space, 0 is the kernel's
+  bool env_pcid_stale;     // TLB may hold stale entries tagged with env_pcid
 
   // Exception handling
   void *env_pgfault_upcall; // Page fault upcall entry point
@@ -71,6 +105,31 @@ struct Env {
   uint32_t env_ipc_value; // Data value sent to us
   envid_t env_ipc_from;   // envid of the sender
   int env_ipc_perm;       // Perm of page mapping received
+  size_t env_ipc_npages;  // Number of pages received
+  envid_t env_ipc_recv_from; // Only accept messages from this env, 0 for any
+  struct IpcMsg env_ipc_msg; // Message words received
+
+  // Blocking IPC send
+  struct Env *env_ipc_senders;      // Senders blocked on us, oldest first
+  struct Env *env_ipc_senders_tail; // Newest blocked sender
+  struct Env *env_ipc_send_to;      // Receiver we are blocked sending to
+  struct Env *env_ipc_send_next;    // Next sender blocked on the same receiver
+  uint32_t env_ipc_send_value;      // Pending value
+  void *env_ipc_send_srcva;         // Pending page, or >= UTOP for none
+  int env_ipc_send_perm;            // Perm of the pending page
+  bool env_ipc_calling;             // Pending send is a sys_ipc_call
+  struct IpcMsg env_ipc_send_msg;   // Pending message words
+  struct Env *env_ipc_callers;      // Callers waiting for our reply
+  struct Env *env_ipc_wait_next;    // Next caller waiting on the same env
+  struct Env **env_ipc_wait_pprev;  // Link to us in that list, or NULL
+  int env_ipc_timeout;              // Seconds a receive may block, 0 for ever
+  int env_ipc_since;                // When the timed receive blocked
+  struct Env *env_ipc_timed_next;   // Next env in a receive that times out
+  struct Env **env_ipc_timed_pprev; // Link to us in that list, or NULL
+
+  // Hardware interrupts, see sys_irq_listen
+  uint16_t env_irq_pending; // IRQs that arrived and were not waited for
+  uint16_t env_irq_wait;    // IRQs we are blocked waiting for
 };
 
 #endif // !JOS_INC_ENV_H
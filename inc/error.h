@@ -29,6 +29,8 @@ enum {
   E_NOT_EXEC    = 17, // File not a valid executable
   E_NOT_SUPP    = 18, // Operation not supported
 
+  E_TIMEOUT     = 19, // Blocking IPC receive timed out
+
   MAXERROR
 };
 
@@ -27,8 +27,25 @@
 // Number of direct block pointers in an indirect block
 #define NINDIRECT (BLKSIZE / 4)
 
+// Largest file that block pointers can map
 #define MAXFILESIZE ((NDIRECT + NINDIRECT) * BLKSIZE)
 
+// A run of a file's blocks that lie in a row on disk: file blocks
+// e_lblk to e_lblk + e_len - 1 are disk blocks e_pblk on.
+struct Extent {
+  uint32_t e_lblk; // first file block
+  uint32_t e_pblk; // first disk block
+  uint32_t e_len;  // number of blocks
+} __attribute__((packed));
+
+// Number of extents in a File descriptor
+#define NEXTENT 5
+// Number of extents in an extent block
+#define NEXTBLK (BLKSIZE / sizeof(struct Extent))
+
+// File flags
+#define FILE_EXTENTS 0x1 // blocks are mapped by extents, not pointers
+
 struct File {
   char f_name[MAXNAMELEN]; // filename
   off_t f_size;            // file size in bytes
@@ -39,9 +56,17 @@ struct File {
   uint32_t f_direct[NDIRECT]; // direct blocks
   uint32_t f_indirect;        // indirect block
 
+  // Extents, used instead of the block pointers if FILE_EXTENTS is
+  // set.  They are sorted by e_lblk; the first NEXTENT are here, the
+  // rest in the extent block.  Blocks in no extent are not allocated.
+  uint32_t f_flags;                // FILE_* flags
+  uint32_t f_nextent;              // number of extents
+  struct Extent f_extent[NEXTENT]; // first extents
+  uint32_t f_extblock;             // extent block, for the rest
+
   // Pad out to 256 bytes; must do arithmetic in case we're compiling
   // fsformat on a 64-bit machine.
-  uint8_t f_pad[256 - MAXNAMELEN - 8 - 4 * NDIRECT - 4];
+  uint8_t f_pad[256 - MAXNAMELEN - 8 - 4 * NDIRECT - 4 - 8 - 12 * NEXTENT - 4];
 } __attribute__((packed)); // required only on some 64-bit machines
 
 // An inode block contains exactly BLKFILES 'struct File's
@@ -78,7 +103,29 @@ enum {
   FSREQ_SNPSHT,
   FSREQ_DFRG,
   FSREQ_TSTDFRG,
-  FSREQ_SYNC
+  FSREQ_SYNC,
+  // Read-map takes a Fsreq_read and maps the file's pages into the caller
+  FSREQ_READ_MAP,
+  // Write-map takes a Fsreq_write_map and the caller's pages, shared
+  // copy-on-write, which become the file's blocks
+  FSREQ_WRITE_MAP,
+  // Map takes a Fsreq_map and maps the file's pages into the caller
+  // for mmap(), shared and writable if asked to
+  FSREQ_MAP,
+  // Msync takes a Fsreq_msync for the pages the caller wrote through
+  // such a mapping, and writes them to disk
+  FSREQ_MSYNC,
+  // Bcstat returns a struct BcStat on the request page
+  FSREQ_BCSTAT
+};
+
+// Block-cache counters of the file server
+struct BcStat {
+  uint64_t bs_hits;      // file blocks that were in the cache when used
+  uint64_t bs_misses;    // blocks read from disk when first touched
+  uint64_t bs_ra_blocks; // blocks read ahead of their use
+  uint64_t bs_ra_reads;  // disk reads that read ahead
+  uint64_t bs_evictions; // blocks dropped to keep the cache bounded
 };
 
 union Fsipc {
@@ -102,6 +149,21 @@ union Fsipc {
     size_t req_n;
     char req_buf[PGSIZE - (2 * sizeof(size_t))];
   } write;
+  struct Fsreq_write_map {
+    int req_fileid;
+    size_t req_n;
+  } write_map;
+  struct Fsreq_map {
+    int req_fileid;
+    off_t req_offset;
+    size_t req_n;
+    int req_write;
+  } map;
+  struct Fsreq_msync {
+    int req_fileid;
+    off_t req_offset;
+    size_t req_n;
+  } msync;
   struct Fsreq_stat {
     int req_fileid;
   } stat;
@@ -110,6 +172,7 @@ union Fsipc {
     off_t ret_size;
     int ret_isdir;
   } statRet;
+  struct BcStat bcstatRet;
   struct Fsreq_flush {
     int req_fileid;
   } flush;
@@ -47,6 +47,7 @@ void exit(void);
 
 // pgfault.c
 void set_pgfault_handler(void (*handler)(struct UTrapframe *utf));
+void set_pgfault_mmap(int (*hook)(struct UTrapframe *utf));
 
 // readline.c
 char *readline(const char *buf);
@@ -60,13 +61,25 @@ void sys_yield(void);
 static envid_t sys_exofork(void);
 int sys_env_set_status(envid_t env, int status);
 int sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
+int sys_env_set_priority(envid_t env, int prio);
 int sys_env_set_pgfault_upcall(envid_t env, void *upcall);
 int sys_page_alloc(envid_t env, void *pg, int perm);
+int sys_page_alloc_huge(envid_t env, void *va, int perm);
+envid_t sys_fork_cow(void);
 int sys_page_map(envid_t src_env, void *src_pg,
                  envid_t dst_env, void *dst_pg, int perm);
 int sys_page_unmap(envid_t env, void *pg);
+int sys_page_harvest(void *va, size_t npages, uint64_t *bitmap, int flags);
 int sys_ipc_try_send(envid_t to_env, uint64_t value, void *pg, int perm);
+int sys_ipc_send(envid_t to_env, uint64_t value, void *pg, int perm, const struct IpcMsg *msg);
+int sys_ipc_call(envid_t to_env, uint64_t value, void *pg, int perm,
+                 const struct IpcMsg *msg, void *rcv_pg);
+int sys_ipc_reply_wait(envid_t to_env, uint64_t value, void *pg, int perm,
+                       const struct IpcMsg *msg, void *rcv_pg);
 int sys_ipc_recv(void *rcv_pg);
+int sys_ipc_timeout(unsigned secs);
+int sys_irq_listen(unsigned irq, uint16_t stopport);
+int sys_irq_wait(unsigned irq);
 int sys_gettime(void);
 
 int vsys_gettime(void);
@@ -84,11 +97,18 @@ sys_exofork(void) {
 
 // ipc.c
 void ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
+void ipc_send_msg(envid_t to_env, uint32_t value, const struct IpcMsg *msg);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+void ipc_send_pages(envid_t to_env, uint32_t value, void *pg, size_t npages, int perm);
+int32_t ipc_recv_pages(envid_t *from_env_store, void *pg, size_t npages,
+                       int *perm_store, size_t *npages_store);
+int32_t ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+                 const struct IpcMsg *msg, void *rcv_pg, int *perm_store);
+int32_t ipc_reply_wait(envid_t to_env, uint32_t value, void *pg, int perm, const struct IpcMsg *msg,
+                       envid_t *from_env_store, void *rcv_pg, int *perm_store);
 envid_t ipc_find_env(enum EnvType type);
 
 // fork.c
-#define PTE_SHARE 0x400
 envid_t fork(void);
 envid_t sfork(void); // Challenge!
 
@@ -108,6 +128,11 @@ int open(const char *path, int mode);
 int ftruncate(int fd, off_t size);
 int remove(const char *path);
 int sync(void);
+int bcstat(struct BcStat *st);
+void *mmap(int fd, off_t off, size_t len, int prot, int flags);
+int msync(void *addr, size_t len);
+int munmap(void *addr, size_t len);
+void munmap_all(void);
 
 // pageref.c
 int pageref(void *addr);
@@ -140,6 +165,13 @@ void wait(envid_t env);
 #define O_EXCL  0x0400 /* error if already exists */
 #define O_MKDIR 0x0800 /* create directory, not regular file */
 
+/* mmap protections and flags */
+#define PROT_READ  0x1 /* pages can be read */
+#define PROT_WRITE 0x2 /* pages can be written */
+
+#define MAP_SHARED  0x1 /* writes go to the file */
+#define MAP_PRIVATE 0x2 /* writes make private copies */
+
 #ifdef JOS_PROG
 extern void (*volatile sys_exit)(void);
 extern void (*volatile sys_yield)(void);
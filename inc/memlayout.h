@@ -17,9 +17,13 @@
 #define GD_KD   0x10 // kernel data
 #define GD_KT32 0x18 // kernel text 32bit
 #define GD_KD32 0x20 // kernel data 32bit
-#define GD_UT   0x28 // user text
-#define GD_UD   0x30 // user data
-#define GD_TSS0 0x38 // Task segment selector for CPU 0
+// sysretq takes user data from STAR + 8 and user text from STAR + 16,
+// so user data must come right before user text, and STAR points at
+// GD_USYSRET, which is never loaded.
+#define GD_USYSRET 0x28 // sysretq base, unused
+#define GD_UD      0x30 // user data
+#define GD_UT      0x38 // user text
+#define GD_TSS0    0x40 // Task segment selector for CPU 0
 
 /*
  * Virtual memory map:                                Permissions
@@ -230,7 +234,8 @@ extern volatile pml4e_t uvpml4e[]; // VA of current page map level 4
  * with page2pa() in kern/pmap.h.
  */
 struct PageInfo {
-  // Next page on the free list.
+  // Next block on the buddy free list.
+  // Only the first page of a free block is linked.
   struct PageInfo *pp_link;
 
   // pp_ref is the count of pointers (usually in page table entries)
@@ -239,6 +244,21 @@ struct PageInfo {
   // boot_alloc do not have valid reference count fields.
 
   uint16_t pp_ref;
+
+  // Free state of the page (PAGE_IN_USE if allocated, see kern/pmap.h)
+  // and, for the first page of a free buddy block, log2 of its size.
+  uint8_t pp_order;
+  uint8_t pp_free;
+
+  union {
+    // Index of the previous block on the same free list, 0 for the head
+    // (page 0 is never free).  An index keeps the structure at 16 bytes.
+    uint32_t pp_prev;
+    // PCID of the address space, if this page is an env's PML4.
+    uint32_t pp_pcid;
+    // Owner of the page, if it was handed out by kmalloc (kern/kmalloc.c).
+    uint32_t pp_kmem;
+  };
 };
 
 #endif /* !__ASSEMBLER__ */
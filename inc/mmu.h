@@ -61,6 +61,8 @@
 #define PTSIZE  (PGSIZE * NPTENTRIES) // bytes mapped by a page directory entry
 #define PTSHIFT 21                    // log2(PTSIZE)
 
+#define PDPSIZE ((uint64_t)PTSIZE * NPDENTRIES) // bytes mapped by a page directory pointer entry
+
 #define PTXSHIFT  12 // offset of PTX in a linear address
 #define PDXSHIFT  21 // offset of PDX in a linear address
 #define PDPESHIFT 30
@@ -82,6 +84,10 @@
 // hardware, so user processes are allowed to set them arbitrarily.
 #define PTE_AVAIL 0xE00 // Available for software use
 
+// Software bits that the user library and the kernel agree on.
+#define PTE_SHARE 0x400 // Shared with children by fork and spawn
+#define PTE_COW   0x800 // Copy-on-write
+
 // Flags in PTE_SYSCALL may be used in system calls.  (Others may not.)
 #define PTE_SYSCALL (PTE_AVAIL | PTE_P | PTE_W | PTE_U)
 
@@ -101,6 +107,8 @@
 #define CR0_CD 0x40000000 // Cache Disable
 #define CR0_PG 0x80000000 // Paging
 
+#define CR4_PCIDE 0x00020000 // Process-context identifiers enable
+#define CR4_PGE   0x00000080 // Page Global Enable
 #define CR4_PCE 0x00000100 // Performance counter enable
 #define CR4_MCE 0x00000040 // Machine Check Enable
 #define CR4_PSE 0x00000010 // Page Size Extensions
@@ -111,9 +119,24 @@
 
 //x86_64 related changes
 #define CR4_PAE  0x00000020
+
+// With CR4_PCIDE, the low 12 bits of CR3 are the PCID, and setting
+// CR3_NOFLUSH keeps the TLB entries tagged with it on a CR3 load.
+#define CR3_PCID_MASK 0xFFF
+#define CR3_NOFLUSH   (1ULL << 63)
+
+// INVPCID types
+#define INVPCID_ADDR   0 // One address in one PCID
+#define INVPCID_SINGLE 1 // All non-global entries of one PCID
 #define EFER_MSR 0xC0000080
+#define EFER_SCE 0 // SYSCALL/SYSRET enable (bit number, like EFER_LME)
 #define EFER_LME 8
 
+// SYSCALL/SYSRET MSRs
+#define STAR_MSR   0xC0000081 // Segment selectors for syscall and sysret
+#define LSTAR_MSR  0xC0000082 // 64-bit syscall entry point
+#define SFMASK_MSR 0xC0000084 // RFLAGS bits cleared on syscall
+
 // Eflags register
 #define FL_CF        0x00000001 // Carry Flag
 #define FL_PF        0x00000004 // Parity Flag
@@ -18,7 +18,21 @@ enum {
   SYS_ipc_try_send,
   SYS_ipc_recv,
   SYS_gettime,
+  SYS_env_set_priority,
+  SYS_page_alloc_huge,
+  SYS_fork_cow,
+  SYS_ipc_send,
+  SYS_ipc_call,
+  SYS_ipc_reply_wait,
+  SYS_irq_listen,
+  SYS_irq_wait,
+  SYS_page_harvest,
+  SYS_ipc_timeout,
   NSYSCALLS
 };
 
+// sys_page_harvest flag: clear the bits it reports.  The other flags
+// are the PTE_A, PTE_D and PTE_AVAIL bits to look at.
+#define HARVEST_CLEAR 0x1000
+
 #endif /* !JOS_INC_SYSCALL_H */
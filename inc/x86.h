@@ -17,6 +17,7 @@ static __inline void outsw(int port, const void *addr, int cnt) __attribute__((a
 static __inline void outsl(int port, const void *addr, int cnt) __attribute__((always_inline));
 static __inline void outl(int port, uint32_t data) __attribute__((always_inline));
 static __inline void invlpg(void *addr) __attribute__((always_inline));
+static __inline void invpcid(uint64_t type, uint64_t pcid, void *addr) __attribute__((always_inline));
 static __inline void lidt(void *p) __attribute__((always_inline));
 static __inline void lgdt(void *p) __attribute__((always_inline));
 static __inline void lldt(uint16_t sel) __attribute__((always_inline));
@@ -34,7 +35,10 @@ static __inline void write_rflags(uint64_t rflags) __attribute__((always_inline)
 static __inline uint64_t read_rbp(void) __attribute__((always_inline));
 static __inline uint64_t read_rsp(void) __attribute__((always_inline));
 static __inline void cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp);
+static __inline void cpuid_count(uint32_t info, uint32_t count, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp);
 static __inline uint64_t read_tsc(void) __attribute__((always_inline));
+static __inline uint64_t rdmsr(uint32_t msr) __attribute__((always_inline));
+static __inline void wrmsr(uint32_t msr, uint64_t val) __attribute__((always_inline));
 
 static __inline void
 breakpoint(void) {
@@ -145,6 +149,18 @@ invlpg(void *addr) {
                    : "memory");
 }
 
+static __inline void
+invpcid(uint64_t type, uint64_t pcid, void *addr) {
+  struct {
+    uint64_t pcid;
+    uint64_t addr;
+  } desc = {pcid, (uint64_t)addr};
+  __asm __volatile("invpcid %0,%1"
+                   :
+                   : "m"(desc), "r"(type)
+                   : "memory");
+}
+
 static __inline void
 lidt(void *p) {
   __asm __volatile("lidt (%0)"
@@ -283,6 +299,22 @@ cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *e
     *edxp = edx;
 }
 
+static __inline void
+cpuid_count(uint32_t info, uint32_t count, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp) {
+  uint32_t eax, ebx, ecx, edx;
+  asm volatile("cpuid"
+               : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+               : "a"(info), "c"(count));
+  if (eaxp)
+    *eaxp = eax;
+  if (ebxp)
+    *ebxp = ebx;
+  if (ecxp)
+    *ecxp = ecx;
+  if (edxp)
+    *edxp = edx;
+}
+
 static __inline uint64_t
 read_tsc(void) {
   uint32_t lo, hi;
@@ -293,6 +325,22 @@ read_tsc(void) {
   return res;
 }
 
+static __inline uint64_t
+rdmsr(uint32_t msr) {
+  uint32_t lo, hi;
+  __asm __volatile("rdmsr"
+                   : "=a"(lo), "=d"(hi)
+                   : "c"(msr));
+  return (uint64_t)lo | ((uint64_t)hi << 32);
+}
+
+static __inline void
+wrmsr(uint32_t msr, uint64_t val) {
+  __asm __volatile("wrmsr"
+                   :
+                   : "c"(msr), "a"((uint32_t)val), "d"((uint32_t)(val >> 32)));
+}
+
 static inline uint32_t
 xchg(volatile uint32_t *addr, uint32_t newval) {
   uint32_t result;
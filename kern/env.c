@@ -6,6 +6,7 @@
 #include <inc/string.h>
 #include <inc/assert.h>
 #include <inc/elf.h>
+#include <inc/vsyscall.h>
 
 #include <kern/env.h>
 #include <kern/pmap.h>
@@ -15,6 +16,7 @@
 #include <kern/cpu.h>
 #include <kern/kdebug.h>
 #include <kern/macro.h>
+#include <kern/vsyscall.h>
 
 #ifdef CONFIG_KSPACE
 struct Env env_array[NENV];
@@ -44,7 +46,7 @@ static struct Env *env_free_list; // Free environment list
 // definition of gdt specifies the Descriptor Privilege Level (DPL)
 // of that descriptor: 0 for kernel and 3 for user.
 //
-struct Segdesc gdt[2 * NCPU + 7] =
+struct Segdesc gdt[2 * NCPU + 8] =
     {
         // 0x0 - unused (always faults -- for trapping NULL far pointers)
         SEG_NULL,
@@ -61,17 +63,20 @@ struct Segdesc gdt[2 * NCPU + 7] =
         // 0x20 - kernel data segment 32bit
         [GD_KD32 >> 3] = SEG(STA_W, 0x0, 0xffffffff, 0),
 
-        // 0x28 - user code segment
-        [GD_UT >> 3] = SEG64(STA_X | STA_R, 0x0, 0xffffffff, 3),
+        // 0x28 - unused, the base sysretq finds user data and text from
+        [GD_USYSRET >> 3] = SEG_NULL,
 
         // 0x30 - user data segment
         [GD_UD >> 3] = SEG64(STA_W, 0x0, 0xffffffff, 3),
 
+        // 0x38 - user code segment
+        [GD_UT >> 3] = SEG64(STA_X | STA_R, 0x0, 0xffffffff, 3),
+
         // Per-CPU TSS descriptors (starting from GD_TSS0) are initialized
         // in trap_init_percpu()
         [GD_TSS0 >> 3] = SEG_NULL,
 
-        [8] = SEG_NULL //last 8 bytes of the tss since tss is 16 bytes long
+        [(GD_TSS0 >> 3) + 1] = SEG_NULL //last 8 bytes of the tss since tss is 16 bytes long
 };
 
 struct Pseudodesc gdt_pd = {
@@ -138,6 +143,9 @@ env_init(void) {
     // initialization in for loop every new environment till max env met
     envs[i].env_link = env_free_list;
     envs[i].env_id   = 0;
+    // Every slot owns a PCID for good: there are fewer envs than the
+    // 4095 PCIDs available, and 0 stays with the kernel's page tables.
+    envs[i].env_pcid = i + 1;
     env_free_list    = &envs[i];
   }
   env_init_percpu();
@@ -205,6 +213,7 @@ env_setup_vm(struct Env *e) {
 
   e->env_pml4e = page2kva(p); // вирт. адрес таблицы страниц 4 уровня
   e->env_cr3 = page2pa(p); // физич. адрес
+  p->pp_pcid = e->env_pcid; // для tlb_invalidate чужого адресного пространства
 
   e->env_pml4e[1] = kern_pml4e[1]; // например, для системных вызовов
   pa2page(PTE_ADDR(kern_pml4e[1]))->pp_ref++;
@@ -248,8 +257,10 @@ env_alloc(struct Env **newenv_store, envid_t parent_id) {
 #else
   e->env_type      = ENV_TYPE_USER;
 #endif
-  e->env_status = ENV_RUNNABLE;
-  e->env_runs   = 0;
+  e->env_status   = ENV_RUNNABLE;
+  e->env_runs     = 0;
+  e->env_priority = ENV_PRIO_DEFAULT;
+  runq_insert(e);
 
   // Clear out all the saved register state,
   // to prevent the register values
@@ -295,6 +306,18 @@ env_alloc(struct Env **newenv_store, envid_t parent_id) {
 
   // Also clear the IPC receiving flag.
   e->env_ipc_recving = 0;
+  e->env_ipc_senders = e->env_ipc_senders_tail = NULL;
+  e->env_ipc_send_to = e->env_ipc_send_next = NULL;
+  e->env_ipc_recv_from = 0;
+  e->env_ipc_calling   = 0;
+  e->env_ipc_callers = e->env_ipc_wait_next = NULL;
+  e->env_ipc_wait_pprev = NULL;
+  e->env_ipc_timeout     = 0;
+  e->env_ipc_timed_next  = NULL;
+  e->env_ipc_timed_pprev = NULL;
+  e->env_ipc_msg.im_nwords = 0;
+
+  e->env_irq_pending = e->env_irq_wait = 0;
 
   // commit the allocation
   env_free_list = e->env_link;
@@ -544,6 +567,159 @@ env_create(uint8_t *binary, enum EnvType type){
 
   load_icode(newenv, binary); // load instruction code
 }
+
+//
+// Queue 'sender', which is blocking in sys_ipc_send, on 'receiver'.
+//
+void
+env_ipc_block_sender(struct Env *sender, struct Env *receiver) {
+  sender->env_ipc_send_to   = receiver;
+  sender->env_ipc_send_next = NULL;
+  if (receiver->env_ipc_senders_tail)
+    receiver->env_ipc_senders_tail->env_ipc_send_next = sender;
+  else
+    receiver->env_ipc_senders = sender;
+  receiver->env_ipc_senders_tail = sender;
+}
+
+//
+// Take the oldest sender blocked on 'receiver' off its queue.
+// Returns NULL if there is none.
+//
+struct Env *
+env_ipc_next_sender(struct Env *receiver) {
+  struct Env *sender = receiver->env_ipc_senders;
+
+  if (sender) {
+    if (!(receiver->env_ipc_senders = sender->env_ipc_send_next))
+      receiver->env_ipc_senders_tail = NULL;
+    sender->env_ipc_send_to   = NULL;
+    sender->env_ipc_send_next = NULL;
+  }
+  return sender;
+}
+
+//
+// Make 'caller', whose request 'callee' has taken, receive from
+// 'callee' alone until it replies.
+//
+void
+env_ipc_wait_reply(struct Env *caller, struct Env *callee) {
+  caller->env_ipc_recving   = 1;
+  caller->env_ipc_recv_from = callee->env_id;
+  if ((caller->env_ipc_wait_next = callee->env_ipc_callers))
+    callee->env_ipc_callers->env_ipc_wait_pprev = &caller->env_ipc_wait_next;
+  callee->env_ipc_callers    = caller;
+  caller->env_ipc_wait_pprev = &callee->env_ipc_callers;
+}
+
+//
+// Stop 'e' from waiting for a reply, if it is, and let it receive
+// from anyone again.
+//
+void
+env_ipc_end_wait(struct Env *e) {
+  if (e->env_ipc_wait_pprev) {
+    if ((*e->env_ipc_wait_pprev = e->env_ipc_wait_next))
+      e->env_ipc_wait_next->env_ipc_wait_pprev = e->env_ipc_wait_pprev;
+    e->env_ipc_wait_next  = NULL;
+    e->env_ipc_wait_pprev = NULL;
+  }
+  e->env_ipc_recv_from = 0;
+}
+
+// Envs blocked in a receive that gives up after env_ipc_timeout.
+static struct Env *ipc_timed;
+
+//
+// Make 'e', about to block receiving from anyone, give up after
+// env_ipc_timeout seconds, if it has set one (see sys_ipc_timeout).
+//
+void
+env_ipc_arm_timeout(struct Env *e) {
+  if (!e->env_ipc_timeout || e->env_ipc_timed_pprev)
+    return;
+  e->env_ipc_since = vsys[VSYS_gettime];
+  if ((e->env_ipc_timed_next = ipc_timed))
+    ipc_timed->env_ipc_timed_pprev = &e->env_ipc_timed_next;
+  ipc_timed              = e;
+  e->env_ipc_timed_pprev = &ipc_timed;
+}
+
+//
+// Stop the receive of 'e' from timing out, if it can.
+//
+void
+env_ipc_disarm_timeout(struct Env *e) {
+  if (e->env_ipc_timed_pprev) {
+    if ((*e->env_ipc_timed_pprev = e->env_ipc_timed_next))
+      e->env_ipc_timed_next->env_ipc_timed_pprev = e->env_ipc_timed_pprev;
+    e->env_ipc_timed_next  = NULL;
+    e->env_ipc_timed_pprev = NULL;
+  }
+}
+
+//
+// Called from the clock interrupt: fail the receives that have blocked
+// for their env_ipc_timeout by 'now' with -E_TIMEOUT.
+//
+void
+env_ipc_check_timeouts(int now) {
+  struct Env *e, *next;
+
+  for (e = ipc_timed; e; e = next) {
+    next = e->env_ipc_timed_next;
+    if (now - e->env_ipc_since < e->env_ipc_timeout)
+      continue;
+    env_ipc_disarm_timeout(e);
+    e->env_ipc_recving        = 0;
+    e->env_tf.tf_regs.reg_rax = -E_TIMEOUT;
+    e->env_status             = ENV_RUNNABLE;
+    runq_insert(e);
+  }
+}
+
+// Is some env blocked in a receive that times out?
+bool
+env_ipc_timing(void) {
+  return ipc_timed != NULL;
+}
+
+// Take 'e' out of IPC: leave the queue it is blocked on, or the
+// callers of the env it waits for, if any, and fail the sends of
+// everyone blocked on it, and the calls of everyone waiting for its
+// reply, with -E_BAD_ENV.
+static void
+env_ipc_cancel(struct Env *e) {
+  struct Env *receiver = e->env_ipc_send_to, **pp, *prev = NULL, *sender, *caller;
+
+  if (receiver) {
+    for (pp = &receiver->env_ipc_senders; *pp != e; pp = &(*pp)->env_ipc_send_next)
+      prev = *pp;
+    *pp = e->env_ipc_send_next;
+    if (receiver->env_ipc_senders_tail == e)
+      receiver->env_ipc_senders_tail = prev;
+    e->env_ipc_send_to = e->env_ipc_send_next = NULL;
+  }
+
+  while ((sender = env_ipc_next_sender(e))) {
+    sender->env_ipc_calling        = 0;
+    sender->env_tf.tf_regs.reg_rax = -E_BAD_ENV;
+    sender->env_status             = ENV_RUNNABLE;
+    runq_insert(sender);
+  }
+
+  env_ipc_end_wait(e);
+  env_ipc_disarm_timeout(e);
+  while ((caller = e->env_ipc_callers)) {
+    env_ipc_end_wait(caller);
+    caller->env_ipc_recving        = 0;
+    caller->env_tf.tf_regs.reg_rax = -E_BAD_ENV;
+    caller->env_status             = ENV_RUNNABLE;
+    runq_insert(caller);
+  }
+}
+
 //
 // Frees env e and all memory it uses.
 //
@@ -567,6 +743,9 @@ env_free(struct Env *e) {
   // Note the environment's demise.
   cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
+  // Stop the devices e drives before its pages can be reused.
+  irq_release(e);
+
 #ifndef CONFIG_KSPACE
   // Flush all mapped pages in the user portion of the address space
   static_assert(UTOP % PTSIZE == 0, "Misaligned UTOP");
@@ -586,6 +765,12 @@ env_free(struct Env *e) {
       if (!(pgdir[pdeno] & PTE_P))
         continue;
 
+      // a 2MB page has no page table to free
+      if (pgdir[pdeno] & PTE_PS) {
+        page_remove(e->env_pml4e, PGADDR((uint64_t)0, pdpeno, pdeno, 0, 0));
+        continue;
+      }
+
       // find the pa and va of the page table
       pa = PTE_ADDR(pgdir[pdeno]);
       pt = (pte_t *)KADDR(pa);
@@ -615,8 +800,13 @@ env_free(struct Env *e) {
   e->env_pml4e    = 0;
   e->env_cr3      = 0;
   page_decref(pa2page(pa));
+
+  // The next env in this slot reuses the PCID.
+  tlb_invalidate_pcid(e->env_pcid, NULL);
 #endif
   // return the environment to the free list
+  env_ipc_cancel(e);
+  runq_remove(e);
   e->env_status = ENV_FREE;
   e->env_link   = env_free_list;
   env_free_list = e;
@@ -766,14 +956,26 @@ env_run(struct Env *e) {
       }
     } else if (curenv->env_status == ENV_RUNNING) { // если процесс можем запустить
       curenv->env_status = ENV_RUNNABLE;  // запускаем процесс
+      if (curenv != e)
+        runq_insert(curenv);  // в хвост очереди своего приоритета
     }
   }
+  runq_remove(e);
   
   curenv = e;  // текущая среда – е
   curenv->env_status = ENV_RUNNING; // устанавливаем статус среды на "выполняется"
   curenv->env_runs++; // обновляем количество запусков контекста процесса
 
-  lcr3(curenv->env_cr3);
+  // Keep the TLB entries tagged with the env's PCID unless some of
+  // them may be stale.
+  if (!pcid_enabled) {
+    lcr3(curenv->env_cr3);
+  } else if (curenv->env_pcid_stale) {
+    curenv->env_pcid_stale = 0;
+    lcr3(curenv->env_cr3 | curenv->env_pcid);
+  } else {
+    lcr3(curenv->env_cr3 | curenv->env_pcid | CR3_NOFLUSH);
+  }
 
   env_pop_tf(&curenv->env_tf); // восстанавливаем из curen все переменные окружения
   
@@ -14,6 +14,14 @@ void env_init(void);
 void env_init_percpu(void);
 int env_alloc(struct Env **e, envid_t parent_id);
 void env_free(struct Env *e);
+void env_ipc_block_sender(struct Env *sender, struct Env *receiver);
+struct Env *env_ipc_next_sender(struct Env *receiver);
+void env_ipc_wait_reply(struct Env *caller, struct Env *callee);
+void env_ipc_end_wait(struct Env *e);
+void env_ipc_arm_timeout(struct Env *e);
+void env_ipc_disarm_timeout(struct Env *e);
+void env_ipc_check_timeouts(int now);
+bool env_ipc_timing(void);
 void env_create(uint8_t *binary, enum EnvType type);
 void env_destroy(struct Env *e); // Does not return if e == curenv
 
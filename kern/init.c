@@ -10,6 +10,7 @@
 #include <kern/tsc.h>
 #include <kern/console.h>
 #include <kern/pmap.h>
+#include <kern/kmalloc.h>
 #include <kern/env.h>
 #include <kern/timer.h>
 #include <kern/trap.h>
@@ -123,6 +124,7 @@ i386_init(void) {
 #ifndef CONFIG_KSPACE
   // Lab 6 memory management initialization functions
   mem_init();
+  kmem_init();
 #endif
 
   // Perform global constructor initialisation (e.g. asan)
@@ -0,0 +1,389 @@
+/* See COPYRIGHT for copyright information. */
+
+// Slab allocator for small kernel objects.
+//
+// Every cache hands out objects of one size, carved out of slabs: buddy
+// blocks of 2^order pages that start with a struct kmem_slab.  The
+// PageInfo of every page of a slab records the slab's first page, so
+// kfree() finds the owning cache in O(1).  kmalloc() rounds the request
+// up to a power-of-two size class and uses that class's cache; larger
+// requests get whole buddy blocks.
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/stdio.h>
+
+#include <kern/kmalloc.h>
+#include <kern/pmap.h>
+
+// A slab is at most 2^KMEM_SLAB_MAX_ORDER pages, and is grown up to
+// that size until it holds at least KMEM_SLAB_MIN_OBJS objects.
+#define KMEM_SLAB_MAX_ORDER 3
+#define KMEM_SLAB_MIN_OBJS  8
+
+// pp_kmem of the first page of a block that kmalloc() took directly
+// from the buddy allocator: the flag, or'ed with the block's order.
+#define KMEM_LARGE 0x80000000U
+
+// The fast stack is a pointer in the low 48 bits and a generation
+// count in the high 16 bits, bumped on every update so that a
+// compare-and-swap does not succeed on a head that was popped and
+// pushed back in between (the ABA problem).
+#define KMEM_PTR_MASK ((1ULL << 48) - 1)
+#define KMEM_TAG_ONE  (1ULL << 48)
+
+struct kmem_slab {
+  struct kmem_cache *cache;
+  struct kmem_slab *next;
+  struct kmem_slab *prev;
+  void *free;      // free objects of this slab
+  unsigned inuse;  // objects not on 'free'
+};
+
+static struct kmem_cache kmem_cache_cache;
+static struct kmem_cache kmalloc_caches[KMALLOC_NCLASSES];
+static struct kmem_cache *kmem_caches;
+static struct spinlock kmem_caches_lock;
+
+static void
+slab_list_insert(struct kmem_slab **head, struct kmem_slab *s) {
+  s->prev = NULL;
+  s->next = *head;
+  if (*head)
+    (*head)->prev = s;
+  *head = s;
+}
+
+static void
+slab_list_remove(struct kmem_slab **head, struct kmem_slab *s) {
+  if (s->prev)
+    s->prev->next = s->next;
+  else
+    *head = s->next;
+  if (s->next)
+    s->next->prev = s->prev;
+  s->next = s->prev = NULL;
+}
+
+static struct kmem_slab *
+slab_of(void *obj) {
+  struct PageInfo *pp = pa2page(PADDR(obj));
+
+  return (struct kmem_slab *)page2kva(&pages[pp->pp_kmem]);
+}
+
+//
+// Allocate a new slab for 'c' and thread all its objects onto the
+// slab's free list.  Returns NULL if out of memory.
+//
+static struct kmem_slab *
+slab_create(struct kmem_cache *c) {
+  struct PageInfo *pp;
+  struct kmem_slab *s;
+  char *obj;
+  size_t i;
+
+  if (!(pp = page_alloc_order(c->order, 0)))
+    return NULL;
+  for (i = 0; i < (1UL << c->order); i++)
+    pp[i].pp_kmem = pp - pages;
+
+  s        = page2kva(pp);
+  s->cache = c;
+  s->next = s->prev = NULL;
+  s->free  = NULL;
+  s->inuse = 0;
+  obj      = (char *)s + c->offset;
+  for (i = 0; i < c->perslab; i++, obj += c->objsize) {
+    *(void **)obj = s->free;
+    s->free       = obj;
+  }
+  c->nslabs++;
+  return s;
+}
+
+static void
+slab_destroy(struct kmem_cache *c, struct kmem_slab *s) {
+  c->nslabs--;
+  page_free_order(pa2page(PADDR(s)), c->order);
+}
+
+static void *
+fast_pop(struct kmem_cache *c) {
+  uint64_t old, new;
+  void *obj;
+
+  old = __atomic_load_n(&c->fast, __ATOMIC_ACQUIRE);
+  do {
+    if (!(obj = (void *)(uintptr_t)(old & KMEM_PTR_MASK)))
+      return NULL;
+    // obj may be popped and reused by someone else right now, in which
+    // case this reads garbage, but the tag makes the swap fail then.
+    new = ((uintptr_t) * (void **)obj & KMEM_PTR_MASK) | ((old + KMEM_TAG_ONE) & ~KMEM_PTR_MASK);
+  } while (!__atomic_compare_exchange_n(&c->fast, &old, new, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+  __atomic_fetch_sub(&c->nfast, 1, __ATOMIC_RELAXED);
+  return obj;
+}
+
+static bool
+fast_push(struct kmem_cache *c, void *obj) {
+  uint64_t old, new;
+
+  // The bound is loose under concurrency, which is fine.
+  if (c->nfast >= c->fast_max)
+    return 0;
+  old = __atomic_load_n(&c->fast, __ATOMIC_RELAXED);
+  do {
+    *(void **)obj = (void *)(uintptr_t)(old & KMEM_PTR_MASK);
+    new           = (uintptr_t)obj | ((old + KMEM_TAG_ONE) & ~KMEM_PTR_MASK);
+  } while (!__atomic_compare_exchange_n(&c->fast, &old, new, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  __atomic_fetch_add(&c->nfast, 1, __ATOMIC_RELAXED);
+  return 1;
+}
+
+static void *
+slow_alloc(struct kmem_cache *c) {
+  struct kmem_slab *s;
+  void *obj = NULL;
+
+  spin_lock(&c->lock);
+  if (!(s = c->partial)) {
+    if ((s = c->empty))
+      c->empty = NULL;
+    else if (!(s = slab_create(c)))
+      goto out;
+    slab_list_insert(&c->partial, s);
+  }
+  obj     = s->free;
+  s->free = *(void **)obj;
+  s->inuse++;
+  if (!s->free) {
+    slab_list_remove(&c->partial, s);
+    slab_list_insert(&c->full, s);
+  }
+out:
+  spin_unlock(&c->lock);
+  return obj;
+}
+
+static void
+slow_free(struct kmem_cache *c, void *obj) {
+  struct kmem_slab *s = slab_of(obj);
+
+  assert(s->cache == c);
+  spin_lock(&c->lock);
+  if (!s->free) {
+    slab_list_remove(&c->full, s);
+    slab_list_insert(&c->partial, s);
+  }
+  *(void **)obj = s->free;
+  s->free       = obj;
+  if (!--s->inuse) {
+    // Keep one empty slab around so that a cache whose usage hovers
+    // around a slab boundary does not allocate and free pages each time.
+    slab_list_remove(&c->partial, s);
+    if (c->empty)
+      slab_destroy(c, s);
+    else
+      c->empty = s;
+  }
+  spin_unlock(&c->lock);
+}
+
+//
+// Fill in cache 'c' for objects of 'size' bytes aligned to 'align'
+// (a power of two, 0 for the default).
+// Returns 0 on success, < 0 if such objects do not fit in a slab.
+//
+static int
+kmem_cache_setup(struct kmem_cache *c, const char *name, size_t size, size_t align) {
+  if (!align)
+    align = 1UL << KMALLOC_MIN_SHIFT;
+  if (align & (align - 1))
+    return -E_INVAL;
+  if (align < sizeof(void *))
+    align = sizeof(void *);
+
+  memset(c, 0, sizeof(*c));
+  strncpy(c->name, name, KMEM_NAMELEN - 1);
+  c->objsize = ROUNDUP(MAX(size, sizeof(void *)), align);
+  c->offset  = ROUNDUP(sizeof(struct kmem_slab), align);
+  while (c->order < KMEM_SLAB_MAX_ORDER &&
+         ((PGSIZE << c->order) - c->offset) / c->objsize < KMEM_SLAB_MIN_OBJS)
+    c->order++;
+  if (!(c->perslab = ((PGSIZE << c->order) - c->offset) / c->objsize))
+    return -E_INVAL;
+  c->fast_max = c->perslab;
+  spin_initlock(&c->lock);
+
+  spin_lock(&kmem_caches_lock);
+  c->next     = kmem_caches;
+  kmem_caches = c;
+  spin_unlock(&kmem_caches_lock);
+  return 0;
+}
+
+//
+// Create a cache of objects of 'size' bytes aligned to 'align'
+// (a power of two, or 0 for 16 bytes).  'name' shows up in the
+// kmem monitor command.
+// Returns NULL if out of memory or if the objects are too large;
+// use kmalloc() for those.
+//
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size, size_t align) {
+  struct kmem_cache *c;
+
+  if (!(c = kmem_cache_alloc(&kmem_cache_cache)))
+    return NULL;
+  if (kmem_cache_setup(c, name, size, align) < 0) {
+    kmem_cache_free(&kmem_cache_cache, c);
+    return NULL;
+  }
+  return c;
+}
+
+//
+// Allocate an object from cache 'c'.  The memory is not zeroed.
+// Returns NULL if out of memory.
+//
+void *
+kmem_cache_alloc(struct kmem_cache *c) {
+  void *obj;
+
+  if (!(obj = fast_pop(c)) && !(obj = slow_alloc(c)))
+    return NULL;
+  __atomic_fetch_add(&c->nactive, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&c->nallocs, 1, __ATOMIC_RELAXED);
+  return obj;
+}
+
+//
+// Return 'obj' to cache 'c', which it must have come from.
+//
+void
+kmem_cache_free(struct kmem_cache *c, void *obj) {
+  __atomic_fetch_sub(&c->nactive, 1, __ATOMIC_RELAXED);
+  if (!fast_push(c, obj))
+    slow_free(c, obj);
+}
+
+//
+// Allocate 'size' bytes of kernel memory, aligned to 16 bytes.
+// Requests above KMALLOC_MAX get a page-aligned buddy block.
+// Returns NULL if out of memory.
+//
+void *
+kmalloc(size_t size) {
+  struct PageInfo *pp;
+  int order;
+
+  if (!size)
+    return NULL;
+  if (size <= KMALLOC_MAX) {
+    order = size <= (1UL << KMALLOC_MIN_SHIFT) ? 0 :
+            64 - __builtin_clzl(size - 1) - KMALLOC_MIN_SHIFT;
+    return kmem_cache_alloc(&kmalloc_caches[order]);
+  }
+
+  for (order = 0; (PGSIZE << order) < size; order++)
+    if (order == PAGE_MAX_ORDER)
+      return NULL;
+  if (!(pp = page_alloc_order(order, 0)))
+    return NULL;
+  pp->pp_kmem = KMEM_LARGE | order;
+  return page2kva(pp);
+}
+
+//
+// Free memory returned by kmalloc().  kfree(NULL) does nothing.
+//
+void
+kfree(void *ptr) {
+  struct PageInfo *pp;
+
+  if (!ptr)
+    return;
+  pp = pa2page(PADDR(ptr));
+  if (pp->pp_kmem & KMEM_LARGE) {
+    assert(!PGOFF(ptr));
+    page_free_order(pp, pp->pp_kmem & ~KMEM_LARGE);
+    return;
+  }
+  kmem_cache_free(slab_of(ptr)->cache, ptr);
+}
+
+void
+kmem_print_stats(void) {
+  struct kmem_cache *c;
+
+  cprintf("%-24s %7s %6s %7s %8s %10s\n", "cache", "objsize", "slabs", "active", "total", "allocs");
+  spin_lock(&kmem_caches_lock);
+  for (c = kmem_caches; c; c = c->next)
+    cprintf("%-24s %7lu %6lu %7lu %8lu %10lu\n", c->name, (unsigned long)c->objsize,
+            (unsigned long)c->nslabs, (unsigned long)c->nactive,
+            (unsigned long)(c->nslabs * c->perslab), (unsigned long)c->nallocs);
+  spin_unlock(&kmem_caches_lock);
+}
+
+static void
+check_kmalloc(void) {
+  void *small[KMALLOC_NCLASSES], *many[64], *big;
+  size_t active[KMALLOC_NCLASSES];
+  int i;
+
+  for (i = 0; i < KMALLOC_NCLASSES; i++)
+    active[i] = kmalloc_caches[i].nactive;
+
+  // Every size lands in the smallest class that holds it.
+  for (i = 0; i < KMALLOC_NCLASSES; i++) {
+    assert((small[i] = kmalloc((1UL << (i + KMALLOC_MIN_SHIFT)) - 1)));
+    assert(!((uintptr_t)small[i] & ((1UL << KMALLOC_MIN_SHIFT) - 1)));
+    assert(slab_of(small[i])->cache == &kmalloc_caches[i]);
+    memset(small[i], i, (1UL << (i + KMALLOC_MIN_SHIFT)) - 1);
+  }
+  for (i = 0; i < KMALLOC_NCLASSES; i++) {
+    assert(*(uint8_t *)small[i] == i);
+    kfree(small[i]);
+  }
+
+  // Objects do not overlap, even across several slabs.
+  for (i = 0; i < 64; i++) {
+    assert((many[i] = kmalloc(1024)));
+    *(int *)many[i] = i;
+  }
+  for (i = 0; i < 64; i++) {
+    assert(*(int *)many[i] == i);
+    kfree(many[i]);
+  }
+
+  assert((big = kmalloc(3 * PGSIZE)));
+  assert(!PGOFF(big));
+  memset(big, 0, 3 * PGSIZE);
+  kfree(big);
+
+  for (i = 0; i < KMALLOC_NCLASSES; i++)
+    assert(kmalloc_caches[i].nactive == active[i]);
+
+  cprintf("check_kmalloc() succeeded!\n");
+}
+
+void
+kmem_init(void) {
+  char name[KMEM_NAMELEN];
+  int i;
+
+  spin_initlock(&kmem_caches_lock);
+  if (kmem_cache_setup(&kmem_cache_cache, "kmem_cache", sizeof(struct kmem_cache), 0) < 0)
+    panic("kmem_init: cannot set up kmem_cache");
+  for (i = 0; i < KMALLOC_NCLASSES; i++) {
+    snprintf(name, sizeof(name), "kmalloc-%lu", 1UL << (i + KMALLOC_MIN_SHIFT));
+    if (kmem_cache_setup(&kmalloc_caches[i], name, 1UL << (i + KMALLOC_MIN_SHIFT), 0) < 0)
+      panic("kmem_init: cannot set up %s", name);
+  }
+
+  check_kmalloc();
+}
@@ -0,0 +1,57 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KMALLOC_H
+#define JOS_KERN_KMALLOC_H
+#ifndef JOS_KERNEL
+#error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <kern/spinlock.h>
+
+// kmalloc size classes: 16, 32, ..., 2048 bytes.
+#define KMALLOC_MIN_SHIFT 4
+#define KMALLOC_MAX_SHIFT 11
+#define KMALLOC_NCLASSES  (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
+#define KMALLOC_MAX       (1UL << KMALLOC_MAX_SHIFT)
+
+#define KMEM_NAMELEN 24
+
+struct kmem_slab;
+
+struct kmem_cache {
+  char name[KMEM_NAMELEN];
+  size_t objsize;  // object size, rounded up to the alignment
+  int order;       // a slab is a buddy block of 2^order pages
+  unsigned perslab; // objects per slab
+  size_t offset;    // of the first object in a slab
+
+  // Lock-free stack of freed objects (tagged pointer, see kmalloc.c)
+  // which alloc and free try before they take the lock.
+  volatile uint64_t fast;
+  volatile unsigned nfast;
+  unsigned fast_max;
+
+  struct spinlock lock;   // protects the slab lists below
+  struct kmem_slab *partial; // slabs with free objects
+  struct kmem_slab *full;    // slabs without
+  struct kmem_slab *empty;   // at most one spare slab
+
+  // Statistics
+  volatile size_t nactive; // objects handed out
+  size_t nslabs;
+  volatile size_t nallocs;
+
+  struct kmem_cache *next; // on the list of all caches
+};
+
+void kmem_init(void);
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align);
+void *kmem_cache_alloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+void kmem_print_stats(void);
+
+void *kmalloc(size_t size);
+void kfree(void *ptr);
+
+#endif // !JOS_KERN_KMALLOC_H
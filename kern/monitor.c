@@ -15,6 +15,7 @@
 #include <kern/timer.h>
 #include <kern/env.h>
 #include <kern/pmap.h>
+#include <kern/kmalloc.h>
 #include <kern/trap.h>
 
 #define CMDBUF_SIZE 80 // enough for one VGA text line
@@ -39,7 +40,8 @@ static struct Command commands[] = {
     {"timer_start", "Start timer", mon_start},
     {"timer_stop", "Stop timer", mon_stop},
     {"timer_freq", "Count processor frequency", mon_frequency},
-    {"mon_memory", "Info", mon_memory}};
+    {"mon_memory", "Info", mon_memory},
+    {"kmem", "Display kernel object cache usage", mon_kmem}};
 #define NCOMMANDS (sizeof(commands) / sizeof(commands[0]))
 
 /***** Implementations of basic kernel monitor commands *****/
@@ -135,6 +137,8 @@ int mon_memory(int argc, char **argv, struct Trapframe *tf)
 {
   size_t i;
   int is_cur_free;
+  int order;
+  size_t hits, total;
 
   for (i = 1; i <= npages; i++) {
     is_cur_free = !page_is_allocated(&pages[i - 1]);
@@ -147,9 +151,31 @@ int mon_memory(int argc, char **argv, struct Trapframe *tf)
     }
     cprintf(is_cur_free ? " FREE\n" : " ALLOCATED\n");
   }
+
+  for (order = 0; order < NPAGEORDERS; order++) {
+    cprintf("order %2d (%5lu KB): %lu free blocks\n", order,
+            (unsigned long)(PGSIZE << order) / 1024, (unsigned long)page_free_blocks(order));
+  }
+
+  hits  = page_pool_stats.zero_hits;
+  total = hits + page_pool_stats.zero_misses;
+  cprintf("zeroed pool: %lu pages, dirty: %lu pages, zeroed while idle: %lu\n",
+          (unsigned long)page_pool_stats.nzeroed, (unsigned long)page_pool_stats.ndirty,
+          (unsigned long)page_pool_stats.zero_filled);
+  cprintf("ALLOC_ZERO: %lu hits, %lu misses (%lu%% hit rate)\n",
+          (unsigned long)hits, (unsigned long)page_pool_stats.zero_misses,
+          (unsigned long)(total ? hits * 100 / total : 0));
+  cprintf("COW faults: %lu copied, %lu reused, %lu forwarded to user\n",
+          (unsigned long)cow_stats.copied, (unsigned long)cow_stats.reused,
+          (unsigned long)cow_stats.forwarded);
   return 0;
 }
 
+int
+mon_kmem(int argc, char **argv, struct Trapframe *tf) {
+  kmem_print_stats();
+  return 0;
+}
 
 /***** Kernel monitor command interpreter *****/
 
@@ -21,5 +21,6 @@ int mon_start(int argc, char **argv, struct Trapframe *tf);
 int mon_stop(int argc, char **argv, struct Trapframe *tf);
 int mon_frequency(int argc, char **argv, struct Trapframe *tf);
 int mon_memory(int argc, char **argv, struct Trapframe *tf);
+int mon_kmem(int argc, char **argv, struct Trapframe *tf);
 
 #endif // !JOS_KERN_MONITOR_H
@@ -81,6 +81,23 @@ irq_setmask_8259A(uint16_t mask) {
   cprintf("\n");
 }
 
+// Mask or unmask a single IRQ, without the message that
+// irq_setmask_8259A prints, for IRQs that user environments wait for
+// over and over.
+void
+irq_set_masked(uint8_t irq, bool masked) {
+  if (masked)
+    irq_mask_8259A |= 1 << irq;
+  else
+    irq_mask_8259A &= ~(1 << irq);
+  if (!didinit)
+    return;
+  if (irq < 8)
+    outb(IO_PIC1_DATA, (char)irq_mask_8259A);
+  else
+    outb(IO_PIC2_DATA, (char)(irq_mask_8259A >> 8));
+}
+
 void
 pic_send_eoi(uint8_t irq) {
   if (irq >= 8)
@@ -28,10 +28,17 @@ static size_t npages_basemem; // Amount of base memory (in pages)
 // These variables are set in mem_init()
 volatile int *vsys;                                // Virtual syscall space
 pde_t *kern_pml4e;                                 // Kernel's initial page directory
+static bool has_1gb_pages;                         // CPU supports PTE_PS in a PDPE
+bool pcid_enabled;                                 // CR4_PCIDE is set
+static bool has_invpcid;                           // CPU supports INVPCID
 physaddr_t kern_cr3;                               // Physical address of boot time page directory
 struct PageInfo *pages; // массив для физических страниц      // Physical page state array
-static struct PageInfo *page_free_list     = NULL; // Free list of physical pages
-static struct PageInfo *page_free_list_top = NULL;
+static struct PageInfo *page_free_area[NPAGEORDERS]; // Buddy free lists, one per order
+static size_t page_free_nblocks[NPAGEORDERS];        // Number of blocks on each list
+static struct PageInfo *page_dirty_list;              // Freed pages not zeroed yet
+static struct PageInfo *page_zeroed_list;             // Free pages filled with zeroes
+struct PagePoolStats page_pool_stats;
+struct CowStats cow_stats;
 //Pointers to start and end of UEFI memory map
 EFI_MEMORY_DESCRIPTOR *mmap_base = NULL;
 EFI_MEMORY_DESCRIPTOR *mmap_end  = NULL;
@@ -139,7 +146,7 @@ fix_lp_addresses(void) {
 // --------------------------------------------------------------
 
 static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
-static void check_page_free_list(bool only_low_memory);
+static void check_page_free_list(void);
 static void check_page_alloc(void);
 static void check_kern_pml4e(void);
 static physaddr_t check_va2pa(pde_t *pgdir, uintptr_t va);
@@ -157,7 +164,7 @@ static void check_page_installed_pml4(void);
 //
 // If we're out of memory, boot_alloc should panic.
 // This function may ONLY be used during initialization,
-// before the page_free_list list has been set up.
+// before the page free lists have been set up.
 static void *
 boot_alloc(uint32_t n) {
   static char *nextfree; // virtual address of next byte of free memory
@@ -194,16 +201,6 @@ boot_alloc(uint32_t n) {
   return result;
 }
 
-static struct PageInfo *
-evaluate_page_free_list_top() {
-  struct PageInfo *pp = page_free_list, *pt = NULL;
-  while (pp) {
-    pt = pp;
-    pp = pp->pp_link;
-  }
-  return pt;
-}
-
 // Set up a two-level page table:
 //    kern_pml4e is its linear (virtual) address of the root
 //
@@ -217,9 +214,14 @@ void
 mem_init(void) {
   pml4e_t *pml4e;
   size_t size_to_alloc;
+  uint32_t edx;
   // Find out how much memory the machine has (npages & npages_basemem).
   i386_detect_memory();
 
+  // 2MB pages are always there in long mode, 1GB ones are optional.
+  cpuid(0x80000001, NULL, NULL, NULL, &edx);
+  has_1gb_pages = (edx >> 26) & 1;
+
   // Remove this line when you're ready to test this function.
   // panic("mem_init: This function is not finished\n");
 
@@ -272,7 +274,7 @@ mem_init(void) {
   // or page_insert
   page_init();
 
-  check_page_free_list(1);
+  check_page_free_list();
   check_page();
   check_page_alloc();
 
@@ -372,6 +374,21 @@ mem_init(void) {
   // kern_pml4e wrong.
   lcr3(kern_cr3);
 
+  // Keep the kernel half (PTE_G) in the TLB across CR3 loads, and tag
+  // the user half with a PCID per address space if the CPU can.
+  {
+    uint32_t ecx, ebx;
+    uintptr_t cr4 = rcr4() | CR4_PGE;
+    cpuid(1, NULL, NULL, &ecx, NULL);
+    if ((ecx >> 17) & 1) {
+      cr4 |= CR4_PCIDE;
+      pcid_enabled = 1;
+      cpuid_count(7, 0, NULL, &ebx, NULL, NULL);
+      has_invpcid = (ebx >> 10) & 1;
+    }
+    lcr4(cr4);
+  }
+
   // entry.S set the really important flags in cr0.
   // Here we configure the rest of the flags that we care about.
   {
@@ -393,9 +410,8 @@ mem_init(void) {
 
   // Some more checks, only possible after kern_pml4e is installed.
   check_page_installed_pml4();
-  page_free_list_top = evaluate_page_free_list_top();
 
-  check_page_free_list(0);
+  check_page_free_list();
 }
 
 #ifdef SANITIZE_SHADOW_BASE
@@ -439,14 +455,121 @@ kasan_mem_init(void) {
 // --------------------------------------------------------------
 // Tracking of physical pages.
 // The 'pages' array has one 'struct PageInfo' entry per physical page.
-// Pages are reference counted, and free pages are kept on a linked list.
+// Pages are reference counted, and free pages are kept by a binary buddy
+// allocator: page_free_area[k] lists the free blocks of 2^k pages whose
+// first page index is a multiple of 2^k.  The buddy of such a block is
+// the one whose index differs only in bit k; when both are free they are
+// merged into one block of order k + 1.
 // --------------------------------------------------------------
 
+static void
+page_free_area_push(struct PageInfo *pp, int order) {
+  pp->pp_order = order;
+  pp->pp_free  = PAGE_FREE_BUDDY;
+  pp->pp_prev  = 0;
+  pp->pp_link  = page_free_area[order];
+  if (pp->pp_link)
+    pp->pp_link->pp_prev = pp - pages;
+  page_free_area[order] = pp;
+  page_free_nblocks[order]++;
+}
+
+static void
+page_free_area_unlink(struct PageInfo *pp) {
+  if (pp->pp_prev)
+    pages[pp->pp_prev].pp_link = pp->pp_link;
+  else
+    page_free_area[pp->pp_order] = pp->pp_link;
+  if (pp->pp_link)
+    pp->pp_link->pp_prev = pp->pp_prev;
+  page_free_nblocks[pp->pp_order]--;
+
+  pp->pp_free = PAGE_IN_USE;
+  pp->pp_prev = 0;
+  pp->pp_link = NULL;
+}
+
+// Put the free block of 2^order pages starting at page 'idx' on the free
+// lists, merging it with its buddy for as long as the buddy is free too.
+static void
+page_free_area_merge(size_t idx, int order) {
+  struct PageInfo *buddy;
+  size_t bidx;
+
+  while (order < PAGE_MAX_ORDER) {
+    bidx = idx ^ (1UL << order);
+    if (bidx + (1UL << order) > npages)
+      break;
+    buddy = &pages[bidx];
+    if (buddy->pp_free != PAGE_FREE_BUDDY || buddy->pp_order != order)
+      break;
+    page_free_area_unlink(buddy);
+    idx &= bidx;
+    order++;
+  }
+  page_free_area_push(&pages[idx], order);
+}
+
+// Take the first block of 2^order pages off the buddy lists, splitting
+// a larger one if there is no block of that size.
+static struct PageInfo *
+page_free_area_take(int order) {
+  struct PageInfo *pp;
+  int k;
+
+  for (k = order; k <= PAGE_MAX_ORDER && !page_free_area[k]; k++)
+    ;
+  if (k > PAGE_MAX_ORDER)
+    return NULL;
+
+  pp = page_free_area[k];
+  page_free_area_unlink(pp);
+  while (k > order) {
+    k--;
+    page_free_area_push(pp + (1UL << k), k);
+  }
+  return pp;
+}
+
+// The dirty and zeroed lists hold single free pages outside of the
+// buddy lists, linked through pp_link.
+static void
+page_pool_push(struct PageInfo **list, struct PageInfo *pp, int state) {
+  pp->pp_order = 0;
+  pp->pp_free  = state;
+  pp->pp_link  = *list;
+  *list        = pp;
+}
+
+static struct PageInfo *
+page_pool_pop(struct PageInfo **list) {
+  struct PageInfo *pp = *list;
+
+  if (pp) {
+    *list       = pp->pp_link;
+    pp->pp_link = NULL;
+    pp->pp_free = PAGE_IN_USE;
+  }
+  return pp;
+}
+
+// Give all pooled pages back to the buddy lists.
+static void
+page_pool_drain(void) {
+  struct PageInfo *pp;
+
+  while ((pp = page_pool_pop(&page_dirty_list)))
+    page_free_area_merge(pp - pages, 0);
+  while ((pp = page_pool_pop(&page_zeroed_list)))
+    page_free_area_merge(pp - pages, 0);
+  page_pool_stats.ndirty = page_pool_stats.nzeroed = 0;
+}
+
 //
 // Initialize page structure and memory free list.
 // After this is done, NEVER use boot_alloc again.  ONLY use the page
 // allocator functions below to allocate and deallocate physical
-// memory via the page_free_list.
+// memory via the buddy free lists.
 //
 void
 page_init(void) {
@@ -469,75 +592,71 @@ page_init(void) {
   // free pages!
   size_t i;
   uintptr_t first_free_page;
-  struct PageInfo *last = NULL;
 
   //Mark physical page 0 as in use.
-  pages[0].pp_ref  = 1;
-  pages[0].pp_link = NULL;
+  pages[0].pp_ref = 1;
 
   //  2) The rest of base memory, [PGSIZE, npages_basemem * PGSIZE)
   //     is free.
-  pages[1].pp_ref = 0;
-  page_free_list  = &pages[1];
-  last            = &pages[1];
-  for (i = 2; i < npages_basemem; i++) {
-    if (is_page_allocatable(i)) {
-      pages[i].pp_ref = 0;
-      last->pp_link   = &pages[i];
-      last            = &pages[i];
-    } else {
-      pages[i].pp_ref  = 1;
-      pages[i].pp_link = NULL;
-    }
-  }
+  for (i = 1; i < npages_basemem; i++)
+    pages[i].pp_ref = is_page_allocatable(i) ? 0 : 1;
 
   //  3) Then comes the IO hole [IOPHYSMEM, EXTPHYSMEM), which must
   //     never be allocated.
   first_free_page = PADDR(boot_alloc(0)) / PGSIZE;
-  for (i = npages_basemem; i < first_free_page; i++) {
-    pages[i].pp_ref  = 1;
-    pages[i].pp_link = NULL;
-  }
+  for (i = npages_basemem; i < first_free_page; i++)
+    pages[i].pp_ref = 1;
 
   //     Some of it is in use, some is free. Where is the kernel
   //     in physical memory?  Which pages are already in use for
   //     page tables and other data structures?
-  for (i = first_free_page; i < npages; i++) {
-    if (is_page_allocatable(i)) {
-      pages[i].pp_ref = 0;
-      last->pp_link   = &pages[i];
-      last            = &pages[i];
-    } else {
-      pages[i].pp_ref  = 1;
-      pages[i].pp_link = NULL;
-    }
+  for (i = first_free_page; i < npages; i++)
+    pages[i].pp_ref = is_page_allocatable(i) ? 0 : 1;
+
+  // Hand the free pages to the buddy allocator.  Going from the top
+  // leaves the lowest blocks at the heads of the free lists, so early
+  // allocations come from memory covered by the boot page tables.
+  for (i = npages; i-- > 1;) {
+    if (!pages[i].pp_ref)
+      page_free_area_merge(i, 0);
   }
 }
 
 //
-// Allocates a physical page.  If (alloc_flags & ALLOC_ZERO), fills the entire
-// returned physical page with '\0' bytes.  Does NOT increment the reference
-// count of the page - the caller must do these if necessary (either explicitly
-// or via page_insert).
+// Allocates a physically contiguous, naturally aligned block of 2^order
+// pages.  If (alloc_flags & ALLOC_ZERO), fills the whole block with '\0'
+// bytes.  Does NOT increment the reference count of any page of the
+// block - the caller must do these if necessary.
 //
-// Be sure to set the pp_link field of the allocated page to NULL so
-// page_free can check for double-free bugs.
+// The smallest free block that fits is taken and split in halves until
+// it has the requested size; the unused halves go back to the free lists.
+// Single pages come from the zeroed list for ALLOC_ZERO requests and from
+// the dirty list otherwise, before the buddy lists are looked at.
 //
-// Returns NULL if out of free memory.
+// Returns NULL if there is no free block that large.
 //
-// Hint: use page2kva and memset
 struct PageInfo *
-page_alloc(int alloc_flags) {
-  if (!page_free_list) {
+page_alloc_order(int order, int alloc_flags) {
+  struct PageInfo *return_page = NULL;
+
+  if (order < 0 || order > PAGE_MAX_ORDER)
     return NULL;
-  }
-  struct PageInfo *return_page = page_free_list;
-  page_free_list               = page_free_list->pp_link;
-  return_page->pp_link         = NULL;
 
-  if (!page_free_list) {
-    page_free_list_top = NULL;
+  if (!order && (alloc_flags & ALLOC_ZERO) &&
+      (return_page = page_pool_pop(&page_zeroed_list))) {
+    page_pool_stats.nzeroed--;
+    page_pool_stats.zero_hits++;
+    alloc_flags &= ~ALLOC_ZERO;
+  } else if (!order && (return_page = page_pool_pop(&page_dirty_list))) {
+    page_pool_stats.ndirty--;
+  } else if (!(return_page = page_free_area_take(order))) {
+    // Pooled pages may merge into a block large enough.
+    page_pool_drain();
+    if (!(return_page = page_free_area_take(order)))
+      return NULL;
   }
+  if (alloc_flags & ALLOC_ZERO)
+    page_pool_stats.zero_misses++;
 
 #ifdef SANITIZE_SHADOW_BASE
   if ((uintptr_t)page2kva(return_page) >= SANITIZE_SHADOW_BASE) {
@@ -545,19 +664,68 @@ page_alloc(int alloc_flags) {
     return NULL;
   }
   // Unpoison allocated memory before accessing it!
-  platform_asan_unpoison(page2kva(return_page), PGSIZE);
+  platform_asan_unpoison(page2kva(return_page), PGSIZE << order);
 #endif
 
   if (alloc_flags & ALLOC_ZERO) {
-    memset(page2kva(return_page), 0, PGSIZE); // physical address => virtual address
+    memset(page2kva(return_page), 0, PGSIZE << order); // physical address => virtual address
   }
 
   return return_page;
 }
 
+//
+// Allocates a physical page.  If (alloc_flags & ALLOC_ZERO), fills the entire
+// returned physical page with '\0' bytes.  Does NOT increment the reference
+// count of the page - the caller must do these if necessary (either explicitly
+// or via page_insert).
+//
+// Returns NULL if out of free memory.
+//
+struct PageInfo *
+page_alloc(int alloc_flags) {
+  return page_alloc_order(0, alloc_flags);
+}
+
 int
 page_is_allocated(const struct PageInfo *pp) {
-  return !pp->pp_link && pp != page_free_list_top;
+  size_t idx = pp - pages;
+  const struct PageInfo *head;
+  int order;
+
+  if (pp->pp_free != PAGE_IN_USE)
+    return 0;
+
+  // A page is free if it lies inside a free block, and the first page
+  // of that block is 'idx' rounded down to the block size.
+  for (order = 1; order <= PAGE_MAX_ORDER; order++) {
+    head = &pages[idx & ~((1UL << order) - 1)];
+    if (head->pp_free == PAGE_FREE_BUDDY && head->pp_order >= order)
+      return 0;
+  }
+  return 1;
+}
+
+//
+// Return a block of 2^order pages, allocated by page_alloc_order()
+// or made up of pages allocated separately, to the free lists,
+// merging it with its buddy for as long as the buddy is free too.
+//
+void
+page_free_order(struct PageInfo *pp, int order) {
+  size_t idx = pp - pages;
+
+  if (order < 0 || order > PAGE_MAX_ORDER || (idx & ((1UL << order) - 1)))
+    panic("page_free_order: bad block %p of order %d\n", pp, order);
+  if (pp->pp_ref != 0 || pp->pp_link != NULL || !page_is_allocated(pp))
+    panic("page_free: Page cannot be freed!\n");
+
+  if (!order && page_pool_stats.ndirty < PAGE_DIRTY_MAX) {
+    page_pool_push(&page_dirty_list, pp, PAGE_FREE_DIRTY);
+    page_pool_stats.ndirty++;
+    return;
+  }
+  page_free_area_merge(idx, order);
 }
 
 //
@@ -566,17 +734,39 @@ page_is_allocated(const struct PageInfo *pp) {
 //
 void
 page_free(struct PageInfo *pp) {
-  // LAB 6: Fill this function in
-  // Hint: You may want to panic if pp->pp_ref is nonzero or
-  // pp->pp_link is not NULL.
-  if (pp->pp_ref != 0 || pp->pp_link != NULL)
-    panic("page_free: Page cannot be freed!\n");
+  page_free_order(pp, 0);
+}
 
-  pp->pp_link    = page_free_list;
-  page_free_list = pp;
-  if (!page_free_list_top)
-  {
-    page_free_list_top = pp;
+//
+// Number of free blocks of 2^order pages.
+//
+size_t
+page_free_blocks(int order) {
+  return page_free_nblocks[order];
+}
+
+//
+// Zero some free pages ahead of time, so that page_alloc(ALLOC_ZERO)
+// does not have to.  Called by the scheduler when the CPU is idle.
+//
+void
+page_zero_refill(void) {
+  struct PageInfo *pp;
+  int n;
+
+  for (n = 0; n < PAGE_ZERO_BATCH && page_pool_stats.nzeroed < PAGE_ZERO_TARGET; n++) {
+    if ((pp = page_pool_pop(&page_dirty_list)))
+      page_pool_stats.ndirty--;
+    else if (!(pp = page_free_area_take(0)))
+      break;
+
+#ifdef SANITIZE_SHADOW_BASE
+    platform_asan_unpoison(page2kva(pp), PGSIZE);
+#endif
+    memset(page2kva(pp), 0, PGSIZE);
+    page_pool_push(&page_zeroed_list, pp, PAGE_FREE_ZEROED);
+    page_pool_stats.nzeroed++;
+    page_pool_stats.zero_filled++;
   }
 }
 
@@ -636,6 +826,8 @@ pte_t *
 pdpe_walk(pdpe_t *pdpe, const void *va, int create) {
   // LAB 7: Fill this function in
   if (pdpe[PDPE(va)] & PTE_P) {
+    if (pdpe[PDPE(va)] & PTE_PS) // 1GB page
+      return &pdpe[PDPE(va)];
     return pgdir_walk((pde_t *)KADDR(PTE_ADDR(pdpe[PDPE(va)])), va, create);
   }
   if (create) {
@@ -655,6 +847,8 @@ pte_t *
 pgdir_walk(pde_t *pgdir, const void *va, int create) {
   // LAB 7: Fill this function in
   if (pgdir[PDX(va)] & PTE_P) {
+    if (pgdir[PDX(va)] & PTE_PS) // 2MB page
+      return &pgdir[PDX(va)];
     return (pte_t *)KADDR(PTE_ADDR(pgdir[PDX(va)])) + PTX(va); // находим виртаульный адрес
     // нужной нам записи в таблице последнего уровня со всеми атрибутами
   }
@@ -670,24 +864,77 @@ pgdir_walk(pde_t *pgdir, const void *va, int create) {
   return NULL;
 }
 
+//
+// Like pml4e_walk, but returns the entry that maps 'va' with pages of
+// 'pgsize' bytes: PGSIZE for a PTE, PTSIZE for a PDE or PDPSIZE for a
+// PDPE.  Missing tables above that level are allocated if 'create'.
+// If a larger page (PTE_PS) already covers 'va', its entry is returned.
+//
+pte_t *
+pml4e_walk_size(pml4e_t *pml4e, const void *va, size_t pgsize, int create) {
+  pte_t *table = pml4e, *ent;
+  struct PageInfo *np;
+  int shift;
+
+  for (shift = PML4SHIFT;; shift -= PDXSHIFT - PTXSHIFT) {
+    ent = &table[((uintptr_t)va >> shift) & 0x1FF];
+    if ((1UL << shift) == pgsize)
+      return ent;
+    if (!(*ent & PTE_P)) {
+      if (!create || !(np = page_alloc(ALLOC_ZERO)))
+        return NULL;
+      np->pp_ref++;
+      *ent = page2pa(np) | PTE_P | PTE_U | PTE_W;
+    } else if (*ent & PTE_PS) {
+      return ent;
+    }
+    table = KADDR(PTE_ADDR(*ent));
+  }
+}
+
 //
 // Map [va, va+size) of virtual address space to physical [pa, pa+size)
 // in the page table rooted at pgdir.  Size is a multiple of PGSIZE, and
 // va and pa are both page-aligned.
 // Use permission bits perm|PTE_P for the entries.
 //
+// Whenever va, pa and the remaining size allow it, 1GB or 2MB pages
+// are used instead of 4K ones, unless a page table already covers
+// that part of the range.
+//
+// Mappings in the kernel half, which every env shares through
+// env_setup_vm, are global (PTE_G) and survive CR3 loads.
+//
 // This function is only intended to set up the ``static'' mappings
 // above UTOP. As such, it should *not* change the pp_ref field on the
 // mapped pages.
 //
-// Hint: the TA solution uses pgdir_walk
 static void
 boot_map_region(pml4e_t *pml4e, uintptr_t va, size_t size, physaddr_t pa, int perm) {
   // LAB 7: Fill this function in
-  size_t i;
-  for (i = 0; i < size; i += PGSIZE)
-  {
-    *pml4e_walk(pml4e, (void *)(va + i), 1) = (pa + i) | perm | PTE_P; // отображение виртуального адреса по физическому
+  size_t i, pgsize;
+  pte_t *ptep;
+
+  if (PML4(va) == PML4(KERNBASE))
+    perm |= PTE_G;
+
+  for (i = 0; i < size; i += pgsize) {
+    pgsize = PGSIZE;
+    if (!((va + i) % PTSIZE) && !((pa + i) % PTSIZE) && size - i >= PTSIZE) {
+      pgsize = PTSIZE;
+      if (has_1gb_pages && !((va + i) % PDPSIZE) && !((pa + i) % PDPSIZE) && size - i >= PDPSIZE)
+        pgsize = PDPSIZE;
+    }
+
+    for (;;) {
+      if (!(ptep = pml4e_walk_size(pml4e, (void *)(va + i), pgsize, 1)))
+        panic("boot_map_region: out of memory");
+      if (pgsize == PGSIZE || !(*ptep & PTE_P) || (*ptep & PTE_PS))
+        break;
+      // A page table is in the way, use smaller pages.
+      pgsize = pgsize == PDPSIZE ? PTSIZE : PGSIZE;
+    }
+    *ptep = (pa + i) | perm | PTE_P | (pgsize > PGSIZE ? PTE_PS : 0); // отображение виртуального адреса по физическому
   }
 }
 
@@ -696,57 +943,61 @@ boot_map_region(pml4e_t *pml4e, uintptr_t va, size_t size, physaddr_t pa, int pe
 // The permissions (the low 12 bits) of the page table entry
 // should be set to 'perm|PTE_P'.
 //
+// If perm includes PTE_PS, 'pp' is the first page of a block of
+// order HUGE_PAGE_ORDER, which is mapped with a single 2MB entry;
+// va must then be 2MB aligned.  The reference count of such a block
+// is kept in its first page only.
+//
 // Requirements
 //   - If there is already a page mapped at 'va', it should be page_remove()d.
+//     Mapping a 2MB page also removes the 4K pages and the page table
+//     covering its range, and vice versa.
 //   - If necessary, on demand, a page table should be allocated and inserted
 //     into 'pgdir'.
 //   - pp->pp_ref should be incremented if the insertion succeeds.
 //   - The TLB must be invalidated if a page was formerly present at 'va'.
 //
-// Corner-case hint: Make sure to consider what happens when the same
-// pp is re-inserted at the same virtual address in the same pgdir.
-// However, try not to distinguish this case in your code, as this
-// frequently leads to subtle bugs; there's an elegant way to handle
-// everything in one code path.
-//
 // RETURNS:
 //   0 on success
 //   -E_NO_MEM, if page table couldn't be allocated
-//
-// Hint: The TA solution is implemented using pgdir_walk, page_remove,
-// and page2pa.
+//   -E_INVAL, if va is not aligned to the page size
 //
 int
 page_insert(pml4e_t *pml4e, struct PageInfo *pp, void *va, int perm) {
   // LAB 7: Fill this function in
+  size_t pgsize = (perm & PTE_PS) ? PTSIZE : PGSIZE;
   pte_t *ptep;
+  size_t i;
 
-  ptep = pml4e_walk(pml4e, va, 1);
-
-  if (ptep == 0) {
+  if ((uintptr_t)va % pgsize)
+    return -E_INVAL;
+  if (!(ptep = pml4e_walk_size(pml4e, va, pgsize, 1)))
     return -E_NO_MEM;
-  }
 
-  if (*ptep & PTE_P)
-  {
-    if (PTE_ADDR(*ptep) == page2pa(pp))
-    {
-      *ptep = (*ptep & 0xfffff000) | perm | PTE_P;
-    }
-    else
-    {
+  // Take the new reference first, so that re-inserting the same
+  // page at the same address does not free it in page_remove.
+  pp->pp_ref++;
+
+  if ((*ptep & PTE_P) && (*ptep & PTE_PS) != (perm & PTE_PS)) {
+    if (*ptep & PTE_PS) {
+      // A 2MB page covers the 4K one to be mapped.
       page_remove(pml4e, va);
-      *ptep = page2pa(pp) | perm | PTE_P;
-      pp->pp_ref++;
-      tlb_invalidate(pml4e, va);
+      if (!(ptep = pml4e_walk_size(pml4e, va, pgsize, 1))) {
+        pp->pp_ref--;
+        return -E_NO_MEM;
+      }
+    } else {
+      // A page table is where the 2MB entry goes.
+      for (i = 0; i < NPTENTRIES; i++)
+        page_remove(pml4e, (char *)va + i * PGSIZE);
+      page_decref(pa2page(PTE_ADDR(*ptep)));
+      *ptep = 0;
     }
   }
-  else
-  {
-    *ptep = page2pa(pp) | perm | PTE_P;
-    pp->pp_ref++;
 
-  }
+  if (*ptep & PTE_P)
+    page_remove(pml4e, va);
+  *ptep = page2pa(pp) | perm | PTE_P;
   return 0;
 }
 
@@ -757,6 +1008,9 @@ page_insert(pml4e_t *pml4e, struct PageInfo *pp, void *va, int perm) {
 // can be used to verify page permissions for syscall arguments,
 // but should not be used by most callers.
 //
+// For a 2MB page the first page of its block is returned and the
+// stored entry has PTE_PS set.
+//
 // Return NULL if there is no page mapped at va.
 //
 // Hint: the TA solution uses pgdir_walk and pa2page.
@@ -767,7 +1021,7 @@ page_lookup(pml4e_t *pml4e, void *va, pte_t **pte_store) {
   pte_t *ptep;
 
   ptep = pml4e_walk(pml4e, va, 0);
-  if (!ptep) {
+  if (!ptep || !(*ptep & PTE_P)) {
     return NULL;
   }
   if (pte_store) {
@@ -779,6 +1033,7 @@ page_lookup(pml4e_t *pml4e, void *va, pte_t **pte_store) {
 //
 // Unmaps the physical page at virtual address 'va'.
 // If there is no physical page at that address, silently does nothing.
+// If 'va' lies in a 2MB page, the whole 2MB page is unmapped.
 //
 // Details:
 //   - The ref count on the physical page should decrement.
@@ -803,17 +1058,63 @@ page_remove(pml4e_t *pml4e, void *va) {
     *ptep = 0;
     tlb_invalidate(pml4e, va); // больше не актуально
   } */
+  struct PageInfo *pp;
   pte_t *ent = pml4e_walk(pml4e, va, 0);
   if (!ent)
     return;
 
-  if (PTE_ADDR(*ent))
-    page_decref(pa2page(PTE_ADDR(*ent)));
+  if (PTE_ADDR(*ent)) {
+    pp = pa2page(PTE_ADDR(*ent));
+    // 2MB pages are released as the whole block.
+    if (!(*ent & PTE_PS))
+      page_decref(pp);
+    else if (--pp->pp_ref == 0)
+      page_free_order(pp, HUGE_PAGE_ORDER);
+  }
   *ent = 0;
 
   tlb_invalidate(pml4e, va);
 }
 
+//
+// Resolve a write fault on the copy-on-write user page at 'va':
+// give it a private writable copy of the page, or, if this is the
+// last mapping of the page, just make it writable again.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//   -E_INVAL if 'va' is not mapped by a user PTE_COW 4K page.
+//   -E_NO_MEM if there is no memory for the copy.
+//
+int
+page_cow_fault(pml4e_t *pml4e, void *va) {
+  struct PageInfo *pp, *np;
+  pte_t *ptep;
+  int perm;
+
+  va = ROUNDDOWN(va, PGSIZE);
+  if (!(pp = page_lookup(pml4e, va, &ptep)) ||
+      (*ptep & (PTE_U | PTE_COW | PTE_PS)) != (PTE_U | PTE_COW))
+    return -E_INVAL;
+
+  perm = ((*ptep & PTE_SYSCALL) & ~PTE_COW) | PTE_W;
+  if (pp->pp_ref == 1) {
+    *ptep = page2pa(pp) | perm;
+    tlb_invalidate(pml4e, va);
+    cow_stats.reused++;
+    return 0;
+  }
+
+  if (!(np = page_alloc(0)))
+    return -E_NO_MEM;
+  memcpy(page2kva(np), page2kva(pp), PGSIZE);
+  if (page_insert(pml4e, np, va, perm) < 0) {
+    page_free(np);
+    return -E_NO_MEM;
+  }
+  cow_stats.copied++;
+  return 0;
+}
+
 //
 // Invalidate a TLB entry, but only if the page tables being
 // edited are the ones currently in use by the processor.
@@ -821,8 +1122,26 @@ page_remove(pml4e_t *pml4e, void *va) {
 void
 tlb_invalidate(pml4e_t *pml4e, void *va) {
   // Flush the entry only if we're modifying the current address space.
+  // Other address spaces keep their entries under their own PCID then.
   if (!curenv || curenv->env_pml4e == pml4e)
     invlpg(va);
+  else if (pcid_enabled)
+    tlb_invalidate_pcid(pa2page(PADDR(pml4e))->pp_pcid, va);
+}
+
+//
+// Invalidate the TLB entries tagged with env PCID 'pcid' for 'va', or
+// all of them if 'va' is NULL.  Without INVPCID, the env is marked so
+// that env_run flushes them when it switches to it.
+//
+void
+tlb_invalidate_pcid(uint16_t pcid, void *va) {
+  if (!pcid_enabled || !pcid)
+    return;
+  if (has_invpcid)
+    invpcid(va ? INVPCID_ADDR : INVPCID_SINGLE, pcid, va);
+  else
+    envs[pcid - 1].env_pcid_stale = 1;
 }
 
 //
@@ -949,64 +1268,109 @@ user_mem_assert(struct Env *env, const void *va, size_t len, int perm) {
 // --------------------------------------------------------------
 
 //
-// Check that the pages on the page_free_list are reasonable.
+// Take all free pages off the pools and free lists, so that the checks
+// below can simulate running out of memory.  The blocks are no longer marked free,
+// hence nothing freed in the meantime gets merged with them.
 //
 static void
-check_page_free_list(bool only_low_memory) {
+page_free_area_steal(struct PageInfo *saved[NPAGEORDERS]) {
   struct PageInfo *pp;
-  unsigned pdx_limit = only_low_memory ? 1 : NPDENTRIES;
-  int nfree_basemem = 0, nfree_extmem = 0;
-  char *first_free_page;
+  int order;
+
+  page_pool_drain();
+  for (order = 0; order <= PAGE_MAX_ORDER; order++) {
+    saved[order] = page_free_area[order];
+    for (pp = saved[order]; pp; pp = pp->pp_link)
+      pp->pp_free = PAGE_IN_USE;
+    page_free_area[order]    = NULL;
+    page_free_nblocks[order] = 0;
+  }
+}
 
-  if (!page_free_list)
-    panic("'page_free_list' is a null pointer!");
-
-  if (only_low_memory) {
-    // Move pages with lower addresses first in the free
-    // list, since entry_pgdir does not map all pages.
-    struct PageInfo *pp1, *pp2;
-    struct PageInfo **tp[2] = {&pp1, &pp2};
-    for (pp = page_free_list; pp; pp = pp->pp_link) {
-      int pagetype  = VPN(page2pa(pp)) >= pdx_limit;
-      *tp[pagetype] = pp;
-      tp[pagetype]  = &pp->pp_link;
+//
+// Give back the blocks taken by page_free_area_steal().
+//
+static void
+page_free_area_restore(struct PageInfo *saved[NPAGEORDERS]) {
+  struct PageInfo *pp, *next;
+  int order;
+
+  for (order = 0; order <= PAGE_MAX_ORDER; order++) {
+    for (pp = saved[order]; pp; pp = next) {
+      next        = pp->pp_link;
+      pp->pp_link = NULL;
+      pp->pp_prev = 0;
+      page_free_order(pp, order);
     }
-    *tp[1]         = 0;
-    *tp[0]         = pp2;
-    page_free_list = pp1;
   }
+}
 
-  // if there's a page that shouldn't be on the free list,
-  // try to make sure it eventually causes trouble.
-  /*for (pp = page_free_list; pp; pp = pp->pp_link) {
-        if (VPN(page2pa(pp)) < pdx_limit) {
-#ifdef SANITIZE_SHADOW_BASE
-            // This is technically invalid memory, access it via unsanitized routine.
-            __nosan_memset(page2kva(pp), 0x97, 128);
-#else
-            memset(page2kva(pp), 0x97, 128);
-#endif
-        }
-    }*/
+//
+// Number of free pages on all the free lists.
+//
+static size_t
+page_free_npages(void) {
+  size_t n = 0;
+  int order;
+
+  for (order = 0; order <= PAGE_MAX_ORDER; order++)
+    n += page_free_nblocks[order] << order;
+  return n + page_pool_stats.ndirty + page_pool_stats.nzeroed;
+}
+
+//
+// Check that the blocks on the buddy free lists are reasonable.
+//
+static void
+check_page_free_list(void) {
+  struct PageInfo *pp, *prev;
+  int nfree_basemem = 0, nfree_extmem = 0;
+  size_t nblocks, i;
+  char *first_free_page;
+  physaddr_t pa;
+  int order;
+
+  if (!page_free_npages())
+    panic("buddy free lists are empty!");
 
   first_free_page = (char *)boot_alloc(0);
-  for (pp = page_free_list; pp; pp = pp->pp_link) {
-    // check that we didn't corrupt the free list itself
-    assert(pp >= pages);
-    assert(pp < pages + npages);
-    assert(((char *)pp - (char *)pages) % sizeof(*pp) == 0);
-
-    // check a few pages that shouldn't be on the free list
-    assert(page2pa(pp) != 0);
-    assert(page2pa(pp) != IOPHYSMEM);
-    assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
-    assert(page2pa(pp) != EXTPHYSMEM);
-    assert(page2pa(pp) < EXTPHYSMEM || (char *)page2kva(pp) >= first_free_page);
-
-    if (page2pa(pp) < EXTPHYSMEM)
-      ++nfree_basemem;
-    else
-      ++nfree_extmem;
+  for (order = 0; order <= PAGE_MAX_ORDER; order++) {
+    nblocks = 0;
+    prev    = NULL;
+    for (pp = page_free_area[order]; pp; prev = pp, pp = pp->pp_link) {
+      // check that we didn't corrupt the free list itself
+      assert(pp >= pages);
+      assert(pp + (1UL << order) <= pages + npages);
+      assert(((char *)pp - (char *)pages) % sizeof(*pp) == 0);
+      assert(((pp - pages) & ((1UL << order) - 1)) == 0);
+      assert(pp->pp_free == PAGE_FREE_BUDDY && pp->pp_order == order);
+      assert(prev ? pp->pp_prev == prev - pages : !pp->pp_prev);
+      assert(!page_is_allocated(pp) && !page_is_allocated(pp + (1UL << order) - 1));
+      nblocks++;
+
+      for (i = 0; i < (1UL << order); i++) {
+        pa = page2pa(pp + i);
+
+        // check a few pages that shouldn't be on the free list
+        assert(pa != 0);
+        assert(pa != IOPHYSMEM);
+        assert(pa != EXTPHYSMEM - PGSIZE);
+        assert(pa != EXTPHYSMEM);
+        assert(pa < EXTPHYSMEM || (char *)page2kva(pp + i) >= first_free_page);
+
+        if (pa < EXTPHYSMEM)
+          ++nfree_basemem;
+        else
+          ++nfree_extmem;
+      }
+
+      // two free buddies of the same order should have been merged
+      if (order < PAGE_MAX_ORDER) {
+        struct PageInfo *buddy = &pages[(pp - pages) ^ (1UL << order)];
+        assert(buddy >= pages + npages || !(buddy->pp_free == PAGE_FREE_BUDDY && buddy->pp_order == order));
+      }
+    }
+    assert(nblocks == page_free_nblocks[order]);
   }
 
   //assert(nfree_basemem > 0);
@@ -1020,8 +1384,8 @@ check_page_free_list(bool only_low_memory) {
 static void
 check_page_alloc(void) {
   struct PageInfo *pp, *pp0, *pp1, *pp2;
-  int nfree;
-  struct PageInfo *fl;
+  size_t nfree;
+  struct PageInfo *fl[NPAGEORDERS];
   char *c;
   int i;
 
@@ -1029,8 +1393,7 @@ check_page_alloc(void) {
     panic("'pages' is a null pointer!");
 
   // check number of free pages
-  for (pp = page_free_list, nfree = 0; pp; pp = pp->pp_link)
-    ++nfree;
+  nfree = page_free_npages();
 
   // should be able to allocate three pages
   pp0 = pp1 = pp2 = 0;
@@ -1046,8 +1409,7 @@ check_page_alloc(void) {
   assert(page2pa(pp2) < npages * PGSIZE);
 
   // temporarily steal the rest of the free pages
-  fl             = page_free_list;
-  page_free_list = 0;
+  page_free_area_steal(fl);
 
   // should be no free memory
   assert(!page_alloc(0));
@@ -1074,8 +1436,11 @@ check_page_alloc(void) {
   for (i = 0; i < PGSIZE; i++)
     assert(c[i] == 0);
 
+  // three single pages never make up an order 2 block
+  assert(!page_alloc_order(2, 0));
+
   // give free list back
-  page_free_list = fl;
+  page_free_area_restore(fl);
 
   // free the pages we took
   page_free(pp0);
@@ -1083,9 +1448,23 @@ check_page_alloc(void) {
   page_free(pp2);
 
   // number of free pages should be the same
-  for (pp = page_free_list; pp; pp = pp->pp_link)
-    --nfree;
-  assert(nfree == 0);
+  assert(nfree == page_free_npages());
+
+  // multi-page blocks are naturally aligned and contiguous,
+  // and are merged back with their buddies when freed
+  assert((pp0 = page_alloc_order(3, ALLOC_ZERO)));
+  assert(((pp0 - pages) & 7) == 0);
+  assert(page_is_allocated(pp0) && page_is_allocated(pp0 + 7));
+  c = page2kva(pp0);
+  for (i = 0; i < 8 * PGSIZE; i++)
+    assert(c[i] == 0);
+  assert((pp1 = page_alloc_order(PAGE_MAX_ORDER, 0)));
+  assert(((pp1 - pages) & ((1 << PAGE_MAX_ORDER) - 1)) == 0);
+  assert(pp1 + (1 << PAGE_MAX_ORDER) <= pp0 || pp0 + 8 <= pp1);
+  assert(!page_alloc_order(PAGE_MAX_ORDER + 1, 0));
+  page_free_order(pp0, 3);
+  page_free_order(pp1, PAGE_MAX_ORDER);
+  assert(nfree == page_free_npages());
 
   cprintf("check_page_alloc() succeeded!\n");
 }
@@ -1168,11 +1547,15 @@ check_va2pa(pml4e_t *pml4e, uintptr_t va) {
   // cprintf(" %x %x " , pdpe, *pdpe);
   if (!(pdpe[PDPE(va)] & PTE_P))
     return ~0;
+  if (pdpe[PDPE(va)] & PTE_PS)
+    return PTE_ADDR(pdpe[PDPE(va)]) + ROUNDDOWN(va % PDPSIZE, PGSIZE);
   pde = (pde_t *)KADDR(PTE_ADDR(pdpe[PDPE(va)]));
   // cprintf(" %x %x " , pde, *pde);
   pde = &pde[PDX(va)];
   if (!(*pde & PTE_P))
     return ~0;
+  if (*pde & PTE_PS)
+    return PTE_ADDR(*pde) + ROUNDDOWN(va % PTSIZE, PGSIZE);
   pte = (pte_t *)KADDR(PTE_ADDR(*pde));
   // cprintf(" %x %x " , pte, *pte);
   if (!(pte[PTX(va)] & PTE_P))
@@ -1185,7 +1568,7 @@ check_va2pa(pml4e_t *pml4e, uintptr_t va) {
 static void
 check_page(void) {
   struct PageInfo *pp0, *pp1, *pp2, *pp3, *pp4, *pp5;
-  struct PageInfo *fl;
+  struct PageInfo *fl[NPAGEORDERS];
   pte_t *ptep, *ptep1;
   pdpe_t *pdpe;
   pde_t *pde;
@@ -1213,9 +1596,8 @@ check_page(void) {
   assert(pp5 && pp5 != pp4 && pp5 != pp3 && pp5 != pp2 && pp5 != pp1 && pp5 != pp0);
 
   // temporarily steal the rest of the free pages
-  fl = page_free_list;
-  assert(fl != NULL);
-  page_free_list = NULL;
+  assert(page_free_npages() > 0);
+  page_free_area_steal(fl);
 
   // should be no free memory
   assert(!page_alloc(0));
@@ -1344,7 +1726,7 @@ check_page(void) {
   kern_pml4e[0] = 0;
 
   // give free list back
-  page_free_list = fl;
+  page_free_area_restore(fl);
 
   // free the pages we took
   page_decref(pp0);
@@ -55,6 +55,47 @@ enum {
   ALLOC_ZERO = 1 << 0,
 };
 
+// The buddy allocator hands out naturally aligned blocks of
+// 2^order pages, order being in [0; PAGE_MAX_ORDER].
+#define PAGE_MAX_ORDER 10
+#define NPAGEORDERS    (PAGE_MAX_ORDER + 1)
+
+// Order of the block backing a 2MB (PTE_PS) user mapping.
+#define HUGE_PAGE_ORDER (PTSHIFT - PGSHIFT)
+
+// Values of PageInfo's pp_free
+enum {
+  PAGE_IN_USE = 0,   // Allocated (or boot time reserved)
+  PAGE_FREE_BUDDY,   // First page of a block on a buddy free list
+  PAGE_FREE_DIRTY,   // Freed single page not zeroed yet
+  PAGE_FREE_ZEROED,  // Free single page already filled with zeroes
+};
+
+// Single pages freed with page_free() are kept on a dirty list of at
+// most PAGE_DIRTY_MAX pages; sched_halt() zeroes up to PAGE_ZERO_BATCH
+// of them per call, until PAGE_ZERO_TARGET zeroed pages are ready.
+#define PAGE_DIRTY_MAX   1024
+#define PAGE_ZERO_TARGET 512
+#define PAGE_ZERO_BATCH  64
+
+struct PagePoolStats {
+  size_t ndirty;      // Pages on the dirty list
+  size_t nzeroed;     // Pages on the zeroed list
+  size_t zero_hits;   // ALLOC_ZERO requests served from the zeroed list
+  size_t zero_misses; // ALLOC_ZERO requests that had to zero memory
+  size_t zero_filled; // Pages zeroed ahead of time by page_zero_refill()
+};
+
+extern struct PagePoolStats page_pool_stats;
+
+struct CowStats {
+  size_t copied;    // COW faults resolved by copying the page
+  size_t reused;    // COW faults on the last reference, resolved in place
+  size_t forwarded; // Write faults left to the user page fault upcall
+};
+
+extern struct CowStats cow_stats;
+
 void mem_init(void);
 
 #ifdef SANITIZE_SHADOW_BASE
@@ -64,18 +105,26 @@ void kasan_mem_init(void);
 void page_init(void);
 struct PageInfo *page_alloc(int alloc_flags);
 void page_free(struct PageInfo *pp);
+struct PageInfo *page_alloc_order(int order, int alloc_flags);
+void page_free_order(struct PageInfo *pp, int order);
+size_t page_free_blocks(int order);
+void page_zero_refill(void);
 int page_insert(pml4e_t *pml4e, struct PageInfo *pp, void *va, int perm);
 void page_remove(pml4e_t *pml4e, void *va);
+int page_cow_fault(pml4e_t *pml4e, void *va);
 struct PageInfo *page_lookup(pml4e_t *pml4e, void *va, pte_t **pte_store);
 void page_decref(struct PageInfo *pp);
 int page_is_allocated(const struct PageInfo *pp);
 
+extern bool pcid_enabled;
+
 void tlb_invalidate(pml4e_t *pml4e, void *va);
+void tlb_invalidate_pcid(uint16_t pcid, void *va);
 
 void *mmio_map_region(physaddr_t pa, size_t size);
 void *mmio_remap_last_region(physaddr_t pa, void *addr, size_t oldsize, size_t newsize);
 
-static void check_page_free_list(bool only_low_memory);
+static void check_page_free_list(void);
 
 int user_mem_check(struct Env *env, const void *va, size_t len, int perm);
 void user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
@@ -102,6 +151,7 @@ page2kva(struct PageInfo *pp) {
 pte_t *pgdir_walk(pde_t *pgdir, const void *va, int create);
 
 pte_t *pml4e_walk(pml4e_t *pml4e, const void *va, int create);
+pte_t *pml4e_walk_size(pml4e_t *pml4e, const void *va, size_t pgsize, int create);
 
 pde_t *pdpe_walk(pdpe_t *pdpe, const void *va, int create);
 
@@ -2,42 +2,102 @@
 #include <inc/x86.h>
 #include <kern/env.h>
 #include <kern/monitor.h>
+#include <kern/pmap.h>
+#include <kern/trap.h>
 
 struct Taskstate cpu_ts;
 void sched_halt(void);
 
+// Run queues, one FIFO list per priority level.  Bit N of runq_mask
+// is set iff level N is non-empty, so picking the next environment
+// does not depend on the number of environments in the system.
+static struct Env *runq_head[NENVPRIO];
+static struct Env *runq_tail[NENVPRIO];
+static uint32_t runq_mask;
+
+// Append 'e' to the tail of its priority level.
+// Does nothing if 'e' is already queued.
+void
+runq_insert(struct Env *e) {
+  int prio;
+
+  if (e->env_rq_linked)
+    return;
+
+  prio = e->env_priority;
+  assert(prio >= 0 && prio < NENVPRIO);
+
+  e->env_rq_next = NULL;
+  e->env_rq_prev = runq_tail[prio];
+  if (runq_tail[prio])
+    runq_tail[prio]->env_rq_next = e;
+  else
+    runq_head[prio] = e;
+  runq_tail[prio]  = e;
+  runq_mask       |= 1U << prio;
+  e->env_rq_linked = 1;
+}
+
+// Unlink 'e' from its run queue.
+// Does nothing if 'e' is not queued.
+void
+runq_remove(struct Env *e) {
+  int prio;
+
+  if (!e->env_rq_linked)
+    return;
+
+  prio = e->env_priority;
+  if (e->env_rq_prev)
+    e->env_rq_prev->env_rq_next = e->env_rq_next;
+  else
+    runq_head[prio] = e->env_rq_next;
+  if (e->env_rq_next)
+    e->env_rq_next->env_rq_prev = e->env_rq_prev;
+  else
+    runq_tail[prio] = e->env_rq_prev;
+  if (!runq_head[prio])
+    runq_mask &= ~(1U << prio);
+
+  e->env_rq_next = e->env_rq_prev = NULL;
+  e->env_rq_linked = 0;
+}
+
+// Move 'e' to another priority level, keeping it queued if it was.
+void
+runq_set_priority(struct Env *e, int prio) {
+  bool linked = e->env_rq_linked;
+
+  runq_remove(e);
+  e->env_priority = prio;
+  if (linked)
+    runq_insert(e);
+}
+
 // Choose a user environment to run and run it.
 void
 sched_yield(void) {
-  // Implement simple round-robin scheduling.
-  //
-  // Search through 'envs' for an ENV_RUNNABLE environment in
-  // circular fashion starting just after the env was
-  // last running.  Switch to the first such environment found.
+  // Run the head of the most favored non-empty run queue.
+  // env_run() takes it off the queue and puts the previously
+  // running environment, if it is still ENV_RUNNING, at the tail
+  // of its own level, so environments of equal priority are
+  // served round-robin.
   //
-  // If no envs are runnable, but the environment previously
-  // running is still ENV_RUNNING, it's okay to
-  // choose that environment.
+  // The environment previously running, if it is still
+  // ENV_RUNNING, competes at its own level: it goes on running
+  // if nothing is queued at that level or a more favored one.
   //
   // If there are no runnable environments,
   // simply drop through to the code
   // below to halt the cpu.
 
-  // LAB 3: Your code here.
+  bool cur = curenv && curenv->env_status == ENV_RUNNING;
 
-  // If no current environment,
-  // start scanning from the beginning of array
-  int id   = curenv ? ENVX(curenv_getid()) : 0;
-  int orig = id;
+  if (runq_mask && (!cur || __builtin_ctz(runq_mask) <= curenv->env_priority))
+    env_run(runq_head[__builtin_ctz(runq_mask)]);
 
-  do {
-    id = (id + 1) % NENV; // id ∈ [0; кол-во процессов]
-    if (envs[id].env_status == ENV_RUNNABLE || 
-    (id == orig && envs[id].env_status == ENV_RUNNING)) {
-      // Found suitable environment to run
-      env_run(envs + id);  // envs - массив => envs + id - нужный элемент массива
-    }
-  } while (id != orig);
+  if (cur)
+    env_run(curenv);
 
   // No runnable environments,
   // so just halt the cpu
@@ -49,22 +109,23 @@ sched_yield(void) {
 //
 void
 sched_halt(void) {
-  int i;
-
   // For debugging and testing purposes, if there are no runnable
   // environments in the system, then drop into the kernel monitor.
-  for (i = 0; i < NENV; i++) {
-    if ((envs[i].env_status == ENV_RUNNABLE ||
-         envs[i].env_status == ENV_RUNNING ||
-         envs[i].env_status == ENV_DYING))
-      break;
-  }
-  if (i == NENV) {
+  // Every ENV_RUNNABLE environment is on a run queue, so only the
+  // current one has to be looked at separately.  An environment
+  // waiting for an interrupt, or in a receive that times out, will be
+  // runnable again.
+  if (!runq_mask && !irq_waiting() && !env_ipc_timing() &&
+      !(curenv && (curenv->env_status == ENV_RUNNING ||
+                   curenv->env_status == ENV_DYING))) {
     cprintf("No runnable environments in the system!\n");
     while (1)
       monitor(NULL);
   }
 
+  // Use the idle time to prepare zeroed pages for page_alloc(ALLOC_ZERO).
+  page_zero_refill();
+
   // Mark that no environment is running on CPU
   curenv = NULL;
 
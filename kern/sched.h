@@ -9,4 +9,10 @@
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
 
+#include <inc/env.h>
+
+void runq_insert(struct Env *e);
+void runq_remove(struct Env *e);
+void runq_set_priority(struct Env *e, int prio);
+
 #endif // !JOS_KERN_SCHED_H
@@ -12,6 +12,7 @@
 #include <kern/console.h>
 #include <kern/sched.h>
 #include <kern/kclock.h>
+#include <kern/picirq.h>
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -92,6 +93,7 @@ sys_exofork(void) {
   }
 
   e->env_status = ENV_NOT_RUNNABLE;
+  runq_remove(e);
   e->env_tf = curenv->env_tf;
   e->env_pgfault_upcall = curenv->env_pgfault_upcall;
 	e->env_tf.tf_regs.reg_rax = 0;
@@ -99,6 +101,140 @@ sys_exofork(void) {
 	return e->env_id;
 }
 
+#ifdef SANITIZE_USER_SHADOW_BASE
+static bool
+fork_cow_in_shadow(uintptr_t va) {
+  return (va >= SANITIZE_USER_SHADOW_BASE && va < SANITIZE_USER_SHADOW_BASE + SANITIZE_USER_SHADOW_SIZE) ||
+         (va >= SANITIZE_USER_EXTRA_SHADOW_BASE && va < SANITIZE_USER_EXTRA_SHADOW_BASE + SANITIZE_USER_EXTRA_SHADOW_SIZE) ||
+         (va >= SANITIZE_USER_STACK_SHADOW_BASE && va < SANITIZE_USER_STACK_SHADOW_BASE + SANITIZE_USER_STACK_SHADOW_SIZE) ||
+         (va >= SANITIZE_USER_VPT_SHADOW_BASE && va < SANITIZE_USER_VPT_SHADOW_BASE + SANITIZE_USER_VPT_SHADOW_SIZE);
+}
+#endif
+
+// Copy the page table 'pt' of the current environment, which maps the
+// 2MB at 'va', into a new page table installed at *child_pde.
+// Writable and copy-on-write pages become copy-on-write in both,
+// PTE_SHARE pages stay shared, read-only pages stay read-only.
+// Returns 1 if some entry in 'pt' was changed, 0 if not, < 0 on error.
+static int
+fork_cow_pt(pde_t *child_pde, pte_t *pt, uintptr_t va) {
+  struct PageInfo *np;
+  pte_t *child_pt;
+  int i, changed = 0;
+
+  if (!(np = page_alloc(ALLOC_ZERO))) {
+    return -E_NO_MEM;
+  }
+  np->pp_ref++;
+  *child_pde = page2pa(np) | PTE_P | PTE_U | PTE_W;
+  child_pt   = page2kva(np);
+
+  for (i = 0; i < NPTENTRIES; i++, va += PGSIZE) {
+    pte_t perm = pt[i] & PTE_SYSCALL;
+
+    if (!(pt[i] & PTE_P) || !(pt[i] & PTE_U) || va == UXSTACKTOP - PGSIZE) {
+      continue;
+    }
+#ifdef SANITIZE_USER_SHADOW_BASE
+    if (fork_cow_in_shadow(va)) {
+      continue;
+    }
+#endif
+    if (!(perm & PTE_SHARE) && (perm & (PTE_W | PTE_COW))) {
+      perm  = (perm | PTE_COW) & ~PTE_W;
+      pt[i] = PTE_ADDR(pt[i]) | perm;
+      changed = 1;
+    }
+    child_pt[i] = PTE_ADDR(pt[i]) | perm;
+    pa2page(PTE_ADDR(pt[i]))->pp_ref++;
+  }
+  return changed;
+}
+
+// Fork the current environment: create a child as sys_exofork does and
+// give it the parent's address space below UTOP, except for the user
+// exception stack.  Private writable pages are copied on write by the
+// user page fault handler, as in lib/fork.c; PTE_SHARE pages are shared.
+// Copy-on-write works on 4KB pages only, so private writable 2MB pages
+// are copied right away, and read-only ones shared.  The whole address
+// space is walked once, skipping absent tables, and the parent's TLB is
+// flushed once at the end.
+// The child is left ENV_NOT_RUNNABLE.
+//
+// Returns envid of new environment, or < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_fork_cow(void) {
+  struct Env *child;
+  pdpe_t *pdpe;
+  pde_t *pgdir, *child_pgdir;
+  struct PageInfo *pp;
+  envid_t envid;
+  uintptr_t va;
+  int i, j, r, flush = 0;
+
+  if ((envid = sys_exofork()) < 0) {
+    return envid;
+  }
+  envid2env(envid, &child, 0);
+
+  // UTOP is the end of the first PML4 entry.
+  static_assert(UTOP == 1UL << PML4SHIFT, "user space is not one PML4 entry");
+  if (!(curenv->env_pml4e[0] & PTE_P)) {
+    return envid;
+  }
+  pdpe = KADDR(PTE_ADDR(curenv->env_pml4e[0]));
+  for (i = 0; i < NPDPENTRIES; i++) {
+    if (!(pdpe[i] & PTE_P) || (pdpe[i] & PTE_PS)) {
+      continue;
+    }
+    pgdir       = KADDR(PTE_ADDR(pdpe[i]));
+    child_pgdir = NULL;
+    for (j = 0; j < NPDENTRIES; j++) {
+      va = ((uintptr_t)i << PDPESHIFT) | ((uintptr_t)j << PDXSHIFT);
+      if (!(pgdir[j] & PTE_P)) {
+        continue;
+      }
+      if (!child_pgdir &&
+          !(child_pgdir = pml4e_walk_size(child->env_pml4e, (void *)((uintptr_t)i << PDPESHIFT), PTSIZE, 1))) {
+        r = -E_NO_MEM;
+        goto fail;
+      }
+      if ((pgdir[j] & (PTE_PS | PTE_W | PTE_SHARE)) == (PTE_PS | PTE_W)) {
+        if (!(pp = page_alloc_order(HUGE_PAGE_ORDER, 0))) {
+          r = -E_NO_MEM;
+          goto fail;
+        }
+        memcpy(page2kva(pp), KADDR(PTE_ADDR(pgdir[j])), PTSIZE);
+        pp->pp_ref++;
+        child_pgdir[j] = page2pa(pp) | (pgdir[j] & (PTE_SYSCALL | PTE_PS));
+      } else if (pgdir[j] & PTE_PS) {
+        child_pgdir[j] = PTE_ADDR(pgdir[j]) | (pgdir[j] & (PTE_SYSCALL | PTE_PS));
+        pa2page(PTE_ADDR(pgdir[j]))->pp_ref++;
+      } else if ((r = fork_cow_pt(&child_pgdir[j], KADDR(PTE_ADDR(pgdir[j])), va)) < 0) {
+        goto fail;
+      } else {
+        flush |= r;
+      }
+    }
+  }
+
+  // Entries that turned copy-on-write may still be cached as writable.
+  // Reloading CR3 drops the user half, and with PCIDs only ours.
+  if (flush) {
+    lcr3(rcr3());
+  }
+  return envid;
+
+fail:
+  if (flush) {
+    lcr3(rcr3());
+  }
+  env_free(child);
+  return r;
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
 // or ENV_NOT_RUNNABLE.
 //
@@ -125,6 +261,40 @@ sys_env_set_status(envid_t envid, int status) {
       return -E_INVAL;
   }
   e->env_status = status;
+  if (status == ENV_RUNNABLE)
+    runq_insert(e);
+  else
+    runq_remove(e);
+
+  return 0;
+}
+
+// Set envid's scheduling priority, 0 (ENV_PRIO_HIGH) being the most
+// favored level and ENV_PRIO_LOW the least favored one.  A priority
+// may always be lowered, but raised no higher than the caller's own,
+// except by the file system server and kernel environments.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid,
+//		or to raise its priority that far.
+//	-E_INVAL if prio is not a valid priority level.
+static int
+sys_env_set_priority(envid_t envid, int prio) {
+  struct Env *e;
+
+  if (envid2env(envid, &e, 1) < 0) {
+    return -E_BAD_ENV;
+  }
+
+  if (prio < 0 || prio >= NENVPRIO) {
+    return -E_INVAL;
+  }
+  if (prio < e->env_priority && prio < curenv->env_priority &&
+      curenv->env_type != ENV_TYPE_FS && curenv->env_type != ENV_TYPE_KERNEL) {
+    return -E_BAD_ENV;
+  }
+  runq_set_priority(e, prio);
 
   return 0;
 }
@@ -199,6 +369,49 @@ sys_page_alloc(envid_t envid, void *va, int perm) {
   return 0;
 }
 
+// Allocate a zeroed, physically contiguous 2MB page and map it at 'va'
+// with a single PTE_PS entry.  Anything mapped in [va, va + PTSIZE)
+// before is unmapped.  perm has the same restrictions as in
+// sys_page_alloc.
+//
+// The page is mapped and unmapped as a whole: sys_page_map and IPC can
+// share it only at 2MB aligned addresses.  fork copies it for the child
+// at once if it is writable, unless it is PTE_SHARE, since it can't be
+// copied on write.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va >= UTOP, or va is not 2MB aligned.
+//	-E_INVAL if perm is inappropriate.
+//	-E_NO_MEM if there's no contiguous 2MB of memory, or no memory
+//		for the page tables.
+static int
+sys_page_alloc_huge(envid_t envid, void *va, int perm) {
+  struct PageInfo *pp;
+  struct Env *e;
+
+  if (envid2env(envid, &e, 1) < 0) {
+    return -E_BAD_ENV;
+  }
+
+  if ((uintptr_t) va >= UTOP || (uintptr_t) va % PTSIZE) {
+    return -E_INVAL;
+  }
+
+  if (perm & ~PTE_SYSCALL) {
+    return -E_INVAL;
+  }
+  if (!(pp = page_alloc_order(HUGE_PAGE_ORDER, ALLOC_ZERO))) {
+    return -E_NO_MEM;
+  }
+  if (page_insert(e->env_pml4e, pp, va, perm | PTE_U | PTE_PS) < 0) {
+    page_free_order(pp, HUGE_PAGE_ORDER);
+    return -E_NO_MEM;
+  }
+  return 0;
+}
+
 // Map the page of memory at 'srcva' in srcenvid's address space
 // at 'dstva' in dstenvid's address space with permission 'perm'.
 // Perm has the same restrictions as in _alloc, except
@@ -211,6 +424,8 @@ sys_page_alloc(envid_t envid, void *va, int perm) {
 //	-E_INVAL if srcva >= UTOP or srcva is not page-aligned,
 //		or dstva >= UTOP or dstva is not page-aligned.
 //	-E_INVAL is srcva is not mapped in srcenvid's address space.
+//	-E_INVAL if srcva is in a 2MB page and srcva or dstva is not
+//		2MB aligned.
 //	-E_INVAL if perm is inappropriate (see sys_page_alloc).
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's
 //		address space.
@@ -249,6 +464,13 @@ sys_page_map(envid_t srcenvid, void *srcva,
 	if (!(*ptep & PTE_W) && (perm & PTE_W)) {
 	  return -E_INVAL;
 	}
+  // A 2MB page can only be mapped as a whole.
+  if (*ptep & PTE_PS) {
+    if ((uintptr_t)srcva % PTSIZE || (uintptr_t)dstva % PTSIZE) {
+      return -E_INVAL;
+    }
+    perm |= PTE_PS;
+  }
 	if (page_insert(dstenv->env_pml4e, pp, dstva, perm | PTE_U)) {
 		return -E_NO_MEM;
 	}
@@ -279,9 +501,233 @@ sys_page_unmap(envid_t envid, void *va) {
 	return 0;
 }
 
+// Look at the npages pages from 'va' in curenv's address space, and
+// set bit i of 'bitmap' if page i has one of the PTE_A, PTE_D and
+// PTE_AVAIL bits in 'flags' set.  With HARVEST_CLEAR in 'flags', also
+// clear those bits, and flush the TLB once at the end.  Unmapped
+// stretches are skipped a page table at a time.  'bitmap' may be NULL
+// to only clear the bits.
+//
+// Returns the number of pages with bits set on success, < 0 on error.
+// Errors are:
+//	-E_INVAL if va is not page-aligned, or the pages reach above UTOP.
+//	-E_INVAL if flags has bits other than the above.
+//	-E_FAULT if 'bitmap' is not writable by curenv.
+static int
+sys_page_harvest(void *va, size_t npages, uint64_t *bitmap, int flags) {
+  uint64_t bits = flags & (PTE_A | PTE_D | PTE_AVAIL);
+  uintptr_t a;
+  size_t i, n, j;
+  pte_t *table, *ent;
+  int shift, found = 0;
+  bool flush = 0;
+
+  if (PGOFF(va) || (uintptr_t)va >= UTOP || npages > (UTOP - (uintptr_t)va) / PGSIZE) {
+    return -E_INVAL;
+  }
+  if (flags & ~(PTE_A | PTE_D | PTE_AVAIL | HARVEST_CLEAR)) {
+    return -E_INVAL;
+  }
+  if (bitmap) {
+    if (user_mem_check(curenv, bitmap, ROUNDUP(npages, 64) / 8, PTE_U | PTE_W) < 0) {
+      return -E_FAULT;
+    }
+    memset(bitmap, 0, ROUNDUP(npages, 64) / 8);
+  }
+
+  for (i = 0; i < npages; i += n) {
+    // Find the entry that maps 'a', or the one that is missing.
+    a     = (uintptr_t)va + i * PGSIZE;
+    table = curenv->env_pml4e;
+    for (shift = PML4SHIFT;; shift -= PDXSHIFT - PTXSHIFT) {
+      ent = &table[(a >> shift) & 0x1FF];
+      if (!(*ent & PTE_P) || (*ent & PTE_PS) || shift == PTXSHIFT) {
+        break;
+      }
+      table = KADDR(PTE_ADDR(*ent));
+    }
+    n = MIN(npages - i, ((ROUNDDOWN(a, 1UL << shift) + (1UL << shift)) - a) / PGSIZE);
+    if (!(*ent & PTE_P) || !(*ent & bits)) {
+      continue;
+    }
+
+    found += n;
+    for (j = i; bitmap && j < i + n; j++) {
+      bitmap[j / 64] |= 1ULL << (j % 64);
+    }
+    if (flags & HARVEST_CLEAR) {
+      *ent &= ~bits;
+      flush = 1;
+    }
+  }
+
+  // Cached entries would go on without setting the cleared bits again.
+  if (flush) {
+    lcr3(rcr3());
+  }
+  return found;
+}
+
+// Check that 'run', a page address or an IPC_PAGES() run of pages, is
+// a valid window below UTOP.
+static int
+ipc_check_run(void *run) {
+	uintptr_t va = (uintptr_t)IPC_PAGES_VA(run);
+
+	if (PGOFF(run) >= IPC_MAX_PAGES) {
+		return -E_INVAL;
+	}
+	if (va >= UTOP || IPC_PAGES_N(run) > (UTOP - va) / PGSIZE) {
+		return -E_INVAL;
+	}
+	return 0;
+}
+
+// Check that 'src' may send the pages of 'run' with 'perm'.
+// With PTE_COW in 'perm', the pages are shared copy-on-write, so they
+// must not be sent writable, and must not be PTE_SHARE or huge pages.
+// They must also be writable in 'src' and mapped nowhere else, since
+// the receiver may keep them as its own, and changes made through any
+// other mapping would show through.
+static int
+ipc_check_pages(struct Env *src, void *run, unsigned perm) {
+	char *va = IPC_PAGES_VA(run);
+	struct PageInfo *p;
+	pte_t *ptep;
+	size_t i;
+
+	if (ipc_check_run(run) < 0) {
+		return -E_INVAL;
+	}
+	if ((perm & ~(PTE_AVAIL | PTE_W)) != (PTE_U | PTE_P)) {
+		return -E_INVAL;
+	}
+	if ((perm & PTE_COW) && (perm & PTE_W)) {
+		return -E_INVAL;
+	}
+	for (i = 0; i < IPC_PAGES_N(run); i++, va += PGSIZE) {
+		if (!(p = page_lookup(src->env_pml4e, va, &ptep))) {
+			return -E_INVAL;
+		}
+		if (!(*ptep & PTE_W) && (perm & PTE_W)) {
+			return -E_INVAL;
+		}
+		// Huge pages only go alone.
+		if ((*ptep & PTE_PS) && IPC_PAGES_N(run) > 1) {
+			return -E_INVAL;
+		}
+		if ((perm & PTE_COW) && (*ptep & (PTE_PS | PTE_SHARE))) {
+			return -E_INVAL;
+		}
+		if ((perm & PTE_COW) && (!(*ptep & PTE_W) || p->pp_ref > 1)) {
+			return -E_INVAL;
+		}
+	}
+	return 0;
+}
+
+// Copy the message 'umsg' of curenv, if it is not NULL, to 'msg'.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_FAULT if curenv can't read the message.
+//	-E_INVAL if the message has more than IPC_MSG_WORDS words.
+static int
+ipc_copy_msg(struct IpcMsg *msg, const struct IpcMsg *umsg) {
+	size_t n;
+
+	msg->im_nwords = 0;
+	if (!umsg) {
+		return 0;
+	}
+	if (user_mem_check(curenv, umsg, sizeof(umsg->im_nwords), PTE_U) < 0) {
+		return -E_FAULT;
+	}
+	// Read the count once; the sender may change it under us.
+	if ((n = umsg->im_nwords) > IPC_MSG_WORDS) {
+		return -E_INVAL;
+	}
+	if (user_mem_check(curenv, umsg->im_words, n * sizeof(uint64_t), PTE_U) < 0) {
+		return -E_FAULT;
+	}
+	memcpy(msg->im_words, umsg->im_words, n * sizeof(uint64_t));
+	msg->im_nwords = n;
+	return 0;
+}
+
+// Whether 'dst' is blocked in a receive that takes a message from 'src'.
+static bool
+ipc_accepts(struct Env *dst, struct Env *src) {
+	return dst->env_ipc_recving &&
+	       (!dst->env_ipc_recv_from || dst->env_ipc_recv_from == src->env_id);
+}
+
+// Give 'value', the words of 'msg' (already copied into the kernel, or
+// NULL for none), and the pages of the run 'srcva' in 'src' if there are
+// any and 'dst' asked for them, to 'dst', which is blocked in
+// sys_ipc_recv.  As many pages are mapped as fit in dst's window.
+// Either all of them are mapped, or none.  If they are sent with
+// PTE_COW, src's mappings of them become copy-on-write too.
+// The status of either env is left alone.
+static int
+ipc_deliver(struct Env *src, struct Env *dst, uint32_t value, void *srcva, unsigned perm,
+            const struct IpcMsg *msg) {
+	char *va = IPC_PAGES_VA(srcva), *dstva = IPC_PAGES_VA(dst->env_ipc_dstva);
+	struct PageInfo *p;
+	pte_t *ptep;
+	size_t i, n;
+	int r;
+
+	dst->env_ipc_perm = 0;
+	dst->env_ipc_npages = 0;
+	if ((uintptr_t) srcva < UTOP) {
+		if ((r = ipc_check_pages(src, srcva, perm)) < 0) {
+			return r;
+		}
+		if ((uintptr_t) dst->env_ipc_dstva < UTOP) {
+			n = MIN(IPC_PAGES_N(srcva), IPC_PAGES_N(dst->env_ipc_dstva));
+			for (i = 0; i < n; i++) {
+				p = page_lookup(src->env_pml4e, va + i * PGSIZE, &ptep);
+				if (*ptep & PTE_PS) {
+					if ((uintptr_t)va % PTSIZE || (uintptr_t)dstva % PTSIZE) {
+						return -E_INVAL;
+					}
+					perm |= PTE_PS;
+				}
+				if (page_insert(dst->env_pml4e, p, dstva + i * PGSIZE, perm)) {
+					while (i-- > 0) {
+						page_remove(dst->env_pml4e, dstva + i * PGSIZE);
+					}
+					return -E_NO_MEM;
+				}
+			}
+			for (i = 0; (perm & PTE_COW) && i < n; i++) {
+				page_lookup(src->env_pml4e, va + i * PGSIZE, &ptep);
+				if (*ptep & PTE_W) {
+					*ptep = (*ptep & ~PTE_W) | PTE_COW;
+					tlb_invalidate(src->env_pml4e, va + i * PGSIZE);
+				}
+			}
+			dst->env_ipc_perm = perm;
+			dst->env_ipc_npages = n;
+		}
+	}
+	dst->env_ipc_recving = 0;
+	env_ipc_end_wait(dst);
+	env_ipc_disarm_timeout(dst);
+	dst->env_ipc_from = src->env_id;
+	dst->env_ipc_value = value;
+	dst->env_ipc_msg.im_nwords = 0;
+	if (msg) {
+		memcpy(&dst->env_ipc_msg, msg, sizeof(msg->im_nwords) + msg->im_nwords * sizeof(uint64_t));
+	}
+	return 0;
+}
+
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
+// 'srcva' can also be a run of pages made with IPC_PAGES(); as many of
+// them are sent as the receiver's window takes.  With PTE_COW in 'perm',
+// the pages are shared copy-on-write, like fork shares them.
 //
 // The send fails with a return value of -E_IPC_NOT_RECV if the
 // target is not blocked, waiting for an IPC.
@@ -293,7 +739,8 @@ sys_page_unmap(envid_t envid, void *va) {
 //    env_ipc_recving is set to 0 to block future sends;
 //    env_ipc_from is set to the sending envid;
 //    env_ipc_value is set to the 'value' parameter;
-//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise.
+//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise;
+//    env_ipc_npages is set to the number of pages transferred.
 // The target environment is marked runnable again, returning 0
 // from the paused sys_ipc_recv system call.  (Hint: does the
 // sys_ipc_recv function ever actually return?)
@@ -321,68 +768,319 @@ static int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm) {
   // LAB 9: Your code here.
   struct Env *e;
-	struct PageInfo *p;
-	pte_t *ptep;
+  int r;
 
 	if (envid2env(envid, &e, 0) < 0) {
 		return -E_BAD_ENV;
 	}
-	if (!e->env_ipc_recving) {
+	if (!ipc_accepts(e, curenv)) {
 		return -E_IPC_NOT_RECV;
 	}
-
-	if ((uintptr_t) srcva < UTOP) {
-		if (PGOFF(srcva)) {
-			return -E_INVAL;
-		}
-		if ((perm & ~(PTE_AVAIL | PTE_W)) != (PTE_U | PTE_P)) {
-      return -E_INVAL;
-    }
-		if (!(p = page_lookup(curenv->env_pml4e, srcva, &ptep))) {
-			return -E_INVAL;
-		}
-		if (!(*ptep & PTE_W) && (perm & PTE_W)) {
-			return -E_INVAL;
-		}
-		if (page_insert(e->env_pml4e, p, e->env_ipc_dstva, perm)) {
-			return -E_NO_MEM;
-		}
-    e->env_ipc_perm = perm;
-	} else {
-		e->env_ipc_perm = 0;
+	if ((r = ipc_deliver(curenv, e, value, srcva, perm, NULL)) < 0) {
+		return r;
 	}
-	e->env_ipc_recving = 0;
-	e->env_ipc_from = curenv->env_id;
-	e->env_ipc_value = value;
 	e->env_status = ENV_RUNNABLE;
+	runq_insert(e);
 	return 0;
 }
 
+// Send a value like sys_ipc_try_send, but if envid is not receiving
+// yet, block until it calls sys_ipc_recv instead of failing.  Blocked
+// senders are served in the order they arrived.  If envid is waiting
+// in sys_ipc_recv already, the CPU is handed to it right away.
+//
+// If 'umsg' is not NULL, its words are sent as well, and the receiver
+// finds them in env_ipc_msg.
+//
+// Returns 0 on success, < 0 on error.  Errors are those of
+// sys_ipc_try_send except -E_IPC_NOT_RECV, and:
+//	-E_INVAL if envid is the caller.
+//	-E_BAD_ENV if envid exits while we are blocked.
+//	-E_FAULT if umsg can't be read.
+//	-E_INVAL if umsg has more than IPC_MSG_WORDS words.
+static int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, unsigned perm, const struct IpcMsg *umsg) {
+  struct IpcMsg msg;
+  struct Env *e;
+  int r;
+
+  if ((r = ipc_copy_msg(&msg, umsg)) < 0) {
+    return r;
+  }
+  if (envid2env(envid, &e, 0) < 0) {
+    return -E_BAD_ENV;
+  }
+  if (e == curenv) {
+    return -E_INVAL;
+  }
+
+  if (ipc_accepts(e, curenv)) {
+    if ((r = ipc_deliver(curenv, e, value, srcva, perm, &msg)) < 0) {
+      return r;
+    }
+    curenv->env_tf.tf_regs.reg_rax = 0;
+    env_run(e);
+  }
+
+  // Fail now on bad arguments rather than when the receiver shows up.
+  if ((uintptr_t) srcva < UTOP && (r = ipc_check_pages(curenv, srcva, perm)) < 0) {
+    return r;
+  }
+  curenv->env_ipc_send_value     = value;
+  curenv->env_ipc_send_srcva     = srcva;
+  curenv->env_ipc_send_perm      = perm;
+  curenv->env_ipc_send_msg       = msg;
+  curenv->env_status             = ENV_NOT_RUNNABLE;
+  curenv->env_tf.tf_regs.reg_rax = 0;
+  env_ipc_block_sender(curenv, e);
+  sched_yield();
+}
+
+// Take the message of the oldest sender blocked on curenv, which is
+// receiving already.  A sender whose page can't be delivered any more
+// gets the error, and the next one is tried.  A sender that made a
+// sys_ipc_call stays blocked, now waiting for our reply.
+// Returns 1 if a message was taken, 0 if there was none.
+static bool
+ipc_recv_queued(void) {
+  struct Env *sender;
+  int r;
+
+  while ((sender = env_ipc_next_sender(curenv))) {
+    r = ipc_deliver(sender, curenv, sender->env_ipc_send_value,
+                    sender->env_ipc_send_srcva, sender->env_ipc_send_perm,
+                    &sender->env_ipc_send_msg);
+    if (!r && sender->env_ipc_calling) {
+      sender->env_ipc_calling = 0;
+      env_ipc_wait_reply(sender, curenv);
+      return 1;
+    }
+    sender->env_ipc_calling        = 0;
+    sender->env_tf.tf_regs.reg_rax = r;
+    sender->env_status             = ENV_RUNNABLE;
+    runq_insert(sender);
+    if (!r) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
 // Block until a value is ready.  Record that you want to receive
 // using the env_ipc_recving and env_ipc_dstva fields of struct Env,
 // mark yourself not runnable, and then give up the CPU.
 //
+// If a sender is blocked in sys_ipc_send on us already, its value is
+// taken right away instead, and the sender becomes runnable again.
+//
 // If 'dstva' is < UTOP, then you are willing to receive a page of data.
-// 'dstva' is the virtual address at which the sent page should be mapped.
+// 'dstva' is the virtual address at which the sent page should be mapped,
+// or an IPC_PAGES() window for a run of pages.
 //
-// This function only returns on error, but the system call will eventually
-// return 0 on success.
+// This function only returns on error, or when a blocked sender was
+// there, but the system call will eventually return 0 on success.
 // Return < 0 on error.  Errors are:
 //	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_TIMEOUT if nothing arrived within curenv's sys_ipc_timeout.
 static int
 sys_ipc_recv(void *dstva) {
   // LAB 9: Your code here.
-  if ((uintptr_t)dstva < UTOP && PGOFF(dstva)) {
+  if ((uintptr_t)dstva < UTOP && ipc_check_run(dstva) < 0) {
     return -E_INVAL;
   }
 	curenv->env_ipc_recving = 1;
 	curenv->env_ipc_dstva = dstva;
+  curenv->env_ipc_recv_from = 0;
+
+  if (ipc_recv_queued()) {
+    return 0;
+  }
+
 	curenv->env_status = ENV_NOT_RUNNABLE;
   curenv->env_tf.tf_regs.reg_rax = 0;
+  env_ipc_arm_timeout(curenv);
 	sched_yield();
 	return 0;
 }
 
+// Send a request to envid like sys_ipc_send, then wait for the reply
+// from envid alone, like sys_ipc_recv at 'dstva'.  Both happen in one
+// system call, and if envid is waiting to receive already, the CPU goes
+// to it directly.
+//
+// Returns 0 when the reply has arrived, < 0 on error.  Errors are those
+// of sys_ipc_send and sys_ipc_recv, and:
+//	-E_BAD_ENV if envid exits before it replies.
+//	-E_INVAL if the reply's page can't be delivered.
+static int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+             const struct IpcMsg *umsg, void *dstva) {
+  struct IpcMsg msg;
+  struct Env *e;
+  int r;
+
+  if ((uintptr_t)dstva < UTOP && ipc_check_run(dstva) < 0) {
+    return -E_INVAL;
+  }
+  if ((r = ipc_copy_msg(&msg, umsg)) < 0) {
+    return r;
+  }
+  if (envid2env(envid, &e, 0) < 0) {
+    return -E_BAD_ENV;
+  }
+  if (e == curenv) {
+    return -E_INVAL;
+  }
+
+  if (ipc_accepts(e, curenv)) {
+    if ((r = ipc_deliver(curenv, e, value, srcva, perm, &msg)) < 0) {
+      return r;
+    }
+    curenv->env_ipc_dstva          = dstva;
+    env_ipc_wait_reply(curenv, e);
+    curenv->env_status             = ENV_NOT_RUNNABLE;
+    curenv->env_tf.tf_regs.reg_rax = 0;
+    env_run(e);
+  }
+
+  if ((uintptr_t) srcva < UTOP && (r = ipc_check_pages(curenv, srcva, perm)) < 0) {
+    return r;
+  }
+  // The receiver turns us into a receiver from it when it takes
+  // the request (see ipc_recv_queued).
+  curenv->env_ipc_dstva          = dstva;
+  curenv->env_ipc_send_value     = value;
+  curenv->env_ipc_send_srcva     = srcva;
+  curenv->env_ipc_send_perm      = perm;
+  curenv->env_ipc_send_msg       = msg;
+  curenv->env_ipc_calling        = 1;
+  curenv->env_status             = ENV_NOT_RUNNABLE;
+  curenv->env_tf.tf_regs.reg_rax = 0;
+  env_ipc_block_sender(curenv, e);
+  sched_yield();
+}
+
+// Reply to envid, which must be waiting in sys_ipc_call on us, then
+// receive the next message like sys_ipc_recv at 'dstva'.  If no message
+// is queued, the CPU goes straight to envid.  The reply is dropped if
+// envid is gone or not receiving from us, so a client can never make
+// the caller block on it; if its page can't be delivered, envid's call
+// fails with the error instead.  An envid of 0 just receives.
+//
+// Returns 0 when a message has arrived, < 0 on error.  Errors are:
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_FAULT if umsg can't be read.
+//	-E_INVAL if umsg has more than IPC_MSG_WORDS words.
+//	-E_TIMEOUT if nothing arrived within curenv's sys_ipc_timeout.
+static int
+sys_ipc_reply_wait(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+                   const struct IpcMsg *umsg, void *dstva) {
+  struct Env *e, *client = NULL;
+  struct IpcMsg msg;
+  int r;
+
+  if ((uintptr_t)dstva < UTOP && ipc_check_run(dstva) < 0) {
+    return -E_INVAL;
+  }
+  if ((r = ipc_copy_msg(&msg, umsg)) < 0) {
+    return r;
+  }
+
+  if (envid && !envid2env(envid, &e, 0) && ipc_accepts(e, curenv)) {
+    if ((r = ipc_deliver(curenv, e, value, srcva, perm, &msg)) < 0) {
+      e->env_ipc_recving = 0;
+      env_ipc_end_wait(e);
+    }
+    e->env_tf.tf_regs.reg_rax = r;
+    e->env_status             = ENV_RUNNABLE;
+    runq_insert(e);
+    client = e;
+  }
+
+  curenv->env_ipc_recving   = 1;
+  curenv->env_ipc_dstva     = dstva;
+  curenv->env_ipc_recv_from = 0;
+  if (ipc_recv_queued()) {
+    return 0;
+  }
+
+  curenv->env_status             = ENV_NOT_RUNNABLE;
+  curenv->env_tf.tf_regs.reg_rax = 0;
+  env_ipc_arm_timeout(curenv);
+  if (client) {
+    env_run(client);
+  }
+  sched_yield();
+}
+
+// Make the receives of curenv that block for a message from anyone,
+// in sys_ipc_recv or sys_ipc_reply_wait, give up with -E_TIMEOUT after
+// 'secs' seconds, counted by the clock interrupt.  0 means they wait
+// for ever.  Waiting for a reply to a sys_ipc_call never times out.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if secs does not fit in an int.
+static int
+sys_ipc_timeout(unsigned secs) {
+  if ((int)secs < 0) {
+    return -E_INVAL;
+  }
+  curenv->env_ipc_timeout = secs;
+  return 0;
+}
+
+// Deliver hardware interrupt 'irq' to curenv from now on, for the
+// device curenv drives, and unmask it.  Only the file system server,
+// which has I/O privilege, may do so.  An IRQ that arrives is noted,
+// and masked, until curenv waits for it with sys_irq_wait.  If stopport
+// is not 0, the kernel writes 0 to that port when curenv is freed,
+// before its pages are, to stop the device's DMA into them.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if curenv is not the file system server.
+//	-E_INVAL if irq is not one that user environments may take.
+//	-E_INVAL if another environment listens to irq already.
+static int
+sys_irq_listen(unsigned irq, uint16_t stopport) {
+  if (curenv->env_type != ENV_TYPE_FS) {
+    return -E_BAD_ENV;
+  }
+  if (irq >= MAX_IRQS || !(IRQ_USER_MASK & (1 << irq))) {
+    return -E_INVAL;
+  }
+  if (irq_env[irq] && irq_env[irq] != curenv) {
+    return -E_INVAL;
+  }
+  irq_env[irq]       = curenv;
+  irq_stop_port[irq] = stopport;
+  irq_set_masked(irq, 0);
+  return 0;
+}
+
+// Block until the IRQ 'irq' that curenv listens to has arrived since
+// the last sys_irq_wait for it.  Returns right away if it has.  The
+// caller has to have served its device by then, since the IRQ is
+// unmasked again for the wait.
+//
+// Returns 0 once the IRQ arrived, < 0 on error.  Errors are:
+//	-E_INVAL if curenv does not listen to irq.
+static int
+sys_irq_wait(unsigned irq) {
+  if (irq >= MAX_IRQS || irq_env[irq] != curenv) {
+    return -E_INVAL;
+  }
+  if (curenv->env_irq_pending & (1 << irq)) {
+    curenv->env_irq_pending &= ~(1 << irq);
+    return 0;
+  }
+
+  irq_set_masked(irq, 0);
+  curenv->env_irq_wait           = 1 << irq;
+  curenv->env_status             = ENV_NOT_RUNNABLE;
+  curenv->env_tf.tf_regs.reg_rax = 0;
+  sched_yield();
+}
+
 static int
 sys_env_set_trapframe(envid_t envid, struct Trapframe *tf) {
   struct Env *env;
@@ -413,7 +1111,7 @@ sys_gettime(void) {
 
 // Dispatches to the correct kernel function, passing the arguments.
 uintptr_t
-syscall(uintptr_t syscallno, uintptr_t a1, uintptr_t a2, uintptr_t a3, uintptr_t a4, uintptr_t a5) {
+syscall(uintptr_t syscallno, uintptr_t a1, uintptr_t a2, uintptr_t a3, uintptr_t a4, uintptr_t a5, uintptr_t a6) {
   // Call the function corresponding to the 'syscallno' parameter.
   // Return any appropriate return value.
   // LAB 8: Your code here.
@@ -435,10 +1133,18 @@ syscall(uintptr_t syscallno, uintptr_t a1, uintptr_t a2, uintptr_t a3, uintptr_t
     return sys_env_set_status((envid_t) a1, (int) a2);
   else if (syscallno == SYS_page_alloc)
     return sys_page_alloc((envid_t) a1, (void *) a2, (int) a3);
+  else if (syscallno == SYS_fork_cow)
+    return sys_fork_cow();
+  else if (syscallno == SYS_page_alloc_huge)
+    return sys_page_alloc_huge((envid_t) a1, (void *) a2, (int) a3);
   else if (syscallno == SYS_page_map)
     return sys_page_map((envid_t) a1, (void *) a2, (envid_t) a3, (void *) a4, (int) a5);
   else if (syscallno == SYS_page_unmap)
     return sys_page_unmap((envid_t) a1, (void *) a2);
+  else if (syscallno == SYS_page_harvest)
+    return sys_page_harvest((void *) a1, (size_t) a2, (uint64_t *) a3, (int) a4);
+  else if (syscallno == SYS_env_set_priority)
+    return sys_env_set_priority((envid_t) a1, (int) a2);
   else if (syscallno == SYS_env_set_pgfault_upcall)
     return sys_env_set_pgfault_upcall((envid_t) a1, (void *) a2);
   else if (syscallno == SYS_yield) {
@@ -451,8 +1157,22 @@ syscall(uintptr_t syscallno, uintptr_t a1, uintptr_t a2, uintptr_t a3, uintptr_t
     return sys_env_set_trapframe((envid_t)a1, (struct Trapframe *)a2);
   else if (syscallno == SYS_ipc_try_send)
     return sys_ipc_try_send((envid_t) a1, (uint32_t) a2, (void *) a3, (unsigned) a4);
+  else if (syscallno == SYS_ipc_send)
+    return sys_ipc_send((envid_t) a1, (uint32_t) a2, (void *) a3, (unsigned) a4, (const struct IpcMsg *) a5);
+  else if (syscallno == SYS_ipc_call)
+    return sys_ipc_call((envid_t) a1, (uint32_t) a2, (void *) a3, (unsigned) a4,
+                        (const struct IpcMsg *) a6, (void *) a5);
+  else if (syscallno == SYS_ipc_reply_wait)
+    return sys_ipc_reply_wait((envid_t) a1, (uint32_t) a2, (void *) a3, (unsigned) a4,
+                              (const struct IpcMsg *) a6, (void *) a5);
   else if (syscallno == SYS_ipc_recv)
     return sys_ipc_recv((void *) a1);
+  else if (syscallno == SYS_ipc_timeout)
+    return sys_ipc_timeout((unsigned) a1);
+  else if (syscallno == SYS_irq_listen)
+    return sys_irq_listen((unsigned) a1, (uint16_t) a2);
+  else if (syscallno == SYS_irq_wait)
+    return sys_irq_wait((unsigned) a1);
   else 
     return -E_INVAL;
 }
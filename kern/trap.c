@@ -90,6 +90,12 @@ trap_init(void) {
   
   extern void (*kbd_thdlr)(void);
   extern void (*serial_thdlr)(void);
+  extern void (*irq5_thdlr)(void);
+  extern void (*irq9_thdlr)(void);
+  extern void (*irq10_thdlr)(void);
+  extern void (*irq11_thdlr)(void);
+  extern void (*ide_thdlr)(void);
+  extern void (*ide2_thdlr)(void);
 
   extern void (*syscall_thdlr)(void);
 
@@ -112,6 +118,12 @@ trap_init(void) {
 
   SETGATE(idt[IRQ_OFFSET + IRQ_KBD], 0, GD_KT, &kbd_thdlr, 3);
   SETGATE(idt[IRQ_OFFSET + IRQ_SERIAL], 0, GD_KT, &serial_thdlr, 3);
+  SETGATE(idt[IRQ_OFFSET + 5], 0, GD_KT, &irq5_thdlr, 0);
+  SETGATE(idt[IRQ_OFFSET + 9], 0, GD_KT, &irq9_thdlr, 0);
+  SETGATE(idt[IRQ_OFFSET + 10], 0, GD_KT, &irq10_thdlr, 0);
+  SETGATE(idt[IRQ_OFFSET + 11], 0, GD_KT, &irq11_thdlr, 0);
+  SETGATE(idt[IRQ_OFFSET + IRQ_IDE], 0, GD_KT, &ide_thdlr, 0);
+  SETGATE(idt[IRQ_OFFSET + IRQ_IDE2], 0, GD_KT, &ide2_thdlr, 0);
 
   // Per-CPU setup
   trap_init_percpu();
@@ -134,6 +146,16 @@ trap_init_percpu(void) {
 
   // Load the IDT
   lidt(&idt_pd);
+
+#ifndef CONFIG_KSPACE
+  // Enter syscall_entry on the syscall instruction, with the kernel
+  // segments and interrupts off, and leave with sysretq to GD_UT/GD_UD.
+  extern void syscall_entry(void);
+  wrmsr(STAR_MSR, ((uint64_t)(GD_USYSRET | 3) << 48) | ((uint64_t)GD_KT << 32));
+  wrmsr(LSTAR_MSR, (uintptr_t)syscall_entry);
+  wrmsr(SFMASK_MSR, FL_IF | FL_DF | FL_TF | FL_AC);
+  wrmsr(EFER_MSR, rdmsr(EFER_MSR) | (1 << EFER_SCE));
+#endif
 }
 
 void
@@ -196,10 +218,63 @@ print_regs(struct PushRegs *regs) {
   cprintf("  rax  0x%08lx\n", (unsigned long)regs->reg_rax);
 }
 
+// The env that takes each hardware IRQ, set by sys_irq_listen, and the
+// I/O port that stops the device's DMA once the env is gone (0 if none).
+struct Env *irq_env[MAX_IRQS];
+uint16_t irq_stop_port[MAX_IRQS];
+
+// Note that 'irq' arrived for the env listening to it, and make the
+// env runnable if it is blocked in sys_irq_wait for it.  The IRQ stays
+// masked until the env waits for it again, since a level-triggered
+// PCI line stays asserted until the env has served its device.
+static void
+irq_notify(uint8_t irq) {
+  struct Env *e = irq_env[irq];
+
+  irq_set_masked(irq, 1);
+  e->env_irq_pending |= 1 << irq;
+  if (e->env_irq_wait & e->env_irq_pending) {
+    e->env_tf.tf_regs.reg_rax = 0;
+    e->env_irq_pending &= ~e->env_irq_wait;
+    e->env_irq_wait = 0;
+    e->env_status   = ENV_RUNNABLE;
+    runq_insert(e);
+  }
+}
+
+// Is some env blocked in sys_irq_wait?
+bool
+irq_waiting(void) {
+  int i;
+
+  for (i = 0; i < MAX_IRQS; i++)
+    if (irq_env[i] && irq_env[i]->env_irq_wait)
+      return 1;
+  return 0;
+}
+
+// Stop delivering the IRQs e listens to, and mask them again.  Their
+// devices are stopped too, since a transfer e started may still be
+// writing into e's pages.
+void
+irq_release(struct Env *e) {
+  int i;
+
+  for (i = 0; i < MAX_IRQS; i++)
+    if (irq_env[i] == e) {
+      if (irq_stop_port[i])
+        outb(irq_stop_port[i], 0);
+      irq_env[i]       = NULL;
+      irq_stop_port[i] = 0;
+      irq_set_masked(i, 1);
+    }
+  e->env_irq_pending = e->env_irq_wait = 0;
+}
+
 static void
 trap_dispatch(struct Trapframe *tf) {
 
-  int64_t syscallno, a1, a2, a3, a4, a5, ret;
+  int64_t syscallno, a1, a2, a3, a4, a5, a6, ret;
   if (tf->tf_trapno == T_SYSCALL) {
     syscallno           = tf->tf_regs.reg_rax;
     a1                  = tf->tf_regs.reg_rdx;
@@ -207,7 +282,8 @@ trap_dispatch(struct Trapframe *tf) {
     a3                  = tf->tf_regs.reg_rbx;
     a4                  = tf->tf_regs.reg_rdi;
     a5                  = tf->tf_regs.reg_rsi;
-    ret                 = syscall(syscallno, a1, a2, a3, a4, a5);
+    a6                  = tf->tf_regs.reg_r8;
+    ret                 = syscall(syscallno, a1, a2, a3, a4, a5, a6);
     tf->tf_regs.reg_rax = ret;
     return;
   }
@@ -239,6 +315,7 @@ trap_dispatch(struct Trapframe *tf) {
     // Update vsys memory with current time.
     // LAB 12: Your code here.
     vsys[VSYS_gettime] = gettime();
+    env_ipc_check_timeouts(vsys[VSYS_gettime]);
 
     pic_send_eoi(IRQ_CLOCK);
     timer_for_schedule->handle_interrupts();
@@ -263,6 +340,15 @@ trap_dispatch(struct Trapframe *tf) {
     return;
   }
 
+  // Interrupts of devices that user environments drive.
+  if (tf->tf_trapno >= IRQ_OFFSET && tf->tf_trapno < IRQ_OFFSET + MAX_IRQS &&
+      irq_env[tf->tf_trapno - IRQ_OFFSET]) {
+    irq_notify(tf->tf_trapno - IRQ_OFFSET);
+    pic_send_eoi(tf->tf_trapno - IRQ_OFFSET);
+    sched_yield();
+    return;
+  }
+
   print_trapframe(tf);
   if (!(tf->tf_cs & 0x3)) 
   {
@@ -274,6 +360,65 @@ trap_dispatch(struct Trapframe *tf) {
   }
 }
 
+#ifndef CONFIG_KSPACE
+//
+// C half of syscall_entry in trapentry.S.  'tf' is on the kernel stack
+// and holds only what syscall_entry saved, which is copied into
+// curenv->env_tf in case the env does not return right away.
+// Returns the syscall's result if the env goes on running, which
+// syscall_entry hands back with sysretq; otherwise does not return.
+//
+uintptr_t
+syscall_fast(struct Trapframe *tf) {
+  struct Env *e = curenv;
+  struct PushRegs *regs;
+  uintptr_t syscallno = tf->tf_regs.reg_rax, ret;
+
+  extern char *panicstr;
+  if (panicstr)
+    asm volatile("hlt");
+
+  assert(e);
+  if (e->env_status == ENV_DYING) {
+    env_free(e);
+    curenv = NULL;
+    sched_yield();
+  }
+
+  regs                 = &e->env_tf.tf_regs;
+  regs->reg_rbx        = tf->tf_regs.reg_rbx;
+  regs->reg_rbp        = tf->tf_regs.reg_rbp;
+  regs->reg_r12        = tf->tf_regs.reg_r12;
+  regs->reg_r13        = tf->tf_regs.reg_r13;
+  regs->reg_r14        = tf->tf_regs.reg_r14;
+  regs->reg_r15        = tf->tf_regs.reg_r15;
+  e->env_tf.tf_trapno  = T_SYSCALL;
+  e->env_tf.tf_err     = 0;
+  e->env_tf.tf_rip     = tf->tf_rip;
+  e->env_tf.tf_cs      = tf->tf_cs;
+  e->env_tf.tf_rflags  = tf->tf_rflags;
+  e->env_tf.tf_rsp     = tf->tf_rsp;
+  e->env_tf.tf_ss      = tf->tf_ss;
+  last_tf              = &e->env_tf;
+
+  ret = syscall(syscallno, tf->tf_regs.reg_rdx, tf->tf_regs.reg_r10,
+                tf->tf_regs.reg_rbx, tf->tf_regs.reg_rdi, tf->tf_regs.reg_rsi,
+                tf->tf_regs.reg_r8);
+
+  // sysretq resumes from the saved frame, so a new trap frame for
+  // ourselves has to go the long way.
+  if (curenv == e && e->env_status == ENV_RUNNING &&
+      syscallno != SYS_env_set_trapframe)
+    return ret;
+
+  e->env_tf.tf_regs.reg_rax = ret;
+  if (curenv && curenv->env_status == ENV_RUNNING)
+    env_run(curenv);
+  else
+    sched_yield();
+}
+#endif
+
 void
 trap(struct Trapframe *tf) {
   // The environment may have set DF and some versions
@@ -295,7 +440,12 @@ trap(struct Trapframe *tf) {
     cprintf("Incoming TRAP frame at %p\n", tf);
   }
 
-  assert(curenv);
+  // An interrupt that ends the hlt in sched_halt has no env to go
+  // back to.
+  if (!curenv) {
+    trap_dispatch(tf);
+    sched_yield();
+  }
 
   // Garbage collect if current enviroment is a zombie
   if (curenv->env_status == ENV_DYING) {
@@ -346,6 +496,15 @@ page_fault_handler(struct Trapframe *tf) {
   // We've already handled kernel-mode exceptions, so if we get here,
   // the page fault happened in user mode.
 
+  // Copy-on-write faults are resolved right here, without a round trip
+  // through the user page fault upcall.  Everything else, including
+  // COW faults we have no memory for, goes to the upcall as before.
+  if ((tf->tf_err & (FEC_PR | FEC_WR)) == (FEC_PR | FEC_WR)) {
+    if (!page_cow_fault(curenv->env_pml4e, (void *)fault_va))
+      return;
+    cow_stats.forwarded++;
+  }
+
   // Call the environment's page fault upcall, if one exists.  Set up a
   // page fault stack frame on the user exception stack (below
   // UXSTACKTOP), then branch to curenv->env_pgfault_upcall.
@@ -19,6 +19,18 @@ void trap_init_percpu(void);
 void print_regs(struct PushRegs *regs);
 void print_trapframe(struct Trapframe *tf);
 void page_fault_handler(struct Trapframe *);
+uintptr_t syscall_fast(struct Trapframe *tf);
 void backtrace(struct Trapframe *);
 
+/* IRQs that user environments may take with sys_irq_listen: the
+ * IDE channels and the lines the firmware gives PCI devices. */
+#define IRQ_USER_MASK ((1 << 5) | (1 << 9) | (1 << 10) | (1 << 11) | \
+                       (1 << IRQ_IDE) | (1 << IRQ_IDE2))
+
+/* Envs that take hardware interrupts, see sys_irq_listen */
+extern struct Env *irq_env[];
+extern uint16_t irq_stop_port[];
+bool irq_waiting(void);
+void irq_release(struct Env *e);
+
 #endif /* JOS_KERN_TRAP_H */
@@ -3,6 +3,7 @@
 
 void
 exit(void) {
+  munmap_all();
   close_all();
   sys_env_destroy(0);
 }
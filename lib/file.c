@@ -21,8 +21,30 @@ fsipc(unsigned type, void *dstva) {
   if (debug)
     cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
 
-  ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-  return ipc_recv(NULL, dstva, NULL);
+  return ipc_call(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U, NULL, dstva, NULL);
+}
+
+// Like fsipc, but for requests that fit in IPC message words: send the
+// 'len' bytes of 'req' as words instead of fsipcbuf, so that no page
+// has to be mapped into the file server.  'pg' is a run of pages for
+// the server to work on, sent with 'perm', or NULL.  'dstva' is as for
+// fsipc.
+static int
+fsipc_msg(unsigned type, const void *req, size_t len, void *pg, int perm, void *dstva) {
+  static envid_t fsenv;
+  struct IpcMsg msg;
+
+  if (fsenv == 0)
+    fsenv = ipc_find_env(ENV_TYPE_FS);
+
+  assert(len <= sizeof(msg.im_words));
+  msg.im_nwords = ROUNDUP(len, sizeof(uint64_t)) / sizeof(uint64_t);
+  memcpy(msg.im_words, req, len);
+
+  if (debug)
+    cprintf("[%08x] fsipc_msg %d\n", thisenv->env_id, type);
+
+  return ipc_call(fsenv, type, pg, perm, &msg, dstva, NULL);
 }
 
 static int devfile_flush(struct Fd *fd);
@@ -93,8 +115,61 @@ open(const char *path, int mode) {
 // to disk.
 static int
 devfile_flush(struct Fd *fd) {
-  fsipcbuf.flush.req_fileid = fd->fd_file.id;
-  return fsipc(FSREQ_FLUSH, NULL);
+  struct Fsreq_flush req = {.req_fileid = fd->fd_file.id};
+
+  return fsipc_msg(FSREQ_FLUSH, &req, sizeof(req), NULL, 0, NULL);
+}
+
+// Reads larger than a page have the server fill a run of up to
+// IPC_MAX_PAGES pages here, in one round trip.
+#define FSREADBUF ((char *)0xCF000000)
+
+// Read at most 'n' bytes from 'fd', more than a page, through FSREADBUF.
+static ssize_t
+devfile_read_pages(struct Fd *fd, void *buf, size_t n) {
+  // The pages are copy-on-write in parent and child after a fork, and
+  // the server can't write into them then, so those are replaced.
+  static size_t rbuf_npages;
+  struct Fsreq_read req = {.req_fileid = fd->fd_file.id};
+  size_t npages = MIN(ROUNDUP(n, PGSIZE) / PGSIZE, IPC_MAX_PAGES), i;
+  int r;
+
+  for (i = 0; i < npages; i++)
+    if (i >= rbuf_npages || !(uvpt[PGNUM(FSREADBUF + i * PGSIZE)] & PTE_W))
+      if ((r = sys_page_alloc(0, FSREADBUF + i * PGSIZE, PTE_P | PTE_W | PTE_U)) < 0)
+        return r;
+  rbuf_npages = MAX(rbuf_npages, npages);
+
+  req.req_n = MIN(n, npages * PGSIZE);
+  if ((r = fsipc_msg(FSREQ_READ, &req, sizeof(req), IPC_PAGES(FSREADBUF, npages),
+                       PTE_P | PTE_W | PTE_U, NULL)) < 0)
+    return r;
+  assert(r <= req.req_n);
+  memmove(buf, FSREADBUF, r);
+  return r;
+}
+
+// FSREQ_READ_MAP replies map the file's pages here.
+#define FSMAPBUF ((char *)0xCE000000)
+
+// Read at most 'n' bytes from 'fd', at a page-aligned position, by
+// having the server map the block-cache pages at FSMAPBUF, so that the
+// bytes are copied only once, into 'buf'.
+// Returns -E_NOT_SUPP if the server can't map them.
+static ssize_t
+devfile_read_map(struct Fd *fd, void *buf, size_t n) {
+  struct Fsreq_read req = {.req_fileid = fd->fd_file.id};
+  size_t npages = MIN(ROUNDUP(n, PGSIZE) / PGSIZE, IPC_MAX_PAGES);
+  int r;
+
+  req.req_n = MIN(n, npages * PGSIZE);
+  if ((r = fsipc_msg(FSREQ_READ_MAP, &req, sizeof(req), NULL, 0,
+                       IPC_PAGES(FSMAPBUF, npages))) <= 0)
+    return r;
+  assert(r <= req.req_n);
+  assert(thisenv->env_ipc_npages == ROUNDUP(r, PGSIZE) / PGSIZE);
+  memmove(buf, FSMAPBUF, r);
+  return r;
 }
 
 // Read at most 'n' bytes from 'fd' at the current position into 'buf'.
@@ -110,6 +185,12 @@ devfile_read(struct Fd *fd, void *buf, size_t n) {
   // system server.
   // LAB 10: Your code here
   int r;
+
+  if (n >= PGSIZE && !(fd->fd_offset % PGSIZE) &&
+      (r = devfile_read_map(fd, buf, n)) != -E_NOT_SUPP)
+    return r;
+  if (n > PGSIZE)
+    return devfile_read_pages(fd, buf, n);
 	fsipcbuf.read.req_fileid = fd->fd_file.id;
 	fsipcbuf.read.req_n = n;
 	if ((r = fsipc(FSREQ_READ, NULL)) < 0) {
@@ -121,6 +202,23 @@ devfile_read(struct Fd *fd, void *buf, size_t n) {
 	return r;
 }
 
+// Write the whole pages of up to 'n' bytes from 'buf', which must be
+// page-aligned, to 'fd' at a page-aligned seek position, by donating
+// them to the server copy-on-write instead of copying them.  Writing
+// to them again afterwards copies them, then.
+// Returns -E_NOT_SUPP if the server can't take them, or -E_INVAL if the
+// kernel won't, because they are not writable or are mapped elsewhere
+// too, such as mmap()ed pages.
+static ssize_t
+devfile_write_map(struct Fd *fd, const void *buf, size_t n) {
+  struct Fsreq_write_map req = {.req_fileid = fd->fd_file.id};
+  size_t npages = MIN(n / PGSIZE, IPC_MAX_PAGES);
+
+  req.req_n = npages * PGSIZE;
+  return fsipc_msg(FSREQ_WRITE_MAP, &req, sizeof(req), IPC_PAGES(buf, npages),
+                   PTE_P | PTE_U | PTE_COW, NULL);
+}
+
 // Write at most 'n' bytes from 'buf' to 'fd' at the current seek position.
 //
 // Returns:
@@ -133,10 +231,26 @@ devfile_write(struct Fd *fd, const void *buf, size_t n) {
   // remember that write is always allowed to write *fewer*
   // bytes than requested.
   // LAB 10: Your code here
-  fsipcbuf.write.req_fileid = fd->fd_file.id;
-	fsipcbuf.write.req_n = n;
-	memmove(fsipcbuf.write.req_buf, buf, n);
-	return fsipc(FSREQ_WRITE, NULL);
+  // Whole pages are donated; the rest, and anything the server or the
+  // kernel won't take that way, is copied through fsipcbuf.
+  size_t done = 0;
+  ssize_t r;
+
+  while (done < n) {
+    r = -E_NOT_SUPP;
+    if (n - done >= PGSIZE && !(fd->fd_offset % PGSIZE) && !((uintptr_t)(buf + done) % PGSIZE))
+      r = devfile_write_map(fd, buf + done, n - done);
+    if (r == -E_NOT_SUPP || r == -E_INVAL) {
+      fsipcbuf.write.req_fileid = fd->fd_file.id;
+      fsipcbuf.write.req_n      = MIN(n - done, sizeof(fsipcbuf.write.req_buf));
+      memmove(fsipcbuf.write.req_buf, buf + done, fsipcbuf.write.req_n);
+      r = fsipc(FSREQ_WRITE, NULL);
+    }
+    if (r <= 0)
+      return done ? done : r;
+    done += r;
+  }
+  return done;
 }
 
 static int
@@ -155,16 +269,255 @@ devfile_stat(struct Fd *fd, struct Stat *st) {
 // Truncate or extend an open file to 'size' bytes
 static int
 devfile_trunc(struct Fd *fd, off_t newsize) {
-  fsipcbuf.set_size.req_fileid = fd->fd_file.id;
-  fsipcbuf.set_size.req_size   = newsize;
-  return fsipc(FSREQ_SET_SIZE, NULL);
+  struct Fsreq_set_size req = {.req_fileid = fd->fd_file.id, .req_size = newsize};
+
+  return fsipc_msg(FSREQ_SET_SIZE, &req, sizeof(req), NULL, 0, NULL);
+}
+
+// Get the file server's block-cache counters.
+int
+bcstat(struct BcStat *st) {
+  int r;
+
+  if ((r = fsipc(FSREQ_BCSTAT, NULL)) < 0)
+    return r;
+  *st = fsipcbuf.bcstatRet;
+  return 0;
+}
+
+// mmap()ed ranges of files get their addresses from here up to
+// FSMAPBUF.  Each holds a reference to its file's Fd page at MMAPFD,
+// so that the file stays open on the server after close().
+#define NMMAP     16
+#define MMAPBASE  ((char *)0xC0000000)
+#define MMAPTOP   FSMAPBUF
+#define MMAPFD(i) ((struct Fd *)(MMAPBASE - (NMMAP - (i)) * PGSIZE))
+
+// Pages populated by one fault, if they are not there yet.
+#define MMAP_CLUSTER 16
+
+struct Mmap {
+  char *mm_va;   // NULL if the slot is free
+  size_t mm_len; // a multiple of PGSIZE
+  off_t mm_off;  // file offset of mm_va
+  int mm_prot;
+  int mm_flags;
+};
+
+static struct Mmap mmaps[NMMAP];
+
+static bool
+mmap_page_mapped(const void *va) {
+  return (uvpml4e[VPML4E(va)] & PTE_P) && (uvpde[VPDPE(va)] & PTE_P) &&
+         (uvpd[VPD(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P);
+}
+
+static struct Mmap *
+mmap_lookup(const char *va) {
+  int i;
+
+  for (i = 0; i < NMMAP; i++)
+    if (mmaps[i].mm_va && va >= mmaps[i].mm_va && va < mmaps[i].mm_va + mmaps[i].mm_len)
+      return &mmaps[i];
+  return NULL;
+}
+
+// Populate the page of a not-present fault in an mmap()ed range, and
+// up to MMAP_CLUSTER - 1 missing pages after it, from the file server.
+// Returns 1 if the fault was ours and is fixed, 0 otherwise.
+static int
+mmap_pgfault(struct UTrapframe *utf) {
+  char *va = ROUNDDOWN((char *)utf->utf_fault_va, PGSIZE);
+  struct Mmap *m;
+  struct Fsreq_map req = {0};
+  size_t i, npages;
+  int r;
+
+  if ((utf->utf_err & FEC_PR) || !(m = mmap_lookup(va)))
+    return 0;
+
+  for (npages = 1; npages < MMAP_CLUSTER && va + npages * PGSIZE < m->mm_va + m->mm_len &&
+                   !mmap_page_mapped(va + npages * PGSIZE);
+       npages++)
+    ;
+
+  req.req_fileid = MMAPFD(m - mmaps)->fd_file.id;
+  req.req_offset = m->mm_off + (va - m->mm_va);
+  req.req_n      = npages * PGSIZE;
+  req.req_write  = (m->mm_flags & MAP_SHARED) && (m->mm_prot & PROT_WRITE);
+  if ((r = fsipc_msg(FSREQ_MAP, &req, sizeof(req), NULL, 0, IPC_PAGES(va, npages))) <= 0)
+    return 0;
+
+  // Private writable pages are copied on the first write to them.
+  if ((m->mm_flags & MAP_PRIVATE) && (m->mm_prot & PROT_WRITE))
+    for (i = 0; i < thisenv->env_ipc_npages; i++)
+      if ((r = sys_page_map(0, va + i * PGSIZE, 0, va + i * PGSIZE, PTE_P | PTE_U | PTE_COW)) < 0)
+        panic("mmap_pgfault: sys_page_map: %i", r);
+  return 1;
+}
+
+// Map 'len' bytes of file 'fdnum' from 'off', which must be page-aligned,
+// into memory.  'prot' is PROT_READ, optionally with PROT_WRITE.  With
+// MAP_SHARED in 'flags' the pages are the file server's block-cache
+// pages, so writes go to the file; msync(), munmap(), sync() and exit()
+// hand the written ones to the server, which writes them back to disk
+// like its own.  With MAP_PRIVATE
+// writes make private copies.  Pages are filled
+// in on first access; touching one past the end of the file faults.
+//
+// Returns the address of the mapping, or NULL on error.
+void *
+mmap(int fdnum, off_t off, size_t len, int prot, int flags) {
+  static bool hooked;
+  struct Fd *fd;
+  char *va;
+  int i, j, r;
+
+  if (!len || off < 0 || off % PGSIZE || !(prot & PROT_READ) ||
+      (flags & (MAP_SHARED | MAP_PRIVATE)) == 0 ||
+      (flags & (MAP_SHARED | MAP_PRIVATE)) == (MAP_SHARED | MAP_PRIVATE))
+    return NULL;
+  if (fd_lookup(fdnum, &fd) < 0 || fd->fd_dev_id != devfile.dev_id)
+    return NULL;
+  if ((flags & MAP_SHARED) && (prot & PROT_WRITE) && (fd->fd_omode & O_ACCMODE) == O_RDONLY)
+    return NULL;
+  len = ROUNDUP(len, PGSIZE);
+
+  for (i = 0; i < NMMAP && mmaps[i].mm_va; i++)
+    ;
+  if (i == NMMAP)
+    return NULL;
+
+  // First fit.
+  for (va = MMAPBASE; va + len <= MMAPTOP;) {
+    for (j = 0; j < NMMAP; j++)
+      if (mmaps[j].mm_va && va < mmaps[j].mm_va + mmaps[j].mm_len && mmaps[j].mm_va < va + len)
+        break;
+    if (j == NMMAP)
+      break;
+    va = mmaps[j].mm_va + mmaps[j].mm_len;
+  }
+  if (va + len > MMAPTOP)
+    return NULL;
+
+  if ((r = sys_page_map(0, fd, 0, MMAPFD(i), PTE_P | PTE_U)) < 0)
+    return NULL;
+  if (!hooked) {
+    set_pgfault_mmap(mmap_pgfault);
+    hooked = 1;
+  }
+  mmaps[i] = (struct Mmap){va, len, off, prot, flags};
+  return va;
+}
+
+// Write the pages of the shared writable mapping 'm' in [va, end) that
+// were written to since the last time to disk.
+static int
+mmap_sync(struct Mmap *m, char *va, char *end) {
+  struct Fsreq_msync req = {.req_fileid = MMAPFD(m - mmaps)->fd_file.id};
+  char *run;
+  int r;
+
+  if (!(m->mm_flags & MAP_SHARED) || !(m->mm_prot & PROT_WRITE))
+    return 0;
+  while (va < end) {
+    for (; va < end && !(mmap_page_mapped(va) && (uvpt[PGNUM(va)] & PTE_D)); va += PGSIZE)
+      ;
+    // Clear the dirty bits before the server writes the pages, so that
+    // no write after it is lost.
+    for (run = va; va < end && mmap_page_mapped(va) && (uvpt[PGNUM(va)] & PTE_D); va += PGSIZE)
+      if ((r = sys_page_map(0, va, 0, va, uvpt[PGNUM(va)] & PTE_SYSCALL)) < 0)
+        return r;
+    if (run == va)
+      break;
+    req.req_offset = m->mm_off + (run - m->mm_va);
+    req.req_n      = va - run;
+    if ((r = fsipc_msg(FSREQ_MSYNC, &req, sizeof(req), NULL, 0, NULL)) < 0)
+      return r;
+  }
+  return 0;
+}
+
+// Write the pages of shared writable mappings in [addr, addr + len)
+// that were written to since the last msync() to disk.
+// Returns 0 on success, < 0 on error.
+int
+msync(void *addr, size_t len) {
+  char *va = ROUNDDOWN((char *)addr, PGSIZE), *end = (char *)addr + len;
+  int i, r;
+
+  for (i = 0; i < NMMAP; i++) {
+    struct Mmap *m = &mmaps[i];
+
+    if (!m->mm_va || end <= m->mm_va || va >= m->mm_va + m->mm_len)
+      continue;
+    if ((r = mmap_sync(m, MAX(va, m->mm_va), MIN(end, m->mm_va + m->mm_len))) < 0)
+      return r;
+  }
+  return 0;
+}
+
+// Unmap [addr, addr + len), which may cover parts of mappings, after
+// writing what was written through them to disk as msync() does.
+// Returns 0 on success, < 0 on error.
+int
+munmap(void *addr, size_t len) {
+  char *va = ROUNDDOWN((char *)addr, PGSIZE), *end = ROUNDUP((char *)addr + len, PGSIZE);
+  char *lo, *hi, *p;
+  int i, j, r;
+
+  if ((r = msync(va, end - va)) < 0)
+    return r;
+
+  for (i = 0; i < NMMAP; i++) {
+    struct Mmap *m = &mmaps[i];
+
+    if (!m->mm_va || end <= m->mm_va || va >= m->mm_va + m->mm_len)
+      continue;
+    lo = MAX(va, m->mm_va);
+    hi = MIN(end, m->mm_va + m->mm_len);
+    for (p = lo; p < hi; p += PGSIZE)
+      if (mmap_page_mapped(p))
+        sys_page_unmap(0, p);
+
+    if (lo > m->mm_va && hi < m->mm_va + m->mm_len) {
+      // A hole in the middle: the part above it needs a slot of its own.
+      for (j = 0; j < NMMAP && mmaps[j].mm_va; j++)
+        ;
+      if (j == NMMAP || (r = sys_page_map(0, MMAPFD(i), 0, MMAPFD(j), PTE_P | PTE_U)) < 0)
+        return j == NMMAP ? -E_NO_MEM : r;
+      mmaps[j] = (struct Mmap){hi, m->mm_va + m->mm_len - hi, m->mm_off + (hi - m->mm_va),
+                               m->mm_prot, m->mm_flags};
+      m->mm_len = lo - m->mm_va;
+    } else if (lo > m->mm_va) {
+      m->mm_len = lo - m->mm_va;
+    } else if (hi < m->mm_va + m->mm_len) {
+      m->mm_off += hi - m->mm_va;
+      m->mm_len -= hi - m->mm_va;
+      m->mm_va = hi;
+    } else {
+      m->mm_va = NULL;
+      sys_page_unmap(0, MMAPFD(i));
+    }
+  }
+  return 0;
+}
+
+// Unmap all mmap()ed ranges, as exit() does.
+void
+munmap_all(void) {
+  munmap(MMAPBASE, MMAPTOP - MMAPBASE);
 }
 
 // Synchronize disk with buffer cache
 int
 sync(void) {
+  int r;
+
+  // Hand what we wrote through shared mappings to the server first.
+  if ((r = msync(MMAPBASE, MMAPTOP - MMAPBASE)) < 0)
+    return r;
   // Ask the file server to update the disk
   // by writing any dirty blocks in the buffer cache.
-
-  return fsipc(FSREQ_SYNC, NULL);
+  return fsipc_msg(FSREQ_SYNC, NULL, 0, NULL, 0, NULL);
 }
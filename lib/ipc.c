@@ -13,6 +13,7 @@
 // If the system call fails, then store 0 in *fromenv and *perm (if
 //	they're nonnull) and return the error.
 // Otherwise, return the value sent by the sender
+// Message words sent along with the value are in thisenv->env_ipc_msg.
 //
 // Hint:
 //   Use 'thisenv' to discover the value and who sent it.
@@ -42,19 +43,18 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store) {
 			*perm_store = thisenv->env_ipc_perm;
 		}
 #ifdef SANITIZE_USER_SHADOW_BASE
-	  platform_asan_unpoison(pg, PGSIZE);
+	  platform_asan_unpoison(IPC_PAGES_VA(pg), thisenv->env_ipc_npages * PGSIZE);
 #endif
 		return thisenv->env_ipc_value;
 	}
 }
 
 // Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
-// This function keeps trying until it succeeds.
-// It should panic() on any error other than -E_IPC_NOT_RECV.
+// The kernel blocks us until 'toenv' receives it.
+// It should panic() on any error.
 //
 // Hint:
-//   Use sys_yield() to be CPU-friendly.
-//   If 'pg' is null, pass sys_ipc_recv a value that it will understand
+//   If 'pg' is null, pass sys_ipc_send a value that it will understand
 //   as meaning "no page".  (Zero is not the right value.)
 void
 ipc_send(envid_t to_env, uint32_t val, void *pg, int perm) {
@@ -64,13 +64,96 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm) {
   if (pg == NULL) {
     pg = (void *) UTOP;
   }
-  while ((r = sys_ipc_try_send(to_env, val, pg, perm))) {
-	if (r < 0 && r != -E_IPC_NOT_RECV) {
-		panic("ipc_send error: sys_ipc_try_send: %i\n", r);
-	}
-	sys_yield();
+  if ((r = sys_ipc_send(to_env, val, pg, perm, NULL)) < 0) {
+    panic("ipc_send error: sys_ipc_send: %i\n", r);
+  }
+}
+
+// Send 'val' and the message words in 'msg' to 'to_env', without a page.
+// The receiver finds the words in thisenv->env_ipc_msg.
+// It panics on any error, like ipc_send.
+void
+ipc_send_msg(envid_t to_env, uint32_t val, const struct IpcMsg *msg) {
+  int r;
+
+  if ((r = sys_ipc_send(to_env, val, (void *)UTOP, 0, msg)) < 0)
+    panic("ipc_send_msg error: sys_ipc_send: %i\n", r);
+}
+
+// Send 'val' and the 'npages' pages at 'pg' with 'perm' to 'to_env',
+// in one IPC.  'npages' is at most IPC_MAX_PAGES.
+// It panics on any error, like ipc_send.
+void
+ipc_send_pages(envid_t to_env, uint32_t val, void *pg, size_t npages, int perm) {
+  assert(npages > 0 && npages <= IPC_MAX_PAGES);
+  ipc_send(to_env, val, IPC_PAGES(pg, npages), perm);
+}
+
+// Receive like ipc_recv, but take up to 'npages' pages, which are mapped
+// from 'pg' on.  If 'npages_store' is nonnull, the number of pages
+// received is stored in *npages_store.
+int32_t
+ipc_recv_pages(envid_t *from_env_store, void *pg, size_t npages,
+               int *perm_store, size_t *npages_store) {
+  int32_t r;
+
+  assert(npages > 0 && npages <= IPC_MAX_PAGES);
+  r = ipc_recv(from_env_store, IPC_PAGES(pg, npages), perm_store);
+  if (npages_store)
+    *npages_store = r < 0 ? 0 : thisenv->env_ipc_npages;
+  return r;
+}
+
+// Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull, and the words
+// in 'msg', if 'msg' is nonnull) to 'to_env' and wait for its reply,
+// which is received like ipc_recv at 'rcv_pg'.
+// Only 'to_env' can reply; other senders keep waiting meanwhile.
+// Returns the reply value, or < 0 on error (then *perm_store is 0).
+int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, int perm,
+         const struct IpcMsg *msg, void *rcv_pg, int *perm_store) {
+  int r;
+
+  if ((r = sys_ipc_call(to_env, val, pg ? pg : (void *)UTOP, perm, msg,
+                        rcv_pg ? rcv_pg : (void *)UTOP)) < 0) {
+    if (perm_store)
+      *perm_store = 0;
+    return r;
   }
-  sys_yield();
+  if (perm_store)
+    *perm_store = thisenv->env_ipc_perm;
+#ifdef SANITIZE_USER_SHADOW_BASE
+  if (rcv_pg)
+    platform_asan_unpoison(IPC_PAGES_VA(rcv_pg), thisenv->env_ipc_npages * PGSIZE);
+#endif
+  return thisenv->env_ipc_value;
+}
+
+// Reply 'val' (and 'pg' and 'msg', as for ipc_call) to 'to_env',
+// which is waiting in ipc_call, and receive the next request like
+// ipc_recv.  A 'to_env' of 0 sends no reply.
+int32_t
+ipc_reply_wait(envid_t to_env, uint32_t val, void *pg, int perm, const struct IpcMsg *msg,
+               envid_t *from_env_store, void *rcv_pg, int *perm_store) {
+  int r;
+
+  if ((r = sys_ipc_reply_wait(to_env, val, pg ? pg : (void *)UTOP, perm, msg,
+                              rcv_pg ? rcv_pg : (void *)UTOP)) < 0) {
+    if (from_env_store)
+      *from_env_store = 0;
+    if (perm_store)
+      *perm_store = 0;
+    return r;
+  }
+  if (from_env_store)
+    *from_env_store = thisenv->env_ipc_from;
+  if (perm_store)
+    *perm_store = thisenv->env_ipc_perm;
+#ifdef SANITIZE_USER_SHADOW_BASE
+  if (rcv_pg)
+    platform_asan_unpoison(IPC_PAGES_VA(rcv_pg), thisenv->env_ipc_npages * PGSIZE);
+#endif
+  return thisenv->env_ipc_value;
 }
 
 // Find the first environment of the given type.  We'll use this to
@@ -12,6 +12,42 @@ extern void _pgfault_upcall(void);
 // Pointer to currently installed C-language pgfault handler.
 void (*_pgfault_handler)(struct UTrapframe *utf);
 
+// Populates mmap()ed file pages, see lib/file.c.  It gets every fault
+// before _pgfault_handler, so that fork and programs that install their
+// own handler don't have to know about it, and returns 1 if it took care
+// of the fault.
+static int (*_pgfault_mmap)(struct UTrapframe *utf);
+
+// Called by _pgfault_upcall.
+void
+_pgfault_dispatch(struct UTrapframe *utf) {
+  if (_pgfault_mmap && _pgfault_mmap(utf))
+    return;
+  if (!_pgfault_handler)
+    panic("unhandled page fault at va %lx, err %lx",
+          (unsigned long)utf->utf_fault_va, (unsigned long)utf->utf_err);
+  _pgfault_handler(utf);
+}
+
+// Allocate the exception stack and register _pgfault_upcall with the
+// kernel, the first time a handler is set.
+static void
+pgfault_upcall_init(void) {
+  envid_t envid;
+  int error;
+
+  envid = sys_getenvid();
+  if (_pgfault_handler == 0 && _pgfault_mmap == 0) {
+    // First time through!
+    // LAB 9: Your code here.
+    sys_page_alloc(envid, (void *) UXSTACKTOP - PGSIZE, PTE_W);
+  }
+
+  error = sys_env_set_pgfault_upcall(envid, _pgfault_upcall);
+  if (error < 0)
+    panic("set_pgfault_handler: %i", error);
+}
+
 //
 // Set the page fault handler function.
 // If there isn't one yet, _pgfault_handler will be 0.
@@ -22,20 +58,17 @@ void (*_pgfault_handler)(struct UTrapframe *utf);
 //
 void
 set_pgfault_handler(void (*handler)(struct UTrapframe *utf)) {
-  envid_t envid;
-
-  int error;
-
-  envid = sys_getenvid();
-  if (_pgfault_handler == 0) {
-    // First time through!
-    // LAB 9: Your code here.
-    sys_page_alloc(envid, (void *) UXSTACKTOP - PGSIZE, PTE_W);
-  }
+  pgfault_upcall_init();
 
   // Save handler pointer for assembly to call.
   _pgfault_handler = handler;
-  error            = sys_env_set_pgfault_upcall(envid, _pgfault_upcall);
-  if (error < 0)
-    panic("set_pgfault_handler: %i", error);
+}
+
+//
+// Set the hook that resolves faults in mmap()ed ranges.
+//
+void
+set_pgfault_mmap(int (*hook)(struct UTrapframe *utf)) {
+  pgfault_upcall_init();
+  _pgfault_mmap = hook;
 }
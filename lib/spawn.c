@@ -335,6 +335,15 @@ copy_shared_pages(envid_t child) {
     if (!(uvpml4e[VPML4E(i)] & PTE_P) || !(uvpde[VPDPE(i)] & PTE_P) || !(uvpd[VPD(i)] & PTE_P)) {
       continue;
     }
+    if (uvpd[VPD(i)] & PTE_PS) {
+      if (uvpd[VPD(i)] & PTE_SHARE) {
+        err = sys_page_map(0, (void *)i, child, (void *)i, uvpd[VPD(i)] & PTE_SYSCALL);
+        if (err < 0)
+          break;
+      }
+      i += PTSIZE - PGSIZE;
+      continue;
+    }
     if ((uvpt[VPN(i)] & (PTE_P | PTE_SHARE)) == (PTE_P | PTE_SHARE)) {
       err = sys_page_map(0, (void *)i, child, (void *)i, uvpt[VPN(i)] & PTE_SYSCALL);
       if (err < 0)
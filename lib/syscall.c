@@ -4,12 +4,17 @@
 #include <inc/lib.h>
 
 static inline int64_t
-syscall(int64_t num, int64_t check, int64_t a1, int64_t a2, int64_t a3, int64_t a4, int64_t a5) {
+syscall(int64_t num, int64_t check, int64_t a1, int64_t a2, int64_t a3, int64_t a4, int64_t a5, int64_t a6) {
   int64_t ret;
 
+  register int64_t r10 asm("r10") = a2;
+  register int64_t r8 asm("r8")   = a6;
+
   // Generic system call: pass system call number in AX,
-  // up to five parameters in DX, CX, BX, DI, SI.
-  // Interrupt kernel with T_SYSCALL.
+  // up to six parameters in DX, R10, BX, DI, SI, R8.
+  // Enter the kernel with the syscall instruction, which uses CX and
+  // R11 for the return address and flags.  The kernel preserves BX,
+  // BP and R12-R15 only, so the argument registers are outputs too.
   //
   // The "volatile" tells the assembler not to optimize
   // this instruction away just because we don't use the
@@ -19,16 +24,16 @@ syscall(int64_t num, int64_t check, int64_t a1, int64_t a2, int64_t a3, int64_t
   // potentially change the condition codes and arbitrary
   // memory locations.
 
-  asm volatile("int %1\n"
-               : "=a"(ret)
-               : "i"(T_SYSCALL),
-                 "a"(num),
-                 "d"(a1),
-                 "c"(a2),
-                 "b"(a3),
-                 "D"(a4),
-                 "S"(a5)
-               : "cc", "memory");
+  ret = num;
+  asm volatile("syscall\n"
+               : "+a"(ret),
+                 "+d"(a1),
+                 "+r"(r10),
+                 "+D"(a4),
+                 "+S"(a5),
+                 "+r"(r8)
+               : "b"(a3)
+               : "rcx", "r9", "r11", "cc", "memory");
 
   if (check && ret > 0)
     panic("syscall %ld returned %ld (> 0)", (long)num, (long)ret);
@@ -38,32 +43,32 @@ syscall(int64_t num, int64_t check, int64_t a1, int64_t a2, int64_t a3, int64_t
 
 void
 sys_cputs(const char *s, size_t len) {
-  syscall(SYS_cputs, 0, (uint64_t)s, len, 0, 0, 0);
+  syscall(SYS_cputs, 0, (uint64_t)s, len, 0, 0, 0, 0);
 }
 
 int
 sys_cgetc(void) {
-  return syscall(SYS_cgetc, 0, 0, 0, 0, 0, 0);
+  return syscall(SYS_cgetc, 0, 0, 0, 0, 0, 0, 0);
 }
 
 int
 sys_env_destroy(envid_t envid) {
-  return syscall(SYS_env_destroy, 1, envid, 0, 0, 0, 0);
+  return syscall(SYS_env_destroy, 1, envid, 0, 0, 0, 0, 0);
 }
 
 envid_t
 sys_getenvid(void) {
-  return syscall(SYS_getenvid, 0, 0, 0, 0, 0, 0);
+  return syscall(SYS_getenvid, 0, 0, 0, 0, 0, 0, 0);
 }
 
 void
 sys_yield(void) {
-  syscall(SYS_yield, 0, 0, 0, 0, 0, 0);
+  syscall(SYS_yield, 0, 0, 0, 0, 0, 0, 0);
 }
 
 int
 sys_page_alloc(envid_t envid, void *va, int perm) {
-  int r = syscall(SYS_page_alloc, 1, envid, (uint64_t)va, perm, 0, 0);
+  int r = syscall(SYS_page_alloc, 1, envid, (uint64_t)va, perm, 0, 0, 0);
 #ifdef SANITIZE_USER_SHADOW_BASE
   // Unpoison the allocated page
   if (!r)
@@ -72,44 +77,100 @@ sys_page_alloc(envid_t envid, void *va, int perm) {
   return r;
 }
 
+int
+sys_page_alloc_huge(envid_t envid, void *va, int perm) {
+  int r = syscall(SYS_page_alloc_huge, 1, envid, (uint64_t)va, perm, 0, 0, 0);
+#ifdef SANITIZE_USER_SHADOW_BASE
+  if (!r)
+    platform_asan_unpoison(va, PTSIZE);
+#endif
+  return r;
+}
+
 int
 sys_page_map(envid_t srcenv, void *srcva, envid_t dstenv, void *dstva, int perm) {
-  return syscall(SYS_page_map, 1, srcenv, (uint64_t)srcva, dstenv, (uint64_t)dstva, perm);
+  return syscall(SYS_page_map, 1, srcenv, (uint64_t)srcva, dstenv, (uint64_t)dstva, perm, 0);
 }
 
 int
 sys_page_unmap(envid_t envid, void *va) {
-  return syscall(SYS_page_unmap, 1, envid, (uint64_t)va, 0, 0, 0);
+  return syscall(SYS_page_unmap, 1, envid, (uint64_t)va, 0, 0, 0, 0);
+}
+
+int
+sys_page_harvest(void *va, size_t npages, uint64_t *bitmap, int flags) {
+  return syscall(SYS_page_harvest, 0, (uint64_t)va, npages, (uint64_t)bitmap, flags, 0, 0);
 }
 
 // sys_exofork is inlined in lib.h
 
+envid_t
+sys_fork_cow(void) {
+  // Returns 0 in the child, so the check is off.
+  return syscall(SYS_fork_cow, 0, 0, 0, 0, 0, 0, 0);
+}
+
 int
 sys_env_set_status(envid_t envid, int status) {
-  return syscall(SYS_env_set_status, 1, envid, status, 0, 0, 0);
+  return syscall(SYS_env_set_status, 1, envid, status, 0, 0, 0, 0);
+}
+
+int
+sys_env_set_priority(envid_t envid, int prio) {
+  return syscall(SYS_env_set_priority, 1, envid, prio, 0, 0, 0, 0);
 }
 
 int
 sys_env_set_trapframe(envid_t envid, struct Trapframe *tf) {
-  return syscall(SYS_env_set_trapframe, 1, envid, (uint64_t)tf, 0, 0, 0);
+  return syscall(SYS_env_set_trapframe, 1, envid, (uint64_t)tf, 0, 0, 0, 0);
 }
 
 int
 sys_env_set_pgfault_upcall(envid_t envid, void *upcall) {
-  return syscall(SYS_env_set_pgfault_upcall, 1, envid, (uint64_t)upcall, 0, 0, 0);
+  return syscall(SYS_env_set_pgfault_upcall, 1, envid, (uint64_t)upcall, 0, 0, 0, 0);
 }
 
 int
 sys_ipc_try_send(envid_t envid, uint64_t value, void *srcva, int perm) {
-  return syscall(SYS_ipc_try_send, 0, envid, value, (uint64_t)srcva, perm, 0);
+  return syscall(SYS_ipc_try_send, 0, envid, value, (uint64_t)srcva, perm, 0, 0);
+}
+
+int
+sys_ipc_send(envid_t envid, uint64_t value, void *srcva, int perm, const struct IpcMsg *msg) {
+  return syscall(SYS_ipc_send, 1, envid, value, (uint64_t)srcva, perm, (uint64_t)msg, 0);
+}
+
+int
+sys_ipc_call(envid_t envid, uint64_t value, void *srcva, int perm, const struct IpcMsg *msg, void *dstva) {
+  return syscall(SYS_ipc_call, 0, envid, value, (uint64_t)srcva, perm, (uint64_t)dstva, (uint64_t)msg);
+}
+
+int
+sys_ipc_reply_wait(envid_t envid, uint64_t value, void *srcva, int perm, const struct IpcMsg *msg, void *dstva) {
+  return syscall(SYS_ipc_reply_wait, 0, envid, value, (uint64_t)srcva, perm, (uint64_t)dstva, (uint64_t)msg);
 }
 
 int
 sys_ipc_recv(void *dstva) {
-  return syscall(SYS_ipc_recv, 1, (uint64_t)dstva, 0, 0, 0, 0);
+  return syscall(SYS_ipc_recv, 1, (uint64_t)dstva, 0, 0, 0, 0, 0);
+}
+
+int
+sys_ipc_timeout(unsigned secs) {
+  return syscall(SYS_ipc_timeout, 0, secs, 0, 0, 0, 0, 0);
+}
+
+int
+sys_irq_listen(unsigned irq, uint16_t stopport) {
+  return syscall(SYS_irq_listen, 1, irq, stopport, 0, 0, 0, 0);
+}
+
+int
+sys_irq_wait(unsigned irq) {
+  return syscall(SYS_irq_wait, 1, irq, 0, 0, 0, 0, 0);
 }
 
 int
 sys_gettime(void) {
-  return syscall(SYS_gettime, 0, 0, 0, 0, 0, 0);
+  return syscall(SYS_gettime, 0, 0, 0, 0, 0, 0, 0);
 }
@@ -0,0 +1,109 @@
+// Measure the cost of a copy-on-write fault.
+//
+// The kernel resolves COW faults in page_fault_handler.  For comparison,
+// the same copies are also made the old way, by a user page fault handler
+// that makes three system calls per fault.  Then a forktree-style tree
+// of processes dirties a buffer after every fork.  Each child must see
+// its own writes, and no parent a child's.
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+#define NPAGES 64
+#define DEPTH  3
+
+static char buf[NPAGES * PGSIZE] __attribute__((aligned(PGSIZE)));
+
+static uint64_t
+dirty_pages(void) {
+  uint64_t start = read_tsc();
+  int i;
+
+  for (i = 0; i < NPAGES; i++)
+    buf[i * PGSIZE]++;
+  return (read_tsc() - start) / NPAGES;
+}
+
+// Check that every page of buf starts with 'val'.
+static void
+check_pages(char val) {
+  int i;
+
+  for (i = 0; i < NPAGES; i++)
+    if (buf[i * PGSIZE] != val)
+      panic("%04x: page %d holds %d, not %d", sys_getenvid(), i, buf[i * PGSIZE], val);
+}
+
+// The copy lib/fork.c made before the kernel handled COW faults.
+static void
+user_copy_handler(struct UTrapframe *utf) {
+  void *addr = ROUNDDOWN((void *)utf->utf_fault_va, PGSIZE);
+  int r;
+
+  if (!(utf->utf_err & FEC_WR))
+    panic("unexpected fault at %lx", (unsigned long)utf->utf_fault_va);
+  if ((r = sys_page_alloc(0, (void *)PFTEMP, PTE_W)) < 0)
+    panic("sys_page_alloc: %i", r);
+  memmove((void *)PFTEMP, addr, PGSIZE);
+  if ((r = sys_page_map(0, (void *)PFTEMP, 0, addr, PTE_W)) < 0)
+    panic("sys_page_map: %i", r);
+  if ((r = sys_page_unmap(0, (void *)PFTEMP)) < 0)
+    panic("sys_page_unmap: %i", r);
+}
+
+static void
+forktree(int depth) {
+  char val = buf[0];
+  envid_t child;
+  int i;
+
+  for (i = 0; i < 2 && depth < DEPTH; i++) {
+    if ((child = fork()) < 0)
+      panic("fork: %i", child);
+    if (!child) {
+      cprintf("%04x: depth %d, %lu cycles/fault\n",
+              sys_getenvid(), depth + 1, (unsigned long)dirty_pages());
+      check_pages(val + 1);
+      forktree(depth + 1);
+      exit();
+    }
+    wait(child);
+    check_pages(val);
+  }
+}
+
+void
+umain(int argc, char **argv) {
+  envid_t child;
+  int i, r;
+
+  memset(buf, 1, sizeof(buf));
+
+  if ((child = fork()) < 0)
+    panic("fork: %i", child);
+  if (!child) {
+    cprintf("in-kernel COW fault: %lu cycles/fault\n", (unsigned long)dirty_pages());
+    check_pages(2);
+    exit();
+  }
+  wait(child);
+  check_pages(1);
+
+  if ((child = fork()) < 0)
+    panic("fork: %i", child);
+  if (!child) {
+    // Read-only without PTE_COW, so the kernel forwards the faults.
+    set_pgfault_handler(user_copy_handler);
+    for (i = 0; i < NPAGES; i++)
+      if ((r = sys_page_map(0, buf + i * PGSIZE, 0, buf + i * PGSIZE, PTE_P | PTE_U)) < 0)
+        panic("sys_page_map: %i", r);
+    cprintf("user upcall COW fault: %lu cycles/fault\n", (unsigned long)dirty_pages());
+    check_pages(2);
+    exit();
+  }
+  wait(child);
+  check_pages(1);
+
+  forktree(0);
+  cprintf("cowbench is good\n");
+}
@@ -0,0 +1,87 @@
+// Measure the round-trip latency of IPC.
+//
+// A client makes ROUNDS requests to a server, first with separate
+// ipc_send and ipc_recv calls on both sides, four system calls per
+// round trip, then with ipc_call and ipc_reply_wait, two system calls
+// that hand the CPU straight to the other side.  Last, a server exits
+// without replying, which has to fail the call.
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+#define ROUNDS 10000
+
+static void
+send_recv_server(void) {
+  envid_t whom;
+  int32_t v;
+
+  for (;;) {
+    v = ipc_recv(&whom, NULL, NULL);
+    ipc_send(whom, v + 1, NULL, 0);
+  }
+}
+
+static void
+call_reply_server(void) {
+  envid_t whom = 0;
+  int32_t v = 0;
+
+  for (;;)
+    v = ipc_reply_wait(whom, v + 1, NULL, 0, NULL, &whom, NULL, NULL);
+}
+
+static void
+exit_server(void) {
+  ipc_recv(NULL, NULL, NULL);
+}
+
+static void
+run(const char *name, void (*server)(void), bool call) {
+  envid_t srv;
+  uint64_t start;
+  int32_t v;
+  int i;
+
+  if ((srv = fork()) < 0)
+    panic("fork: %i", srv);
+  if (!srv) {
+    server();
+    exit();
+  }
+
+  start = read_tsc();
+  for (i = 0; i < ROUNDS; i++) {
+    if (call) {
+      v = ipc_call(srv, i, NULL, 0, NULL, NULL, NULL);
+    } else {
+      ipc_send(srv, i, NULL, 0);
+      v = ipc_recv(NULL, NULL, NULL);
+    }
+    if (v != i + 1)
+      panic("%s: got %d, want %d", name, v, i + 1);
+  }
+  cprintf("%s: %lu cycles/round trip\n", name, (unsigned long)((read_tsc() - start) / ROUNDS));
+  sys_env_destroy(srv);
+}
+
+void
+umain(int argc, char **argv) {
+  envid_t srv;
+  int32_t v;
+
+  run("ipc_send+ipc_recv", send_recv_server, 0);
+  run("ipc_call+ipc_reply_wait", call_reply_server, 1);
+
+  if ((srv = fork()) < 0)
+    panic("fork: %i", srv);
+  if (!srv) {
+    exit_server();
+    exit();
+  }
+  if ((v = ipc_call(srv, 0, NULL, 0, NULL, NULL, NULL)) != -E_BAD_ENV)
+    panic("call to a server that exits: %i", v);
+  if ((v = ipc_call(srv, 0, NULL, 0, NULL, NULL, NULL)) != -E_BAD_ENV)
+    panic("call to a server that is gone: %i", v);
+  cprintf("ipcbench is good\n");
+}
@@ -0,0 +1,44 @@
+// Measure the round trip of a system call that does nothing:
+// sys_getenvid through the syscall/sysretq fast path, and the same
+// call through the old int $T_SYSCALL/iretq path.
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+#define NCALLS 100000
+
+static envid_t
+getenvid_int(void) {
+  envid_t ret;
+  asm volatile("int %1"
+               : "=a"(ret)
+               : "i"(T_SYSCALL), "a"(SYS_getenvid)
+               : "cc", "memory");
+  return ret;
+}
+
+void
+umain(int argc, char **argv) {
+  uint64_t start, fast, slow;
+  int i, r;
+
+  if (getenvid_int() != sys_getenvid())
+    panic("the two system call paths disagree");
+  // Errors come back through sysretq too.
+  if ((r = sys_page_alloc(0, (void *)UTOP, PTE_P | PTE_U)) != -E_INVAL)
+    panic("sys_page_alloc above UTOP: %i", r);
+
+  start = read_tsc();
+  for (i = 0; i < NCALLS; i++)
+    sys_getenvid();
+  fast = (read_tsc() - start) / NCALLS;
+
+  start = read_tsc();
+  for (i = 0; i < NCALLS; i++)
+    getenvid_int();
+  slow = (read_tsc() - start) / NCALLS;
+
+  cprintf("syscall/sysretq: %lu cycles per call\n", (unsigned long)fast);
+  cprintf("int/iretq:       %lu cycles per call\n", (unsigned long)slow);
+  cprintf("nullsyscall is good\n");
+}
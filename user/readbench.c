@@ -0,0 +1,93 @@
+// Measure sequential file read throughput.
+//
+// A 1MB file is written once, then read back with several buffer
+// sizes, and each read back is checked.  Page-aligned reads of a page
+// or more get the file server's block-cache pages mapped
+// (FSREQ_READ_MAP); smaller or unaligned ones are copied through the
+// IPC page or FSREADBUF.  A forked child reads the file again, after
+// fork has made FSREADBUF copy-on-write.  The file server's block-cache
+// counters are printed at the end.
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+#define FILESIZE (1024 * 1024)
+
+static char buf[FILESIZE] __attribute__((aligned(PGSIZE)));
+
+// Read the file from 'start' on into buf, 'bufsize' bytes at a time,
+// and check what arrived.  Returns the cycles per KB.
+static uint64_t
+read_file(const char *path, size_t bufsize, off_t start) {
+  uint64_t t;
+  size_t total = 0;
+  int fd, n, i;
+
+  memset(buf, 0, sizeof(buf));
+  if ((fd = open(path, O_RDONLY)) < 0)
+    panic("open %s: %i", path, fd);
+  if (start && (n = readn(fd, buf, start)) != start)
+    panic("read %s: %i", path, n);
+  t = read_tsc();
+  while ((n = read(fd, buf + total, MIN(bufsize, FILESIZE - start - total))) > 0)
+    total += n;
+  if (n < 0)
+    panic("read %s: %i", path, n);
+  t = read_tsc() - t;
+  close(fd);
+  if (total != FILESIZE - start)
+    panic("read %lu bytes of %lu", (unsigned long)total, (unsigned long)(FILESIZE - start));
+  for (i = 0; i < total; i++)
+    if (buf[i] != (char)(start + i))
+      panic("%lu-byte reads: byte %ld is %d", (unsigned long)bufsize, (long)(start + i), buf[i]);
+  return t / (total / 1024);
+}
+
+static void
+bench(const char *path, size_t bufsize, off_t start) {
+  uint64_t t = read_file(path, bufsize, start);
+
+  cprintf("%7lu-byte reads%s: %lu cycles/KB\n", (unsigned long)bufsize,
+          start ? ", unaligned" : "", (unsigned long)t);
+}
+
+void
+umain(int argc, char **argv) {
+  const char *path = "/readbench";
+  struct BcStat st;
+  envid_t child;
+  int fd, r, i;
+
+  for (i = 0; i < FILESIZE; i++)
+    buf[i] = i;
+  if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC)) < 0)
+    panic("open %s: %i", path, fd);
+  for (i = 0; i < FILESIZE; i += r)
+    if ((r = write(fd, buf + i, MIN(FILESIZE - i, 2048))) <= 0)
+      panic("write %s: %i", path, r);
+  close(fd);
+
+  bench(path, 512, 0);
+  bench(path, PGSIZE, 0);
+  bench(path, 64 * 1024, 0);
+  bench(path, FILESIZE, 0);
+  bench(path, 64 * 1024, 100);
+
+  if ((child = fork()) < 0)
+    panic("fork: %i", child);
+  if (!child) {
+    read_file(path, 64 * 1024, 100);
+    exit();
+  }
+  wait(child);
+  read_file(path, 64 * 1024, 100);
+  cprintf("readbench is good\n");
+
+  if ((r = bcstat(&st)) < 0)
+    panic("bcstat: %i", r);
+  cprintf("block cache: %lu hits, %lu misses, %lu evictions, "
+          "%lu blocks read ahead in %lu reads\n",
+          (unsigned long)st.bs_hits, (unsigned long)st.bs_misses,
+          (unsigned long)st.bs_evictions, (unsigned long)st.bs_ra_blocks,
+          (unsigned long)st.bs_ra_reads);
+}
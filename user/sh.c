@@ -10,7 +10,7 @@
 // tokens from the string.
 int gettoken(char *s, char **token);
 
-union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
+extern union Fsipc fsipcbuf;
 // Parse a shell command from string 's' and execute it.
 // Do not return until the shell command is finished.
 // runcmd() is called in a forked child,
@@ -24,8 +24,7 @@ runcmd(char *s) {
     cprintf("Sending ipc with snapshot from cmd...\n");
     envid_t fsenv = ipc_find_env(ENV_TYPE_FS);
     strcpy(fsipcbuf.file_snapshot.cmd, s);
-    ipc_send(fsenv, FSREQ_SNPSHT, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-    ipc_recv(NULL, &fsipcbuf,NULL);
+    ipc_call(fsenv, FSREQ_SNPSHT, &fsipcbuf, PTE_P | PTE_W | PTE_U, NULL, &fsipcbuf, NULL);
     exit();
   }
   if (!strncmp(s,"defrag",6))
@@ -33,8 +32,7 @@ runcmd(char *s) {
     cprintf("Sending ipc with defrag from cmd...\n");
     envid_t fsenv = ipc_find_env(ENV_TYPE_FS);
     strcpy(fsipcbuf.dfrg.cmd, s);
-    ipc_send(fsenv, FSREQ_DFRG, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-    ipc_recv(NULL, &fsipcbuf,NULL);
+    ipc_call(fsenv, FSREQ_DFRG, &fsipcbuf, PTE_P | PTE_W | PTE_U, NULL, &fsipcbuf, NULL);
     exit();
   }
   if (!strncmp(s,"test_defrag", 11))
@@ -42,8 +40,7 @@ runcmd(char *s) {
     cprintf("Sending ipc with test_defrag from cmd...\n");
     envid_t fsenv = ipc_find_env(ENV_TYPE_FS);
     strcpy(fsipcbuf.test_dfrg.cmd, s);
-    ipc_send(fsenv, FSREQ_TSTDFRG, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-    ipc_recv(NULL, &fsipcbuf,NULL);
+    ipc_call(fsenv, FSREQ_TSTDFRG, &fsipcbuf, PTE_P | PTE_W | PTE_U, NULL, &fsipcbuf, NULL);
     exit();
   }
   char *argv[MAXARGS], *t, argv0buf[BUFSIZ];
@@ -166,8 +163,7 @@ runit:
     cprintf("Here!!!\n");
     envid_t fsenv = ipc_find_env(ENV_TYPE_FS);
     strcpy(fsipcbuf.file_snapshot.cmd, s);
-    ipc_send(fsenv, FSREQ_SNPSHT, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-    ipc_recv(NULL, &fsipcbuf,NULL);
+    ipc_call(fsenv, FSREQ_SNPSHT, &fsipcbuf, PTE_P | PTE_W | PTE_U, NULL, &fsipcbuf, NULL);
     exit();
   } */
 
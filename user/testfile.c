@@ -13,8 +13,7 @@ xopen(const char *path, int mode) {
   fsipcbuf.open.req_omode = mode;
 
   fsenv = ipc_find_env(ENV_TYPE_FS);
-  ipc_send(fsenv, FSREQ_OPEN, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-  return ipc_recv(NULL, FVA, NULL);
+  return ipc_call(fsenv, FSREQ_OPEN, &fsipcbuf, PTE_P | PTE_W | PTE_U, NULL, FVA, NULL);
 }
 
 void
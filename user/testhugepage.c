@@ -0,0 +1,64 @@
+// test 2MB pages: allocation, mapping them elsewhere, and fork, which
+// copies private ones and shares PTE_SHARE ones
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+#define VA  ((char *)0x10000000)
+#define VA2 ((char *)0x10400000)
+
+void
+umain(int argc, char **argv) {
+  int r;
+
+  if ((r = sys_page_alloc_huge(0, VA, PTE_P | PTE_W | PTE_U)) < 0)
+    panic("sys_page_alloc_huge: %i", r);
+  if (!(uvpd[VPD(VA)] & PTE_PS))
+    panic("%p is not mapped with a 2MB page", VA);
+
+  // the page comes zeroed and is backed all the way through
+  if (VA[0] || VA[PTSIZE - 1])
+    panic("2MB page is not zeroed");
+  VA[0]          = 'a';
+  VA[PTSIZE - 1] = 'z';
+
+  // misaligned requests are refused
+  if ((r = sys_page_alloc_huge(0, VA + PGSIZE, PTE_P | PTE_W | PTE_U)) != -E_INVAL)
+    panic("sys_page_alloc_huge at misaligned va: %i", r);
+  if ((r = sys_page_map(0, VA, 0, VA2 + PGSIZE, PTE_P | PTE_W | PTE_U)) != -E_INVAL)
+    panic("sys_page_map of a 2MB page to misaligned va: %i", r);
+
+  // a second mapping sees the same memory
+  if ((r = sys_page_map(0, VA, 0, VA2, PTE_P | PTE_W | PTE_U)) < 0)
+    panic("sys_page_map: %i", r);
+  if (VA2[0] != 'a' || VA2[PTSIZE - 1] != 'z')
+    panic("2MB page mapped twice has different contents");
+  sys_page_unmap(0, VA2);
+
+  // fork gives the child its own copy of a private 2MB page, and
+  // shares a PTE_SHARE one
+  if ((r = sys_page_alloc_huge(0, VA2, PTE_P | PTE_W | PTE_U | PTE_SHARE)) < 0)
+    panic("sys_page_alloc_huge: %i", r);
+  if ((r = fork()) < 0)
+    panic("fork: %i", r);
+  if (r == 0) {
+    if (VA[0] != 'a' || VA[PTSIZE - 1] != 'z')
+      panic("child's copy of the 2MB page has different contents");
+    VA[PTSIZE / 2]  = 'm';
+    VA2[PTSIZE / 2] = 's';
+    exit();
+  }
+  wait(r);
+  if (VA[PTSIZE / 2])
+    panic("child's write reached the parent's private 2MB page");
+  if (VA2[PTSIZE / 2] != 's')
+    panic("fork does not share PTE_SHARE 2MB pages");
+  sys_page_unmap(0, VA2);
+
+  // unmapping any address within the page drops all of it
+  sys_page_unmap(0, VA + PTSIZE / 2);
+  if (uvpd[VPD(VA)] & PTE_P)
+    panic("2MB page still mapped after sys_page_unmap");
+
+  cprintf("testhugepage is good\n");
+}
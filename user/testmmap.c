@@ -0,0 +1,102 @@
+// Test mmap() of files.
+//
+// A private mapping sees the file and keeps its own writes to itself.
+// Writes through a shared mapping reach the file and a forked child.
+// read() sees them after sync(), which leaves the mappings shared, and
+// after munmap().
+
+#include <inc/lib.h>
+
+#define NPAGES 40
+#define FILESIZE (NPAGES * PGSIZE - 100)
+
+static char buf[NPAGES * PGSIZE];
+
+static void
+check_file(const char *path, char (*expect)(int i)) {
+  int fd, n, i;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    panic("open %s: %i", path, fd);
+  if ((n = readn(fd, buf, sizeof(buf))) != FILESIZE)
+    panic("read %s: %i", path, n);
+  close(fd);
+  for (i = 0; i < FILESIZE; i++)
+    if (buf[i] != expect(i))
+      panic("%s: byte %d is %d, not %d", path, i, buf[i], expect(i));
+}
+
+static char
+pattern(int i) {
+  return i * 7;
+}
+
+static char
+written(int i) {
+  return i % PGSIZE == 5 ? 'x' : pattern(i);
+}
+
+void
+umain(int argc, char **argv) {
+  const char *path = "/testmmap";
+  envid_t child;
+  char *p, *q;
+  int fd, r, i;
+
+  for (i = 0; i < FILESIZE; i++)
+    buf[i] = pattern(i);
+  if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC)) < 0)
+    panic("open %s: %i", path, fd);
+  if ((r = write(fd, buf, FILESIZE)) != FILESIZE)
+    panic("write %s: %i", path, r);
+
+  if (!(p = mmap(fd, 0, FILESIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE)))
+    panic("mmap private failed");
+  for (i = 0; i < FILESIZE; i++)
+    if (p[i] != pattern(i))
+      panic("private mapping: byte %d is %d", i, p[i]);
+  p[PGSIZE] = 'p';
+  if ((r = munmap(p, FILESIZE)) < 0)
+    panic("munmap: %i", r);
+  check_file(path, pattern);
+  cprintf("private mapping is good\n");
+
+  if (!(p = mmap(fd, PGSIZE, FILESIZE - PGSIZE, PROT_READ, MAP_SHARED)))
+    panic("mmap read-only failed");
+  if (!(q = mmap(fd, 0, FILESIZE, PROT_READ | PROT_WRITE, MAP_SHARED)))
+    panic("mmap shared failed");
+  close(fd);
+  for (i = 5; i < FILESIZE; i += PGSIZE)
+    q[i] = 'x';
+  // Both mappings share the block-cache pages.
+  if (p[5] != 'x')
+    panic("read-only mapping does not see the write");
+
+  if ((child = fork()) < 0)
+    panic("fork: %i", child);
+  if (!child) {
+    if (q[PGSIZE + 5] != 'x')
+      panic("child does not see the write");
+    q[2 * PGSIZE + 5] = 'c';
+    exit();
+  }
+  wait(child);
+  if (q[2 * PGSIZE + 5] != 'c')
+    panic("parent does not see the child's write");
+  q[2 * PGSIZE + 5] = 'x';
+
+  if ((r = sync()) < 0)
+    panic("sync: %i", r);
+  check_file(path, written);
+  q[PGSIZE + 6] = 'y';
+  if (p[6] != 'y')
+    panic("mappings are not shared after sync");
+  q[PGSIZE + 6] = pattern(PGSIZE + 6);
+
+  if ((r = munmap(q, FILESIZE)) < 0)
+    panic("munmap: %i", r);
+  if ((r = munmap(p, FILESIZE - PGSIZE)) < 0)
+    panic("munmap: %i", r);
+  check_file(path, written);
+  cprintf("shared mapping is good\n");
+}
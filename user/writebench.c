@@ -0,0 +1,116 @@
+// Measure sequential file write throughput.
+//
+// A 1MB file is written with several buffer sizes, and read back to
+// check it.  Page-aligned writes of whole pages donate the pages to the
+// file server copy-on-write (FSREQ_WRITE_MAP); smaller or unaligned
+// ones are copied through the IPC page.  Writing to the buffer after
+// write() must not change the file.  Pages the kernel won't donate,
+// read-only ones and mmap()ed ones, have to be copied instead.
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+#define FILESIZE (1024 * 1024)
+#define NRDONLY  16
+
+static char buf[FILESIZE + PGSIZE] __attribute__((aligned(PGSIZE)));
+static char check[FILESIZE] __attribute__((aligned(PGSIZE)));
+
+static char
+pattern(int i) {
+  return i * 7;
+}
+
+// Write 'size' bytes from 'src' to 'path', 'bufsize' bytes at a time.
+// Returns the cycles it took.
+static uint64_t
+write_file(const char *path, const char *src, size_t size, size_t bufsize) {
+  size_t total;
+  uint64_t t;
+  int fd, n;
+
+  if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC)) < 0)
+    panic("open %s: %i", path, fd);
+  t = read_tsc();
+  for (total = 0; total < size; total += n)
+    if ((n = write(fd, src + total, MIN(bufsize, size - total))) <= 0)
+      panic("write %s: %i", path, n);
+  t = read_tsc() - t;
+  close(fd);
+  return t;
+}
+
+// Read 'path', which must be 'size' bytes long, into check.
+static void
+read_file(const char *path, size_t size) {
+  int fd, n;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    panic("open %s: %i", path, fd);
+  if ((n = readn(fd, check, FILESIZE)) != size)
+    panic("read %s: %i", path, n);
+  close(fd);
+}
+
+// Check that 'path' holds the 'size' bytes at 'expect'.
+static void
+check_file(const char *path, const char *expect, size_t size) {
+  read_file(path, size);
+  if (memcmp(check, expect, size))
+    panic("%s does not read back what was written", path);
+}
+
+static void
+bench(const char *path, size_t bufsize, size_t misalign) {
+  char *src = buf + misalign;
+  uint64_t t;
+  int i;
+
+  for (i = 0; i < sizeof(buf); i++)
+    buf[i] = pattern(i);
+  t = write_file(path, src, FILESIZE, bufsize);
+  check_file(path, src, FILESIZE);
+
+  // The donated pages are copy-on-write: this must not reach the file.
+  memset(buf, 0, sizeof(buf));
+  read_file(path, FILESIZE);
+  for (i = 0; i < FILESIZE; i++)
+    if (check[i] != pattern(misalign + i))
+      panic("%s: byte %d is %d after the buffer changed", path, i, check[i]);
+
+  cprintf("%7lu-byte writes%s: %lu cycles/KB\n", (unsigned long)bufsize,
+          misalign ? ", unaligned" : "", (unsigned long)(t / (FILESIZE / 1024)));
+}
+
+void
+umain(int argc, char **argv) {
+  const char *path = "/writebench";
+  char *p;
+  int fd, r, i;
+
+  bench(path, 2048, 0);
+  bench(path, PGSIZE, 0);
+  bench(path, 64 * 1024, 0);
+  bench(path, FILESIZE, 0);
+  bench(path, 64 * 1024, 100);
+
+  for (i = 0; i < sizeof(buf); i++)
+    buf[i] = pattern(i);
+  for (i = 0; i < NRDONLY; i++)
+    if ((r = sys_page_map(0, buf + i * PGSIZE, 0, buf + i * PGSIZE, PTE_P | PTE_U)) < 0)
+      panic("sys_page_map: %i", r);
+  write_file("/writebench2", buf, NRDONLY * PGSIZE, NRDONLY * PGSIZE);
+  check_file("/writebench2", buf, NRDONLY * PGSIZE);
+
+  // The block-cache pages of an mmap() are mapped by the server too.
+  if ((fd = open(path, O_RDONLY)) < 0)
+    panic("open %s: %i", path, fd);
+  if (!(p = mmap(fd, 0, FILESIZE, PROT_READ | PROT_WRITE, MAP_SHARED)))
+    panic("mmap %s failed", path);
+  close(fd);
+  write_file("/writebench2", p, FILESIZE, FILESIZE);
+  check_file("/writebench2", p, FILESIZE);
+  if ((r = munmap(p, FILESIZE)) < 0)
+    panic("munmap: %i", r);
+  cprintf("writebench is good\n");
+}